@@ -0,0 +1,74 @@
+#pragma once
+
+// 手寫字處理核心的嵌入用 API（HandwritingCore 函式庫、Python 的 hwcore 模組都用這份）。
+// 不含 GUI、沒有全域狀態：每次呼叫的輸入輸出都由參數帶進來，多個執行緒可以同時呼叫；
+// 影像用 view 描述（指標 + 大小 + 每列 bytes），直接讀寫呼叫端的記憶體，不複製。
+// 錯誤以回傳 false 表示，原因寫進 error（可以是 nullptr）
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace hwcore
+{
+
+// 8-bit 影像；channels 為 3（BGR）或 1（遮罩）
+struct ImageView
+{
+    const uint8_t *data = nullptr;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0; // 每列 bytes，0 表示緊密排列
+    int channels = 3;
+};
+
+// 呼叫端配置好的 8-bit 單通道輸出
+struct MaskView
+{
+    uint8_t *data = nullptr;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0;
+};
+
+// 二值化設定，JSON 格式與 imgBinHistory.json 的一筆相同
+// （name, color_space, enable_binary, rgb_threshold, hsl_threshold, hsv_threshold, adaptive_threshold）
+struct InkMaskOptions
+{
+    std::string setting_json;
+    int open_size = 0;  // 與 --open / --close / --despeckle 相同
+    int close_size = 0;
+    int min_area = 0;
+};
+
+// 墨跡遮罩（255 = 墨跡）直接寫進 ink，大小必須與 bgr 相同
+bool computeInkMask(const ImageView &bgr, const InkMaskOptions &options, const MaskView &ink, std::string *error = nullptr);
+
+struct ClusterOptions
+{
+    double radius = 5.0;
+    bool merge_strokes = false; // 與 --merge-strokes 相同，把筆畫併成整個字
+};
+
+// 叢集結果，全部是扁平陣列：
+// 第 c 個叢集的點為 points[indices[offsets[c] .. offsets[c + 1])]
+struct ClusterResult
+{
+    std::vector<int32_t> points;    // x0, y0, x1, y1, ...
+    std::vector<int32_t> offsets;   // cluster_count + 1
+    std::vector<int32_t> indices;
+    std::vector<int32_t> boxes;     // 每個叢集 x, y, width, height
+    std::vector<float> centroids;   // 每個叢集 cx, cy
+    std::vector<int32_t> sizes;     // 每個叢集的點數
+
+    size_t clusterCount() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+};
+
+// 從遮罩（非 0 = 墨跡）取出墨跡點並做叢集
+bool clusterInkMask(const ImageView &ink, const ClusterOptions &options, ClusterResult &result, std::string *error = nullptr);
+
+// 解析設定並以完整欄位重新輸出（可用來先檢查設定，或與 GUI / 批次的 JSON 比對）
+bool normalizeSetting(const std::string &setting_json, std::string &normalized, std::string *error = nullptr);
+
+} // namespace hwcore
@@ -18,35 +18,100 @@
 #include <windows.h> //do not remove
 #include <io.h>      //do not remove
 #include <fcntl.h>   //do not remove
+#include <process.h>
 #endif
 
 #include <opencv2/opencv.hpp>   //do not remove
+// HW_CORE_LIBRARY：編成 HandwritingCore 函式庫，不含 GUI（OpenGL、ImGui、GLFW）與 main
+// HW_NO_GUI：只有命令列模式（--batch、--worker、--serve、--cluster-json）的執行檔，不需要 OpenGL、ImGui、GLFW
+#if !defined(HW_CORE_LIBRARY) && !defined(HW_NO_GUI)
+#define HW_WITH_GUI
+#endif
+#ifdef HW_WITH_GUI
 #include <GL/glew.h>            //do not remove - must be included before other OpenGL headers
 #define IMGUI_DEFINE_MATH_OPERATORS
 #include <imgui.h>              //do not remove
 #include <imgui_impl_glfw.h>    //do not remove
 #include <imgui_impl_opengl3.h> //do not remove
 #include <GLFW/glfw3.h>         //do not remove
+#endif
 
 #include <numeric>
 #include <unordered_map>
+#include <unordered_set>
 #include <thread>
 #include <mutex>
 #include <random>
 #include <atomic>
 #include <fstream>
+#include <climits>
+#include <cfloat>
+#include <cmath>
+#include <deque>
+#include <condition_variable>
+#include <chrono>
+#include <memory_resource>
+#include <span>
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+#include <array>
+#include <list>
+#include <optional>
+#include <ctime>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
 #include <json/json.h>
+#include "handwriting_core.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef HW_HAVE_LIBWEBP
+#include <webp/decode.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <csignal>
+#include <spawn.h>
+#include <sys/wait.h>
+extern char **environ;
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
 
 using namespace std; // do not remove
 
+// 編成 HandwritingCore 時只匯出 hwcore::（handwriting_core.h），其他實作都放進匿名命名空間，
+// 不會跟嵌入端或其他函式庫的同名符號衝突；一般執行檔與檢查程式照舊
+#ifdef HW_CORE_LIBRARY
+namespace
+{
+#endif
+
+#ifdef HW_WITH_GUI
 /**
  * global variables for binary thresholding
  */
-static int color_space = 1; // 0=RGB, 1=HSL, 2=HSV
+static int color_space = 1; // 0=RGB, 1=HSL, 2=HSV, 3=Adaptive (Sauvola), 4=Adaptive (Niblack)
 static float rgb_threshold[3] = {128.0f, 128.0f, 128.0f};
 static float hsl_threshold[3] = {0.0f, 0.0f, 68.0f};
 static float hsv_threshold[3] = {180.0f, 50.0f, 50.0f};
+static float adaptive_threshold[3] = {31.0f, 0.2f, 128.0f}; // window size, k, R (dynamic range, Sauvola only)
 cv::Mat image;
+#endif
 
 // Binary threshold setting structure
 struct BinaryThresholdSetting {
@@ -55,12 +120,14 @@ struct BinaryThresholdSetting {
     float rgb_threshold[3];
     float hsl_threshold[3];
     float hsv_threshold[3];
+    float adaptive_threshold[3];
     bool enable_binary;
     
     BinaryThresholdSetting() : color_space(1), enable_binary(false) {
         rgb_threshold[0] = rgb_threshold[1] = rgb_threshold[2] = 128.0f;
         hsl_threshold[0] = 0.0f; hsl_threshold[1] = 0.0f; hsl_threshold[2] = 68.0f;
         hsv_threshold[0] = 180.0f; hsv_threshold[1] = 50.0f; hsv_threshold[2] = 50.0f;
+        adaptive_threshold[0] = 31.0f; adaptive_threshold[1] = 0.2f; adaptive_threshold[2] = 128.0f;
     }
 };
 
@@ -84,38 +151,82 @@ string getDocumentPath() {
 #endif
 }
 
-// Function to save binary threshold settings
-void saveBinaryThresholdSettings(const vector<BinaryThresholdSetting>& settings) {
-    Json::Value root(Json::arrayValue);
+// Function to convert one binary threshold setting to JSON
+Json::Value binaryThresholdSettingToJson(const BinaryThresholdSetting& setting) {
+    Json::Value item;
+    item["name"] = setting.name;
+    item["color_space"] = setting.color_space;
+    item["enable_binary"] = setting.enable_binary;
     
-    for (const auto& setting : settings) {
-        Json::Value item;
-        item["name"] = setting.name;
-        item["color_space"] = setting.color_space;
-        item["enable_binary"] = setting.enable_binary;
-        
-        Json::Value rgb(Json::arrayValue);
+    Json::Value rgb(Json::arrayValue);
+    for (int i = 0; i < 3; ++i) {
+        rgb.append(setting.rgb_threshold[i]);
+    }
+    item["rgb_threshold"] = rgb;
+    
+    Json::Value hsl(Json::arrayValue);
+    for (int i = 0; i < 3; ++i) {
+        hsl.append(setting.hsl_threshold[i]);
+    }
+    item["hsl_threshold"] = hsl;
+    
+    Json::Value hsv(Json::arrayValue);
+    for (int i = 0; i < 3; ++i) {
+        hsv.append(setting.hsv_threshold[i]);
+    }
+    item["hsv_threshold"] = hsv;
+    
+    Json::Value adaptive(Json::arrayValue);
+    for (int i = 0; i < 3; ++i) {
+        adaptive.append(setting.adaptive_threshold[i]);
+    }
+    item["adaptive_threshold"] = adaptive;
+    
+    return item;
+}
+
+// Function to read one binary threshold setting from JSON
+BinaryThresholdSetting binaryThresholdSettingFromJson(const Json::Value& item) {
+    BinaryThresholdSetting setting;
+    setting.name = item["name"].asString();
+    setting.color_space = item["color_space"].asInt();
+    setting.enable_binary = item["enable_binary"].asBool();
+    
+    if (item["rgb_threshold"].isArray() && item["rgb_threshold"].size() == 3) {
+        for (int i = 0; i < 3; ++i) {
+            setting.rgb_threshold[i] = item["rgb_threshold"][i].asFloat();
+        }
+    }
+    
+    if (item["hsl_threshold"].isArray() && item["hsl_threshold"].size() == 3) {
         for (int i = 0; i < 3; ++i) {
-            rgb.append(setting.rgb_threshold[i]);
+            setting.hsl_threshold[i] = item["hsl_threshold"][i].asFloat();
         }
-        item["rgb_threshold"] = rgb;
-        
-        Json::Value hsl(Json::arrayValue);
+    }
+    
+    if (item["hsv_threshold"].isArray() && item["hsv_threshold"].size() == 3) {
         for (int i = 0; i < 3; ++i) {
-            hsl.append(setting.hsl_threshold[i]);
+            setting.hsv_threshold[i] = item["hsv_threshold"][i].asFloat();
         }
-        item["hsl_threshold"] = hsl;
-        
-        Json::Value hsv(Json::arrayValue);
+    }
+    
+    if (item["adaptive_threshold"].isArray() && item["adaptive_threshold"].size() == 3) {
         for (int i = 0; i < 3; ++i) {
-            hsv.append(setting.hsv_threshold[i]);
+            setting.adaptive_threshold[i] = item["adaptive_threshold"][i].asFloat();
         }
-        item["hsv_threshold"] = hsv;
-        
-        root.append(item);
     }
     
-    string filePath = getDocumentPath();
+    return setting;
+}
+
+// Function to save binary threshold settings
+void saveBinaryThresholdSettings(const vector<BinaryThresholdSetting>& settings, const string& filePath = getDocumentPath()) {
+    Json::Value root(Json::arrayValue);
+    
+    for (const auto& setting : settings) {
+        root.append(binaryThresholdSettingToJson(setting));
+    }
+    
     ofstream file(filePath);
     if (file.is_open()) {
         Json::StreamWriterBuilder builder;
@@ -129,9 +240,8 @@ void saveBinaryThresholdSettings(const vector<BinaryThresholdSetting>& settings)
 }
 
 // Function to load binary threshold settings
-vector<BinaryThresholdSetting> loadBinaryThresholdSettings() {
+vector<BinaryThresholdSetting> loadBinaryThresholdSettings(const string& filePath = getDocumentPath()) {
     vector<BinaryThresholdSetting> settings;
-    string filePath = getDocumentPath();
     
     ifstream file(filePath);
     if (!file.is_open()) {
@@ -145,30 +255,7 @@ vector<BinaryThresholdSetting> loadBinaryThresholdSettings() {
     
     if (Json::parseFromStream(builder, file, &root, &errors)) {
         for (const auto& item : root) {
-            BinaryThresholdSetting setting;
-            setting.name = item["name"].asString();
-            setting.color_space = item["color_space"].asInt();
-            setting.enable_binary = item["enable_binary"].asBool();
-            
-            if (item["rgb_threshold"].isArray() && item["rgb_threshold"].size() == 3) {
-                for (int i = 0; i < 3; ++i) {
-                    setting.rgb_threshold[i] = item["rgb_threshold"][i].asFloat();
-                }
-            }
-            
-            if (item["hsl_threshold"].isArray() && item["hsl_threshold"].size() == 3) {
-                for (int i = 0; i < 3; ++i) {
-                    setting.hsl_threshold[i] = item["hsl_threshold"][i].asFloat();
-                }
-            }
-            
-            if (item["hsv_threshold"].isArray() && item["hsv_threshold"].size() == 3) {
-                for (int i = 0; i < 3; ++i) {
-                    setting.hsv_threshold[i] = item["hsv_threshold"][i].asFloat();
-                }
-            }
-            
-            settings.push_back(setting);
+            settings.push_back(binaryThresholdSettingFromJson(item));
         }
         cout << "Loaded " << settings.size() << " binary threshold settings from: " << filePath << endl;
     } else {
@@ -178,11 +265,338 @@ vector<BinaryThresholdSetting> loadBinaryThresholdSettings() {
     return settings;
 }
 
+// 每頁暫存用的 arena：bump allocation，換頁時 reset() 倒回起點，deallocate 不做事。
+// 容量不夠時另開 block；reset() 會把多個 block 合併成一個夠大的，之後穩態每頁不再碰 heap。
+// 合併後最多保留 retain_limit bytes：偶爾一頁特別大時多借的記憶體會在 reset() 還回去
+class PageArena : public std::pmr::memory_resource
+{
+public:
+    explicit PageArena(size_t initial_bytes = 4 << 20, size_t retain_bytes = 64 << 20)
+        : initial_size(initial_bytes), retain_limit(retain_bytes) {}
+    PageArena(const PageArena &) = delete;
+    PageArena &operator=(const PageArena &) = delete;
+
+    void reset()
+    {
+        const size_t total = capacity();
+        const size_t keep = std::min(total, std::max(initial_size, retain_limit));
+        if (blocks.size() > 1 || total > keep)
+        {
+            blocks.clear();
+            if (keep > 0)
+                addBlock(keep);
+            released_bytes += total - keep;
+        }
+        offset = 0;
+        used_before_current = 0;
+    }
+
+    // reset() 之後最多保留的容量（高水位）
+    void setRetainLimit(size_t bytes) { retain_limit = bytes; }
+    size_t retainLimit() const { return std::max(initial_size, retain_limit); }
+
+    // cv::Mat header 直接指向 arena 記憶體（Mat 不擁有它，reset 後不可再使用）
+    cv::Mat mat(int rows, int cols, int type)
+    {
+        const size_t step = cv::alignSize(static_cast<size_t>(cols) * CV_ELEM_SIZE(type), 16);
+        void *data = allocate(step * static_cast<size_t>(rows), 64);
+        return cv::Mat(rows, cols, type, data, step);
+    }
+
+    size_t capacity() const
+    {
+        size_t total = 0;
+        for (const auto &b : blocks)
+            total += b.size;
+        return total;
+    }
+    size_t used() const { return used_before_current + offset; }
+    size_t heapAllocations() const { return heap_allocations; }
+    size_t releasedBytes() const { return released_bytes; }
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (!blocks.empty())
+        {
+            if (void *p = bump(bytes, alignment))
+                return p;
+            used_before_current += offset;
+        }
+        addBlock(std::max(bytes + alignment, blocks.empty() ? initial_size : blocks.back().size * 2));
+        offset = 0;
+        return bump(bytes, alignment);
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+private:
+    struct Block
+    {
+        unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    void *bump(size_t bytes, size_t alignment)
+    {
+        Block &b = blocks.back();
+        const uintptr_t base = reinterpret_cast<uintptr_t>(b.data.get());
+        const uintptr_t start = (base + offset + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+        if (start + bytes > base + b.size)
+            return nullptr;
+        offset = start + bytes - base;
+        return reinterpret_cast<void *>(start);
+    }
+
+    void addBlock(size_t size)
+    {
+        blocks.push_back({make_unique<std::byte[]>(size), size});
+        ++heap_allocations;
+    }
+
+    size_t initial_size;
+    size_t retain_limit;
+    vector<Block> blocks;
+    size_t offset = 0;
+    size_t used_before_current = 0;
+    size_t heap_allocations = 0;
+    size_t released_bytes = 0;
+};
+
+// 整個程式共用的 work-stealing 執行緒池。每個 worker 有自己的工作佇列：
+// 自己從尾端取（LIFO，快取友善），沒工作就從別人的頭端偷（FIFO，偷到的是大塊）。
+// 工作只是函式指標 + context + 區間，提交時不配置記憶體；佇列容量只會成長不會縮小
+class WorkStealingPool
+{
+public:
+    // 一組工作；wait() 時呼叫端也會幫忙執行佇列中的工作，所以在工作裡再 parallelFor 不會卡死
+    class TaskGroup
+    {
+    public:
+        explicit TaskGroup(WorkStealingPool &pool) : pool(pool) {}
+        ~TaskGroup() { wait(); }
+
+        void wait()
+        {
+            while (pending.load(std::memory_order_acquire) > 0)
+            {
+                if (!pool.runOne())
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    done.wait_for(lock, std::chrono::microseconds(200),
+                                  [&] { return pending.load(std::memory_order_acquire) == 0; });
+                }
+            }
+            // 等最後一個 finishOne 放開鎖，之後這個物件才可以被解構
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+
+    private:
+        friend class WorkStealingPool;
+
+        void finishOne()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                done.notify_all();
+        }
+
+        WorkStealingPool &pool;
+        std::atomic<size_t> pending{0};
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    explicit WorkStealingPool(unsigned thread_cnt = std::thread::hardware_concurrency())
+    {
+        thread_cnt = std::max(1u, thread_cnt);
+        for (unsigned t = 0; t < thread_cnt; ++t)
+            queues.push_back(make_unique<WorkerQueue>());
+        for (unsigned t = 0; t < thread_cnt; ++t)
+            workers.emplace_back([this, t] { workerLoop(t); });
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &th : workers)
+            th.join();
+    }
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    // 把 [begin, end) 切成 grain 大小的區塊丟進池子，fn(chunk_begin, chunk_end)；回傳時全部做完
+    template <typename Fn>
+    void parallelFor(size_t begin, size_t end, size_t grain, Fn &&fn)
+    {
+        if (begin >= end)
+            return;
+        grain = std::max<size_t>(1, grain);
+        if (end - begin <= grain)
+        {
+            fn(begin, end);
+            return;
+        }
+
+        using F = std::remove_reference_t<Fn>;
+        TaskGroup group(*this);
+        Task task;
+        task.run = [](void *ctx, size_t b, size_t e) { (*static_cast<F *>(ctx))(b, e); };
+        task.ctx = const_cast<void *>(static_cast<const void *>(std::addressof(fn)));
+        task.group = &group;
+        for (size_t b = begin; b < end; b += grain)
+        {
+            task.begin = b;
+            task.end = std::min(b + grain, end);
+            submit(task);
+        }
+        group.wait();
+    }
+
+private:
+    struct Task
+    {
+        void (*run)(void *, size_t, size_t) = nullptr;
+        void *ctx = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+        TaskGroup *group = nullptr;
+    };
+
+    // 可成長的環狀佇列；mutex 只在同一個 worker 的擁有者與小偷之間競爭
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        vector<Task> ring = vector<Task>(256);
+        size_t head = 0;
+        size_t count = 0;
+
+        void pushBack(const Task &t)
+        {
+            if (count == ring.size())
+            {
+                vector<Task> bigger(ring.size() * 2);
+                for (size_t k = 0; k < count; ++k)
+                    bigger[k] = ring[(head + k) % ring.size()];
+                ring.swap(bigger);
+                head = 0;
+            }
+            ring[(head + count) % ring.size()] = t;
+            ++count;
+        }
+        bool popBack(Task &t)
+        {
+            if (count == 0)
+                return false;
+            --count;
+            t = ring[(head + count) % ring.size()];
+            return true;
+        }
+        bool popFront(Task &t)
+        {
+            if (count == 0)
+                return false;
+            t = ring[head];
+            head = (head + 1) % ring.size();
+            --count;
+            return true;
+        }
+    };
+
+    static int &currentWorker()
+    {
+        thread_local int index = -1;
+        return index;
+    }
+
+    void submit(const Task &task)
+    {
+        task.group->pending.fetch_add(1, std::memory_order_relaxed);
+        int w = currentWorker();
+        const size_t target = w >= 0 ? static_cast<size_t>(w) : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+        // 先加計數再放進佇列：否則別的執行緒可能先偷走並 fetch_sub，讓計數暫時下溢成極大值
+        queued.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(queues[target]->mutex);
+            queues[target]->pushBack(task);
+        }
+        {
+            // 與 workerLoop 的判斷同步，避免睡前漏掉通知
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake.notify_one();
+    }
+
+    // 先拿自己的，再去偷別人的；有執行到工作就回傳 true
+    bool runOne()
+    {
+        Task task;
+        const int self = currentWorker();
+        bool found = false;
+        if (self >= 0)
+        {
+            std::lock_guard<std::mutex> lock(queues[self]->mutex);
+            found = queues[self]->popBack(task);
+        }
+        const size_t n = queues.size();
+        const size_t start = self >= 0 ? static_cast<size_t>(self) + 1 : next_queue.load(std::memory_order_relaxed);
+        for (size_t k = 0; !found && k < n; ++k)
+        {
+            WorkerQueue &victim = *queues[(start + k) % n];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            found = victim.popFront(task);
+        }
+        if (!found)
+            return false;
+
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        task.run(task.ctx, task.begin, task.end);
+        task.group->finishOne();
+        return true;
+    }
+
+    void workerLoop(unsigned index)
+    {
+        currentWorker() = static_cast<int>(index);
+        while (true)
+        {
+            if (runOne())
+                continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [&] { return stopping || queued.load(std::memory_order_acquire) > 0; });
+            if (stopping && queued.load(std::memory_order_acquire) == 0)
+                return;
+        }
+    }
+
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<std::thread> workers;
+    std::atomic<size_t> next_queue{0};
+    std::atomic<size_t> queued{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+// 程式唯一的執行緒池（叢集、二值化分帶、匯出都用它）
+WorkStealingPool &sharedPool()
+{
+    static WorkStealingPool pool;
+    return pool;
+}
+
 // 並查集（Disjoint‑Set Union）支援多執行緒
 class ParallelDSU
 {
 public:
-    ParallelDSU(size_t n) : parent(n), rank(n, 0), locks(n)
+    ParallelDSU(size_t n, std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+        : parent(n, resource), rank(n, 0, resource), locks(n, resource)
     {
         std::iota(parent.begin(), parent.end(), 0);
     }
@@ -239,268 +653,7729 @@ public:
     }
 
 private:
-    std::vector<std::atomic<int>> parent;
-    std::vector<int> rank;
-    std::vector<std::mutex> locks;
+    std::pmr::vector<std::atomic<int>> parent;
+    std::pmr::vector<int> rank;
+    std::pmr::vector<std::mutex> locks;
 };
 
-class MultithreadCluster
+// CSR 形式的叢集結果：第 c 個叢集的點索引為 indices[offsets[c], offsets[c + 1])
+struct ClusterCSR
+{
+    std::pmr::vector<int> offsets;
+    std::pmr::vector<int> indices;
+
+    explicit ClusterCSR(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+        : offsets(resource), indices(resource) {}
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+    std::span<const int> operator[](size_t c) const
+    {
+        return std::span<const int>(indices.data() + offsets[c], indices.data() + offsets[c + 1]);
+    }
+
+    vector<vector<int>> toNested() const
+    {
+        vector<vector<int>> nested(size());
+        for (size_t c = 0; c < size(); ++c)
+            nested[c].assign((*this)[c].begin(), (*this)[c].end());
+        return nested;
+    }
+};
+
+// 二維點叢集。座標型別可以是 double（原本的 API）或 int16_t / int32_t：
+// 整數座標用整數平方半徑比較，點以 SoA 存放，AVX2 時一次比較 16 (int16) / 8 (int32) 個點
+template <typename Coord>
+class BasicMultithreadCluster
 {
 public:
     typedef struct Point2d
     {
-        double x;
-        double y;
+        Coord x;
+        Coord y;
     } Point2D; // 二維點
 
+    using DistSq = std::conditional_t<std::is_floating_point_v<Coord>, double, int64_t>;
+
+    // SoA：x、y 各自連續
+    struct PointSet
+    {
+        std::pmr::vector<Coord> xs;
+        std::pmr::vector<Coord> ys;
+
+        explicit PointSet(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+            : xs(resource), ys(resource) {}
+
+        size_t size() const { return xs.size(); }
+    };
+
     vector<Point2D> formCV(vector<cv::Point> &points)
     {
         vector<Point2D> result;
         result.reserve(points.size());
         for (const auto &p : points)
         {
-            result.push_back({static_cast<double>(p.x), static_cast<double>(p.y)});
+            result.push_back({static_cast<Coord>(p.x), static_cast<Coord>(p.y)});
         }
         return result;
     } // Convert cv::Point to Point2D
 
+    void formCV(std::span<const cv::Point> points, PointSet &result)
+    {
+        result.xs.resize(points.size());
+        result.ys.resize(points.size());
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            result.xs[i] = static_cast<Coord>(points[i].x);
+            result.ys[i] = static_cast<Coord>(points[i].y);
+        }
+    }
+
     // 計算平方距離
-    inline double sqDist(const Point2D &a, const Point2D &b)
+    inline DistSq sqDist(const Point2D &a, const Point2D &b)
     {
-        double dx = a.x - b.x;
-        double dy = a.y - b.y;
+        DistSq dx = static_cast<DistSq>(a.x) - static_cast<DistSq>(b.x);
+        DistSq dy = static_cast<DistSq>(a.y) - static_cast<DistSq>(b.y);
         return dx * dx + dy * dy;
     }
 
-    // 多執行緒叢集函式
+    // 整數座標的距離平方也是整數，所以 <= r^2 等價於 <= floor(r^2)。
+    // r^2 放不進 int64 的半徑（包括 inf）夾到 int64 最大值；NaN 與負值沒有鄰居
+    static DistSq radiusSq(double radius)
+    {
+        if constexpr (std::is_floating_point_v<Coord>)
+            return radius * radius;
+        else
+        {
+            if (!(radius >= 0.0))
+                return -1;
+            const double sq = radius * radius;
+            return sq < 0x1p63 ? static_cast<DistSq>(std::floor(sq)) : INT64_MAX;
+        }
+    }
+
+    static constexpr size_t cluster_grain = 512; // 每個工作處理的點數
+
+    // 多執行緒叢集函式（thread_cnt == 1 時在呼叫端執行緒上跑）
     std::vector<std::vector<int>> cluster(
         const std::vector<Point2D> &points,
         double radius,
         unsigned thread_cnt = std::thread::hardware_concurrency())
+    {
+        PointSet soa;
+        soa.xs.reserve(points.size());
+        soa.ys.reserve(points.size());
+        for (const auto &p : points)
+        {
+            soa.xs.push_back(p.x);
+            soa.ys.push_back(p.y);
+        }
+        ClusterCSR csr;
+        cluster(soa, radius, csr, std::pmr::get_default_resource(), thread_cnt);
+        return csr.toNested();
+    }
+
+    // 結果寫進 out（CSR），DSU / 亂序索引 / 分組等暫存都從 scratch 取得
+    void cluster(
+        const PointSet &points,
+        double radius,
+        ClusterCSR &out,
+        std::pmr::memory_resource *scratch,
+        unsigned thread_cnt = std::thread::hardware_concurrency())
     {
         const size_t n = points.size();
-        ParallelDSU dsu(n);
-        const double radius_sq = radius * radius;
+        ParallelDSU dsu(n, scratch);
+        const DistSq radius_sq = radiusSq(radius);
+
+        const Coord *xs = points.xs.data();
+        const Coord *ys = points.ys.data();
+
+        // 點若依 y 排序（findNonZero / gatherInkPoints 的輸出就是），
+        // 內層迴圈只需掃到 y 超出半徑為止
+        const bool y_sorted = std::is_sorted(points.ys.begin(), points.ys.end());
+        // 整數座標時 floor(sqrt(floor(r^2))) == floor(r)，但不會因為 r 太大而溢位
+        const DistSq reach = std::is_floating_point_v<Coord> ? static_cast<DistSq>(radius)
+                             : radius_sq < 0 ? DistSq(-1)
+                                             : static_cast<DistSq>(std::sqrt(static_cast<double>(radius_sq)));
 
         // Monte Carlo：隨機順序處理索引
-        std::vector<size_t> indices(n);
+        std::pmr::vector<size_t> indices(n, scratch);
         std::iota(indices.begin(), indices.end(), 0);
         std::random_device rd;
         std::mt19937 gen(rd());
         std::shuffle(indices.begin(), indices.end(), gen);
 
-        // 每個 thread 處理分段區間
-        std::vector<std::thread> workers;
+        // 切成小區塊丟進共用執行緒池；各點鄰居數差很多，小區塊 + work stealing 才不會有人閒著
         auto work = [&](size_t start_idx, size_t end_idx)
         {
             for (size_t idx = start_idx; idx < end_idx; ++idx)
             {
                 size_t i = indices[idx];
-                for (size_t j = i + 1; j < n; ++j)
+                size_t end = n;
+                if (y_sorted)
                 {
-                    if (sqDist(points[i], points[j]) <= radius_sq)
-                    {
-                        dsu.unite(static_cast<int>(i), static_cast<int>(j));
-                    }
+                    const DistSq limit = static_cast<DistSq>(ys[i]) + reach;
+                    end = std::upper_bound(ys + i + 1, ys + n, limit,
+                                           [](DistSq lim, Coord y) { return lim < static_cast<DistSq>(y); }) - ys;
                 }
+                scanNeighbors(xs, ys, i, i + 1, end, radius_sq, [&](size_t j)
+                              { dsu.unite(static_cast<int>(i), static_cast<int>(j)); });
             }
         };
 
-        size_t chunk = (n + thread_cnt - 1) / thread_cnt;
-        size_t begin = 0;
-        for (unsigned t = 0; t < thread_cnt; ++t)
-        {
-            size_t end = std::min(begin + chunk, n);
-            if (begin >= end)
-                break;
-            workers.emplace_back(work, begin, end);
-            begin = end;
-        }
-        for (auto &th : workers)
-            th.join();
+        if (thread_cnt == 1)
+            work(0, n);
+        else
+            sharedPool().parallelFor(0, n, cluster_grain, work);
 
-        // 收集叢集
-        std::unordered_map<int, std::vector<int>> groups;
+        // 收集叢集：root -> 叢集編號（依第一次出現的順序），再以 counting sort 填 CSR
+        std::pmr::vector<int> label(n, -1, scratch);
+        std::pmr::vector<int> point_cluster(n, scratch);
+        int cluster_cnt = 0;
         for (size_t i = 0; i < n; ++i)
         {
             int root = dsu.find(static_cast<int>(i));
-            groups[root].push_back(static_cast<int>(i));
+            if (label[root] < 0)
+                label[root] = cluster_cnt++;
+            point_cluster[i] = label[root];
         }
 
-        std::vector<std::vector<int>> clusters;
-        clusters.reserve(groups.size());
-        for (auto &[root, vec] : groups)
-        {
-            clusters.emplace_back(std::move(vec));
-        }
-        return clusters;
-    }
-};
+        out.offsets.assign(static_cast<size_t>(cluster_cnt) + 1, 0);
+        for (size_t i = 0; i < n; ++i)
+            ++out.offsets[point_cluster[i] + 1];
+        std::partial_sum(out.offsets.begin(), out.offsets.end(), out.offsets.begin());
 
-// Function to load and process image with OpenCV effects
-bool LoadProcessedTextureFromFile(const char *filename, GLuint *out_texture, int *out_width, int *out_height,
-                                  float brightness = 0.0f, float contrast = 1.0f, int blur_kernel = 0, bool grayscale = false,
-                                  bool enable_binary = false, int color_space = 0,
-                                  float rgb_threshold[3] = nullptr, float hsl_threshold[3] = nullptr, float hsv_threshold[3] = nullptr)
-{
-    // Load image using OpenCV with IMREAD_COLOR to ensure 3 channels
-    image = cv::imread(filename, cv::IMREAD_COLOR);
-    if (image.empty())
-    {
-        cerr << "Failed to load image for processing: " << filename << endl;
-        return false;
+        std::pmr::vector<int> fill(out.offsets.begin(), out.offsets.end() - 1, scratch);
+        out.indices.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            out.indices[fill[point_cluster[i]]++] = static_cast<int>(i);
     }
 
-    // Ensure image is 3-channel BGR
-    if (image.channels() != 3)
+private:
+    // 對 j in [j, end) 中與點 i 距離 <= 半徑的點呼叫 on_hit(j)
+    template <typename Fn>
+    static void scanNeighbors(const Coord *xs, const Coord *ys, size_t i, size_t j, size_t end, DistSq radius_sq, Fn &&on_hit)
     {
-        if (image.channels() == 4)
+#ifdef __AVX2__
+        if constexpr (std::is_same_v<Coord, int16_t>)
         {
-            cv::cvtColor(image, image, cv::COLOR_BGRA2BGR);
+            // |dx|、|dy| 以飽和減法算在 [0, 32767]，madd 得到的 dx^2 + dy^2 不會溢位
+            if (radius_sq <= INT32_MAX)
+            {
+                const __m256i xi = _mm256_set1_epi16(xs[i]);
+                const __m256i yi = _mm256_set1_epi16(ys[i]);
+                const __m256i r2 = _mm256_set1_epi32(static_cast<int32_t>(radius_sq));
+                for (; j + 16 <= end; j += 16)
+                {
+                    const __m256i xj = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + j));
+                    const __m256i yj = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ys + j));
+                    const __m256i dx = _mm256_subs_epi16(_mm256_max_epi16(xi, xj), _mm256_min_epi16(xi, xj));
+                    const __m256i dy = _mm256_subs_epi16(_mm256_max_epi16(yi, yj), _mm256_min_epi16(yi, yj));
+                    const __m256i lo = _mm256_unpacklo_epi16(dx, dy); // 元素 0-3, 8-11
+                    const __m256i hi = _mm256_unpackhi_epi16(dx, dy); // 元素 4-7, 12-15
+                    const __m256i far_lo = _mm256_cmpgt_epi32(_mm256_madd_epi16(lo, lo), r2);
+                    const __m256i far_hi = _mm256_cmpgt_epi32(_mm256_madd_epi16(hi, hi), r2);
+                    const unsigned l = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(far_lo))) & 0xFFu;
+                    const unsigned h = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(far_hi))) & 0xFFu;
+                    unsigned hits = (l & 0x0Fu) | ((h & 0x0Fu) << 4) | ((l & 0xF0u) << 4) | ((h & 0xF0u) << 8);
+                    for (; hits; hits &= hits - 1)
+                        on_hit(j + std::countr_zero(hits));
+                }
+            }
         }
-        else if (image.channels() == 1)
+        else if constexpr (std::is_same_v<Coord, int32_t>)
         {
-            cv::cvtColor(image, image, cv::COLOR_GRAY2BGR);
+            // 先用外框 |dx|, |dy| <= r 篩掉，框內的 dx^2 + dy^2 才保證不溢位
+            const int64_t r_box = static_cast<int64_t>(std::sqrt(static_cast<double>(radius_sq)));
+            if (r_box <= 32767)
+            {
+                const __m256i xi = _mm256_set1_epi32(xs[i]);
+                const __m256i yi = _mm256_set1_epi32(ys[i]);
+                const __m256i rb = _mm256_set1_epi32(static_cast<int32_t>(r_box));
+                const __m256i r2 = _mm256_set1_epi32(static_cast<int32_t>(radius_sq));
+                for (; j + 8 <= end; j += 8)
+                {
+                    const __m256i dx = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + j)), xi));
+                    const __m256i dy = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(ys + j)), yi));
+                    const __m256i out_box = _mm256_or_si256(_mm256_cmpgt_epi32(dx, rb), _mm256_cmpgt_epi32(dy, rb));
+                    const __m256i d2 = _mm256_add_epi32(_mm256_mullo_epi32(dx, dx), _mm256_mullo_epi32(dy, dy));
+                    const __m256i far = _mm256_or_si256(out_box, _mm256_cmpgt_epi32(d2, r2));
+                    unsigned hits = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(far))) & 0xFFu;
+                    for (; hits; hits &= hits - 1)
+                        on_hit(j + std::countr_zero(hits));
+                }
+            }
         }
-    }
+#endif
+        for (; j < end; ++j)
+        {
+            const DistSq dx = static_cast<DistSq>(xs[j]) - static_cast<DistSq>(xs[i]);
+            const DistSq dy = static_cast<DistSq>(ys[j]) - static_cast<DistSq>(ys[i]);
+            if (dx * dx + dy * dy <= radius_sq)
+                on_hit(j);
+        }
+    }
+};
+
+using MultithreadCluster = BasicMultithreadCluster<double>;
+
+// 半徑超過頁面對角線時任兩點都在半徑內，結果跟對角線一樣；先夾住再平方，
+// inf 或極大的半徑才不會在 floor(r^2) 轉成整數時溢位。NaN 與負值當成 0
+double clampClusterRadius(double radius, cv::Size page_size)
+{
+    return radius > 0.0 ? std::min(radius, std::hypot(page_size.width, page_size.height)) : 0.0;
+}
+
+// 從墨跡點做叢集：座標放得進 int16 就走 int16（AVX2 一次 16 點），否則 int32
+void clusterInkPoints(std::span<const cv::Point> points, cv::Size page_size, double radius,
+                      ClusterCSR &out, std::pmr::memory_resource *scratch = std::pmr::get_default_resource())
+{
+    radius = clampClusterRadius(radius, page_size);
+    if (page_size.width <= INT16_MAX && page_size.height <= INT16_MAX)
+    {
+        BasicMultithreadCluster<int16_t> clusterer;
+        BasicMultithreadCluster<int16_t>::PointSet soa(scratch);
+        clusterer.formCV(points, soa);
+        clusterer.cluster(soa, radius, out, scratch);
+    }
+    else
+    {
+        BasicMultithreadCluster<int32_t> clusterer;
+        BasicMultithreadCluster<int32_t>::PointSet soa(scratch);
+        clusterer.formCV(points, soa);
+        clusterer.cluster(soa, radius, out, scratch);
+    }
+}
+
+// 預覽叢集（GUI 先給結果用，精確結果在背景算）：頁面切成邊長 cell 的格子，每個有墨跡的格子以蓄水池抽樣
+// 隨機選一個點當代表，只對代表點做叢集，其餘點經由所在格子查到代表點的叢集。
+// 每個格子最多一個代表點，所以代表點的鄰居直接查附近的格子，不必掃整條 y 帶。
+// 代表點之間用半徑 radius + cell 連接，補回代表點偏離原本點的距離：結果與精確叢集大致相同，
+// 間距略大於 radius 的叢集可能被併在一起。格子大小由時間預算與上次量到的每個代表點成本決定
+struct PreviewClusterInfo
+{
+    size_t samples = 0;      // 代表點數
+    int cell = 1;            // 格子邊長 (px)，1 表示沒有抽樣（結果就是精確結果）
+    double sample_radius = 0.0;
+};
+
+void previewClusterInkPoints(std::span<const cv::Point> points, cv::Size page_size, double radius, double budget_ms,
+                             ClusterCSR &out, PreviewClusterInfo *info = nullptr,
+                             std::pmr::memory_resource *scratch = std::pmr::get_default_resource())
+{
+    // 每個代表點的叢集時間 (ns)，每次量到後更新；第一次用保守的估計值。
+    // 分格與指派是每個點固定的線性成本，抽樣多少都省不掉，不算在內
+    static std::atomic<double> ns_per_sample{200.0};
+    radius = clampClusterRadius(radius, page_size);
+    const size_t n = points.size();
+    const size_t target = std::max<size_t>(1024, static_cast<size_t>(budget_ms * 1e6 / ns_per_sample.load()));
+    PreviewClusterInfo local_info;
+    PreviewClusterInfo &result_info = info ? *info : local_info;
+    if (n <= target)
+    {
+        clusterInkPoints(points, page_size, radius, out, scratch);
+        result_info = PreviewClusterInfo{n, 1, radius};
+        return;
+    }
+
+    // 格子數大約要等於 target；墨跡是線條，實際有墨跡的格子比估計的多時把格子放大重來
+    int cell = std::max(2, static_cast<int>(std::sqrt(static_cast<double>(n) / target)));
+    int grid_w = 0, grid_h = 0;
+    std::pmr::vector<int> cell_of(n, scratch);     // 每點所在格子的代表編號
+    std::pmr::vector<int> grid(scratch);
+    std::pmr::vector<cv::Point> samples(scratch);
+    std::pmr::vector<uint32_t> seen(scratch);      // 每個格子目前看過的點數
+    std::pmr::vector<int> col_of(page_size.width, scratch); // x -> 格子欄、y -> 格子列起點，省掉每點兩次除法
+    std::pmr::vector<size_t> row_of(page_size.height, scratch);
+    while (true)
+    {
+        grid_w = (page_size.width + cell - 1) / cell;
+        grid_h = (page_size.height + cell - 1) / cell;
+        grid.assign(static_cast<size_t>(grid_w) * grid_h, -1);
+        for (int x = 0; x < page_size.width; ++x)
+            col_of[x] = x / cell;
+        for (int y = 0; y < page_size.height; ++y)
+            row_of[y] = static_cast<size_t>(y / cell) * grid_w;
+        samples.clear();
+        seen.clear();
+        uint64_t state = 0x9E3779B97F4A7C15ull ^ n;
+        bool overflow = false;
+        for (size_t i = 0; i < n && !overflow; ++i)
+        {
+            int &slot = grid[row_of[points[i].y] + col_of[points[i].x]];
+            if (slot < 0)
+            {
+                slot = static_cast<int>(samples.size());
+                samples.push_back(points[i]);
+                seen.push_back(1);
+                overflow = samples.size() > target * 3 / 2;
+            }
+            else
+            {
+                // 蓄水池抽樣：格子裡第 k 個點以 1/k 的機率取代代表點
+                // （xorshift 加乘法縮放到 [0, k)，每點省掉一次 mt19937 與除法）
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                if (((state >> 32) * ++seen[slot]) >> 32 == 0)
+                    samples[slot] = points[i];
+            }
+            cell_of[i] = slot;
+        }
+        if (!overflow)
+            break;
+        cell = cell * 3 / 2 + 1;
+    }
+
+    // 代表點的並查集：只查半徑涵蓋的格子，且只往後半平面查（每對只看一次）
+    const size_t m = samples.size();
+    const double sample_radius = radius + cell;
+    const int64_t radius_sq = static_cast<int64_t>(std::floor(sample_radius * sample_radius));
+    const int reach = static_cast<int>(std::ceil(sample_radius / cell));
+    const auto t0 = std::chrono::steady_clock::now();
+    std::pmr::vector<int> parent(m, scratch);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](int x)
+    {
+        while (parent[x] != x)
+        {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    };
+    for (size_t s = 0; s < m; ++s)
+    {
+        const cv::Point p = samples[s];
+        const int gx = p.x / cell, gy = p.y / cell;
+        for (int dy = 0; dy <= reach && gy + dy < grid_h; ++dy)
+        {
+            for (int dx = dy == 0 ? 1 : -reach; dx <= reach; ++dx)
+            {
+                if (gx + dx < 0 || gx + dx >= grid_w)
+                    continue;
+                const int other = grid[static_cast<size_t>(gy + dy) * grid_w + gx + dx];
+                if (other < 0)
+                    continue;
+                const int64_t ddx = samples[other].x - p.x, ddy = samples[other].y - p.y;
+                if (ddx * ddx + ddy * ddy > radius_sq)
+                    continue;
+                const int a = find(static_cast<int>(s)), b = find(other);
+                if (a != b)
+                    parent[std::max(a, b)] = std::min(a, b);
+            }
+        }
+    }
+
+    const double elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    ns_per_sample = 0.5 * ns_per_sample.load() + 0.5 * elapsed_ns / static_cast<double>(m);
+
+    // 叢集編號依點第一次出現的順序（與精確叢集相同），再以 counting sort 填 CSR
+    for (size_t s = 0; s < m; ++s)
+        parent[s] = find(static_cast<int>(s));
+    std::pmr::vector<int> label(m, -1, scratch);
+    std::pmr::vector<int> point_cluster(n, scratch);
+    int cluster_cnt = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int &l = label[parent[cell_of[i]]];
+        if (l < 0)
+            l = cluster_cnt++;
+        point_cluster[i] = l;
+    }
+    out.offsets.assign(static_cast<size_t>(cluster_cnt) + 1, 0);
+    for (size_t i = 0; i < n; ++i)
+        ++out.offsets[point_cluster[i] + 1];
+    std::partial_sum(out.offsets.begin(), out.offsets.end(), out.offsets.begin());
+    std::pmr::vector<int> fill(out.offsets.begin(), out.offsets.end() - 1, scratch);
+    out.indices.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        out.indices[fill[point_cluster[i]]++] = static_cast<int>(i);
+
+    result_info = PreviewClusterInfo{m, cell, sample_radius};
+}
+
+// 門檻微調時的增量叢集：門檻動一格只改變筆畫邊緣一圈像素，不必整頁重做 findNonZero → formCV → cluster。
+// 保留上一次的墨跡遮罩與每個墨跡像素的叢集標籤（並查集），新遮罩只處理差異：
+//   移除的像素：所屬的舊叢集可能斷開，只把這些叢集剩下的點重新叢集（外框內掃描，其他叢集不動）；
+//   新增的像素：查半徑內的圓盤，跟碰到的墨跡像素合併。
+// 先移除再新增，結果與整頁重新叢集相同（不同舊叢集的點距離一定大於半徑，所以可以各自重做）。
+// 叢集是 radius 連通的筆畫，筆畫合併在輸出後照常做
+class IncrementalClusterer
+{
+public:
+    struct UpdateStats
+    {
+        size_t added = 0;
+        size_t removed = 0;
+        size_t reclustered_components = 0; // 因為有像素被移除而重新叢集的舊叢集數
+        size_t reclustered_points = 0;
+    };
+
+    // 從完整的叢集結果建立狀態；points / clusters 與 clusterInkPoints 的輸入輸出相同
+    void reset(const cv::Mat &ink, std::span<const cv::Point> points, const ClusterCSR &clusters, double cluster_radius)
+    {
+        width = ink.cols;
+        height = ink.rows;
+        radius = clampClusterRadius(cluster_radius, ink.size()); // 跟 clusterInkPoints 相同，圓盤也不會大過頁面
+        buildDisc();
+        labels.assign(static_cast<size_t>(width) * height, -1);
+        parent.resize(clusters.size());
+        std::iota(parent.begin(), parent.end(), 0);
+        bounds.assign(clusters.size(), Bounds{INT_MAX, INT_MAX, INT_MIN, INT_MIN});
+        for (size_t c = 0; c < clusters.size(); ++c)
+        {
+            for (int idx : clusters[c])
+            {
+                const cv::Point p = points[idx];
+                labels[index(p.x, p.y)] = static_cast<int>(c);
+                bounds[c].add(p.x, p.y);
+            }
+        }
+        ink_count = points.size();
+    }
+
+    bool ready() const { return width > 0; }
+
+    bool matches(cv::Size size, double cluster_radius) const
+    {
+        return ready() && size.width == width && size.height == height && clampClusterRadius(cluster_radius, size) == radius;
+    }
+
+    // 以新遮罩（非 0 = 墨跡）更新。變動的像素超過墨跡的 max_changed_fraction 時不更新並回傳 false，
+    // 這時整頁重做比較快，呼叫端應改走完整叢集再 reset()
+    bool update(const cv::Mat &ink, double max_changed_fraction, UpdateStats *stats = nullptr)
+    {
+        if (!ready() || ink.cols != width || ink.rows != height)
+            return false;
+
+        // 逐列比對，整列相同（多數列）直接跳過
+        added.clear();
+        removed.clear();
+        const size_t max_changed = static_cast<size_t>(max_changed_fraction * std::max<size_t>(ink_count, 1));
+        for (int y = 0; y < height; ++y)
+        {
+            const uchar *row = ink.ptr<uchar>(y);
+            const int *label_row = labels.data() + index(0, y);
+            for (int x = 0; x < width; ++x)
+            {
+                const bool now = row[x] != 0;
+                const bool before = label_row[x] >= 0;
+                if (now != before)
+                    (now ? added : removed).push_back(cv::Point(x, y));
+            }
+            if (added.size() + removed.size() > max_changed)
+                return false;
+        }
+
+        UpdateStats local;
+        local.added = added.size();
+        local.removed = removed.size();
+
+        // 移除：記下受影響的舊叢集，清掉標籤後，在每個舊叢集剩下的點上重新找連通塊
+        std::vector<int> affected;
+        for (const cv::Point &p : removed)
+        {
+            int &label = labels[index(p.x, p.y)];
+            affected.push_back(find(label));
+            label = -1;
+        }
+        std::sort(affected.begin(), affected.end());
+        affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+        std::vector<cv::Point> component;
+        std::vector<cv::Point> frontier;
+        for (int root : affected)
+        {
+            // 外框內屬於這個叢集的點，標籤先統一改成 root 本身，之後用整數比較就能判斷
+            component.clear();
+            const Bounds box = bounds[root];
+            for (int y = box.y0; y <= box.y1; ++y)
+            {
+                for (int x = box.x0; x <= box.x1; ++x)
+                {
+                    int &label = labels[index(x, y)];
+                    if (label >= 0 && find(label) == root)
+                    {
+                        label = root;
+                        component.push_back(cv::Point(x, y));
+                    }
+                }
+            }
+            ++local.reclustered_components;
+            local.reclustered_points += component.size();
+
+            // 以半徑圓盤當鄰域做 flood fill，每個連通塊一個新標籤（新標籤都大於 root，不會跟 root 混淆）
+            for (const cv::Point &seed : component)
+            {
+                if (labels[index(seed.x, seed.y)] != root)
+                    continue;
+                const int id = newLabel();
+                labels[index(seed.x, seed.y)] = id;
+                frontier.assign(1, seed);
+                while (!frontier.empty())
+                {
+                    const cv::Point p = frontier.back();
+                    frontier.pop_back();
+                    bounds[id].add(p.x, p.y);
+                    for (const cv::Point &d : disc)
+                    {
+                        const int x = p.x + d.x, y = p.y + d.y;
+                        if (x < box.x0 || y < box.y0 || x > box.x1 || y > box.y1)
+                            continue;
+                        int &label = labels[index(x, y)];
+                        if (label == root)
+                        {
+                            label = id;
+                            frontier.push_back(cv::Point(x, y));
+                        }
+                    }
+                }
+            }
+        }
+
+        // 新增：每個像素先自成一個叢集，再跟半徑內的墨跡像素（舊的或同一批新增的）合併
+        for (const cv::Point &p : added)
+        {
+            const int id = newLabel();
+            labels[index(p.x, p.y)] = id;
+            bounds[id].add(p.x, p.y);
+        }
+        for (const cv::Point &p : added)
+        {
+            const int id = labels[index(p.x, p.y)];
+            for (const cv::Point &d : disc)
+            {
+                const int x = p.x + d.x, y = p.y + d.y;
+                if (x < 0 || y < 0 || x >= width || y >= height)
+                    continue;
+                const int other = labels[index(x, y)];
+                if (other >= 0)
+                    unite(id, other);
+            }
+        }
+        ink_count = ink_count + added.size() - removed.size();
+
+        // 舊標籤用完就丟，累積太多時依目前的叢集重新編號
+        if (parent.size() > 4 * ink_count + 4096)
+            compact();
+        if (stats)
+            *stats = local;
+        return true;
+    }
+
+    // 輸出目前的墨跡點（列優先，與 findNonZero 相同）與叢集（編號依點第一次出現的順序，與 clusterInkPoints 相同）
+    void extract(vector<cv::Point> &points, ClusterCSR &clusters)
+    {
+        points.clear();
+        points.reserve(ink_count);
+        std::vector<int> point_cluster;
+        point_cluster.reserve(ink_count);
+        std::vector<int> compact_id(parent.size(), -1);
+        int cluster_cnt = 0;
+        for (int y = 0; y < height; ++y)
+        {
+            const int *label_row = labels.data() + index(0, y);
+            for (int x = 0; x < width; ++x)
+            {
+                if (label_row[x] < 0)
+                    continue;
+                int &id = compact_id[find(label_row[x])];
+                if (id < 0)
+                    id = cluster_cnt++;
+                points.push_back(cv::Point(x, y));
+                point_cluster.push_back(id);
+            }
+        }
+        clusters.offsets.assign(static_cast<size_t>(cluster_cnt) + 1, 0);
+        for (int id : point_cluster)
+            ++clusters.offsets[id + 1];
+        std::partial_sum(clusters.offsets.begin(), clusters.offsets.end(), clusters.offsets.begin());
+        std::vector<int> fill(clusters.offsets.begin(), clusters.offsets.end() - 1);
+        clusters.indices.resize(points.size());
+        for (size_t i = 0; i < point_cluster.size(); ++i)
+            clusters.indices[fill[point_cluster[i]]++] = static_cast<int>(i);
+    }
+
+private:
+    struct Bounds
+    {
+        int x0, y0, x1, y1;
+
+        void add(int x, int y)
+        {
+            x0 = std::min(x0, x);
+            y0 = std::min(y0, y);
+            x1 = std::max(x1, x);
+            y1 = std::max(y1, y);
+        }
+        void add(const Bounds &other)
+        {
+            x0 = std::min(x0, other.x0);
+            y0 = std::min(y0, other.y0);
+            x1 = std::max(x1, other.x1);
+            y1 = std::max(y1, other.y1);
+        }
+    };
+
+    size_t index(int x, int y) const { return static_cast<size_t>(y) * width + x; }
+
+    // 與 clusterInkPoints 相同的判斷：dx^2 + dy^2 <= floor(r^2)
+    void buildDisc()
+    {
+        disc.clear();
+        const int64_t radius_sq = static_cast<int64_t>(std::floor(radius * radius));
+        const int reach = static_cast<int>(std::floor(radius));
+        for (int dy = -reach; dy <= reach; ++dy)
+        {
+            for (int dx = -reach; dx <= reach; ++dx)
+            {
+                if ((dx != 0 || dy != 0) && int64_t(dx) * dx + int64_t(dy) * dy <= radius_sq)
+                    disc.push_back(cv::Point(dx, dy));
+            }
+        }
+    }
+
+    int newLabel()
+    {
+        const int id = static_cast<int>(parent.size());
+        parent.push_back(id);
+        bounds.push_back(Bounds{INT_MAX, INT_MAX, INT_MIN, INT_MIN});
+        return id;
+    }
+
+    int find(int x)
+    {
+        while (parent[x] != x)
+        {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    }
+
+    void unite(int a, int b)
+    {
+        a = find(a);
+        b = find(b);
+        if (a == b)
+            return;
+        if (a > b)
+            std::swap(a, b);
+        parent[b] = a;
+        bounds[a].add(bounds[b]);
+    }
+
+    void compact()
+    {
+        std::vector<int> remap(parent.size(), -1);
+        std::vector<Bounds> compact_bounds;
+        for (int &label : labels)
+        {
+            if (label < 0)
+                continue;
+            const int root = find(label);
+            if (remap[root] < 0)
+            {
+                remap[root] = static_cast<int>(compact_bounds.size());
+                compact_bounds.push_back(bounds[root]);
+            }
+            label = remap[root];
+        }
+        parent.resize(compact_bounds.size());
+        std::iota(parent.begin(), parent.end(), 0);
+        bounds = std::move(compact_bounds);
+    }
+
+    int width = 0;
+    int height = 0;
+    double radius = 0.0;
+    size_t ink_count = 0;
+    std::vector<int> labels;   // 每個像素的叢集標籤，-1 表示不是墨跡
+    std::vector<int> parent;   // 標籤的並查集
+    std::vector<Bounds> bounds; // 每個根標籤的外框
+    std::vector<cv::Point> disc;
+    std::vector<cv::Point> added;
+    std::vector<cv::Point> removed;
+};
+
+// 叢集統計：外框、質心、點數
+struct ClusterStats
+{
+    cv::Rect bbox;
+    cv::Point2f centroid;
+    int size = 0;
+};
+
+// Clusters 可以是 vector<vector<int>> 或 ClusterCSR
+template <typename Clusters>
+void computeClusterStats(std::span<const cv::Point> points, const Clusters &clusters, std::pmr::vector<ClusterStats> &stats)
+{
+    stats.assign(clusters.size(), ClusterStats());
+    for (size_t c = 0; c < clusters.size(); ++c)
+    {
+        int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+        double sum_x = 0.0, sum_y = 0.0;
+        for (int idx : clusters[c])
+        {
+            const cv::Point &p = points[idx];
+            min_x = std::min(min_x, p.x);
+            min_y = std::min(min_y, p.y);
+            max_x = std::max(max_x, p.x);
+            max_y = std::max(max_y, p.y);
+            sum_x += p.x;
+            sum_y += p.y;
+        }
+        ClusterStats &s = stats[c];
+        s.size = static_cast<int>(clusters[c].size());
+        if (s.size > 0)
+        {
+            s.bbox = cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+            s.centroid = cv::Point2f(static_cast<float>(sum_x / s.size), static_cast<float>(sum_y / s.size));
+        }
+    }
+}
+
+template <typename Clusters>
+std::pmr::vector<ClusterStats> computeClusterStats(std::span<const cv::Point> points, const Clusters &clusters)
+{
+    std::pmr::vector<ClusterStats> stats;
+    computeClusterStats(points, clusters, stats);
+    return stats;
+}
+
+// 筆畫合併：半徑 5 的像素叢集會把多筆畫的中文字拆成好幾塊，加大半徑又會黏到隔壁的字。
+// 這裡改在叢集外框上做第二層合併：外框放進均勻格網，只檢查鄰近格子裡的外框，
+// 重疊或間距夠小、且合併後仍不超過一個字大小的才合併。處理的是幾千個外框而不是幾十萬個像素
+struct StrokeMergeOptions
+{
+    int char_size = 0;                 // 一個字的邊長 (px)；0 表示由筆畫外框自動估計
+    float size_percentile = 0.9f;      // 自動估計時取筆畫外框長邊的這個百分位數
+    float size_tolerance = 1.15f;      // 合併後外框可超出字大小的比例
+    float gap_fraction = 0.15f;        // 兩個外框間距不超過 char_size * gap_fraction 才考慮合併
+    float overlap_fraction = 0.3f;     // 交集佔較小外框這個比例以上時優先合併
+};
+
+// 依筆畫外框長邊的高百分位數估計字的大小：長橫、長豎幾乎和整個字一樣寬或高
+int estimateCharSize(std::span<const ClusterStats> stats, float percentile,
+                     std::pmr::memory_resource *scratch = std::pmr::get_default_resource())
+{
+    std::pmr::vector<int> sides(scratch);
+    sides.reserve(stats.size());
+    for (const auto &s : stats)
+    {
+        if (s.size > 0)
+            sides.push_back(std::max(s.bbox.width, s.bbox.height));
+    }
+    if (sides.empty())
+        return 0;
+    const size_t k = std::min(sides.size() - 1, static_cast<size_t>(percentile * sides.size()));
+    std::nth_element(sides.begin(), sides.begin() + k, sides.end());
+    return sides[k];
+}
+
+// 輸出的 characters 每一組是合併後所有筆畫的點索引（和 clusters 用同一份 points），
+// 組的順序依組內第一個筆畫的索引
+template <typename Clusters>
+void mergeStrokeClusters(std::span<const ClusterStats> stats, const Clusters &clusters, ClusterCSR &characters,
+                         std::pmr::memory_resource *scratch = std::pmr::get_default_resource(),
+                         const StrokeMergeOptions &options = StrokeMergeOptions())
+{
+    const int n = static_cast<int>(stats.size());
+    characters.offsets.assign(1, 0);
+    characters.indices.clear();
+    if (n == 0)
+        return;
+
+    const int char_size = options.char_size > 0 ? options.char_size : estimateCharSize(stats, options.size_percentile, scratch);
+    const int max_side = std::max(1, static_cast<int>(char_size * options.size_tolerance));
+    const int max_gap = static_cast<int>(char_size * options.gap_fraction);
+
+    // 格網：格子邊長 = 字大小，外框登記到它蓋到的每一格（CSR）
+    int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+    for (const auto &s : stats)
+    {
+        if (s.size <= 0)
+            continue;
+        min_x = std::min(min_x, s.bbox.x);
+        min_y = std::min(min_y, s.bbox.y);
+        max_x = std::max(max_x, s.bbox.x + s.bbox.width);
+        max_y = std::max(max_y, s.bbox.y + s.bbox.height);
+    }
+    const int cell = std::max(1, char_size);
+    const int grid_w = (max_x - min_x) / cell + 1;
+    const int grid_h = (max_y - min_y) / cell + 1;
+    auto cellRange = [&](const cv::Rect &r, int pad, int &cx0, int &cy0, int &cx1, int &cy1)
+    {
+        cx0 = std::clamp((r.x - pad - min_x) / cell, 0, grid_w - 1);
+        cy0 = std::clamp((r.y - pad - min_y) / cell, 0, grid_h - 1);
+        cx1 = std::clamp((r.x + r.width - 1 + pad - min_x) / cell, 0, grid_w - 1);
+        cy1 = std::clamp((r.y + r.height - 1 + pad - min_y) / cell, 0, grid_h - 1);
+    };
+
+    std::pmr::vector<int> cell_start(static_cast<size_t>(grid_w) * grid_h + 1, 0, scratch);
+    for (int c = 0; c < n; ++c)
+    {
+        if (stats[c].size <= 0)
+            continue;
+        int cx0, cy0, cx1, cy1;
+        cellRange(stats[c].bbox, 0, cx0, cy0, cx1, cy1);
+        for (int cy = cy0; cy <= cy1; ++cy)
+            for (int cx = cx0; cx <= cx1; ++cx)
+                ++cell_start[cy * grid_w + cx + 1];
+    }
+    for (size_t i = 1; i < cell_start.size(); ++i)
+        cell_start[i] += cell_start[i - 1];
+    std::pmr::vector<int> cell_items(cell_start.back(), scratch);
+    std::pmr::vector<int> cell_fill(cell_start.begin(), cell_start.end() - 1, scratch);
+    for (int c = 0; c < n; ++c)
+    {
+        if (stats[c].size <= 0)
+            continue;
+        int cx0, cy0, cx1, cy1;
+        cellRange(stats[c].bbox, 0, cx0, cy0, cx1, cy1);
+        for (int cy = cy0; cy <= cy1; ++cy)
+            for (int cx = cx0; cx <= cx1; ++cx)
+                cell_items[cell_fill[cy * grid_w + cx]++] = c;
+    }
+
+    // 候選配對：間距（兩軸空隙的較大者）在 max_gap 以內，且兩者合起來沒有超過字大小
+    struct Candidate
+    {
+        float score; // 越小越先合併：重疊多的為負值，其餘為間距
+        int a, b;
+    };
+    std::pmr::vector<Candidate> candidates(scratch);
+    for (int a = 0; a < n; ++a)
+    {
+        if (stats[a].size <= 0)
+            continue;
+        const cv::Rect &ra = stats[a].bbox;
+        int cx0, cy0, cx1, cy1;
+        cellRange(ra, max_gap + 1, cx0, cy0, cx1, cy1);
+        for (int cy = cy0; cy <= cy1; ++cy)
+        {
+            for (int cx = cx0; cx <= cx1; ++cx)
+            {
+                const int idx = cy * grid_w + cx;
+                for (int k = cell_start[idx]; k < cell_start[idx + 1]; ++k)
+                {
+                    const int b = cell_items[k];
+                    if (b <= a)
+                        continue;
+                    const cv::Rect &rb = stats[b].bbox;
+                    // 同一對外框可能同時出現在好幾格，只在固定的一格處理：
+                    // 取 b 外框內最靠近 a 左上角右下方的那一點所在的格子
+                    const int own_x = (std::min(std::max(ra.x, rb.x), rb.x + rb.width - 1) - min_x) / cell;
+                    const int own_y = (std::min(std::max(ra.y, rb.y), rb.y + rb.height - 1) - min_y) / cell;
+                    if (own_x != cx || own_y != cy)
+                        continue;
+                    const cv::Rect u = ra | rb;
+                    if (u.width > max_side || u.height > max_side)
+                        continue;
+                    const int gap_x = std::max(ra.x, rb.x) - std::min(ra.x + ra.width, rb.x + rb.width);
+                    const int gap_y = std::max(ra.y, rb.y) - std::min(ra.y + ra.height, rb.y + rb.height);
+                    const int gap = std::max(gap_x, gap_y);
+                    if (gap > max_gap)
+                        continue;
+                    float score = static_cast<float>(std::max(gap, 0));
+                    if (gap_x < 0 && gap_y < 0)
+                    {
+                        const float overlap = static_cast<float>(gap_x) * gap_y /
+                                              std::min(ra.area(), rb.area());
+                        if (overlap >= options.overlap_fraction)
+                            score = -overlap;
+                    }
+                    candidates.push_back(Candidate{score, a, b});
+                }
+            }
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate &x, const Candidate &y)
+              { return x.score != y.score ? x.score < y.score : (x.a != y.a ? x.a < y.a : x.b < y.b); });
+
+    // 由最近的配對開始合併；每組維護合併後的外框，超過字大小就拒絕，避免鏈式合併跨到隔壁字
+    std::pmr::vector<int> parent(n, scratch);
+    std::iota(parent.begin(), parent.end(), 0);
+    std::pmr::vector<cv::Rect> group_box(scratch);
+    group_box.reserve(n);
+    for (const auto &s : stats)
+        group_box.push_back(s.bbox);
+    auto find = [&](int x)
+    {
+        while (parent[x] != x)
+        {
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    };
+    for (const auto &cand : candidates)
+    {
+        const int ra = find(cand.a);
+        const int rb = find(cand.b);
+        if (ra == rb)
+            continue;
+        const cv::Rect u = group_box[ra] | group_box[rb];
+        if (u.width > max_side || u.height > max_side)
+            continue;
+        const int root = std::min(ra, rb);
+        parent[std::max(ra, rb)] = root;
+        group_box[root] = u;
+    }
+
+    // 依組輸出：root 是組內最小的筆畫索引，所以依 root 遞增就是依第一個筆畫排序
+    std::pmr::vector<int> group_of(n, -1, scratch);
+    int group_cnt = 0;
+    for (int c = 0; c < n; ++c)
+    {
+        if (stats[c].size > 0 && find(c) == c)
+            group_of[c] = group_cnt++;
+    }
+    characters.offsets.assign(group_cnt + 1, 0);
+    for (int c = 0; c < n; ++c)
+    {
+        if (stats[c].size > 0)
+            characters.offsets[group_of[find(c)] + 1] += stats[c].size;
+    }
+    for (int g = 0; g < group_cnt; ++g)
+        characters.offsets[g + 1] += characters.offsets[g];
+    characters.indices.resize(characters.offsets.back());
+    std::pmr::vector<int> fill(characters.offsets.begin(), characters.offsets.end() - 1, scratch);
+    for (int c = 0; c < n; ++c)
+    {
+        if (stats[c].size <= 0)
+            continue;
+        int &pos = fill[group_of[find(c)]];
+        for (int idx : clusters[c])
+            characters.indices[pos++] = idx;
+    }
+}
+
+// 版面分析：把叢集分成橫式文字行，決定閱讀順序與每個字的基線偏移
+struct TextLine
+{
+    int top;      // 行內字形外框的最上緣
+    int bottom;   // 行內字形外框的最下緣（不含）
+    int baseline; // 行基線 y（主要字形外框底部的中位數）
+    int first;    // PageLayout::order 中的起點
+    int count;
+};
+
+struct PageLayout
+{
+    std::pmr::vector<TextLine> lines;      // 由上而下
+    std::pmr::vector<int> order;           // 閱讀順序的叢集索引，第 i 行是 order[first, first + count)
+    std::pmr::vector<int> line_of;         // 叢集 -> 行，-1 表示不屬於任何行
+    std::pmr::vector<int> baseline_offset; // 叢集外框底部 - 所在行的基線
+
+    explicit PageLayout(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+        : lines(resource), order(resource), line_of(resource), baseline_offset(resource) {}
+};
+
+struct LayoutOptions
+{
+    int min_points = 4;         // 點數更少的叢集視為雜點，不參與分行，只依位置掛到某一行
+    float core_fraction = 0.5f; // 分行時只用外框中間這一段高度，避免上下伸出的筆畫把兩行黏在一起
+};
+
+// 以各字形「核心」y 區間的投影來分行：依核心上緣排序後掃過去，核心區間有重疊就是同一行，
+// 投影出現空隙就換行。行內依質心 x 排序。整體 O(n log n)
+void analyzeLayout(std::span<const ClusterStats> stats, PageLayout &layout,
+                   std::pmr::memory_resource *scratch = std::pmr::get_default_resource(),
+                   const LayoutOptions &options = LayoutOptions())
+{
+    const int n = static_cast<int>(stats.size());
+    layout.lines.clear();
+    layout.order.clear();
+    layout.line_of.assign(n, -1);
+    layout.baseline_offset.assign(n, 0);
+
+    auto coreTop = [&](int c) { return stats[c].bbox.y + stats[c].bbox.height * (1.0f - options.core_fraction) * 0.5f; };
+    auto coreBottom = [&](int c) { return stats[c].bbox.y + stats[c].bbox.height * (1.0f + options.core_fraction) * 0.5f; };
+
+    std::pmr::vector<int> main_glyphs(scratch);
+    std::pmr::vector<int> small_glyphs(scratch);
+    for (int c = 0; c < n; ++c)
+    {
+        if (stats[c].size <= 0)
+            continue;
+        (stats[c].size >= options.min_points ? main_glyphs : small_glyphs).push_back(c);
+    }
+    std::sort(main_glyphs.begin(), main_glyphs.end(), [&](int a, int b) { return coreTop(a) < coreTop(b); });
+
+    // 掃描：核心區間聯集的每一段就是一行；同時記下整行外框的上下緣
+    std::pmr::vector<float> band_top(scratch), band_bottom(scratch);
+    std::pmr::vector<int> full_top(scratch), full_bottom(scratch);
+    for (int c : main_glyphs)
+    {
+        if (band_bottom.empty() || coreTop(c) > band_bottom.back())
+        {
+            band_top.push_back(coreTop(c));
+            band_bottom.push_back(coreBottom(c));
+            full_top.push_back(stats[c].bbox.y);
+            full_bottom.push_back(stats[c].bbox.y + stats[c].bbox.height);
+        }
+        else
+        {
+            band_bottom.back() = std::max(band_bottom.back(), coreBottom(c));
+            full_top.back() = std::min(full_top.back(), stats[c].bbox.y);
+            full_bottom.back() = std::max(full_bottom.back(), stats[c].bbox.y + stats[c].bbox.height);
+        }
+        layout.line_of[c] = static_cast<int>(band_top.size()) - 1;
+    }
+    const int line_cnt = static_cast<int>(band_top.size());
+
+    // 雜點（標點、點畫）掛到外框涵蓋其質心、且核心最近的那一行
+    for (int c : small_glyphs)
+    {
+        const float cy = stats[c].centroid.y;
+        const int next = static_cast<int>(std::upper_bound(band_top.begin(), band_top.end(), cy) - band_top.begin());
+        float best_dist = FLT_MAX;
+        for (int line = std::max(0, next - 1); line <= std::min(next, line_cnt - 1); ++line)
+        {
+            if (cy < full_top[line] || cy > full_bottom[line])
+                continue;
+            const float dist = cy < band_top[line] ? band_top[line] - cy : std::max(0.0f, cy - band_bottom[line]);
+            if (dist < best_dist)
+            {
+                best_dist = dist;
+                layout.line_of[c] = line;
+            }
+        }
+    }
+
+    // 依行分組（counting sort），行內依 x 排序
+    layout.lines.assign(line_cnt, TextLine{INT_MAX, INT_MIN, 0, 0, 0});
+    for (int c = 0; c < n; ++c)
+    {
+        if (layout.line_of[c] >= 0)
+            ++layout.lines[layout.line_of[c]].count;
+    }
+    int running = 0;
+    for (auto &line : layout.lines)
+    {
+        line.first = running;
+        running += line.count;
+    }
+    layout.order.resize(running);
+    std::pmr::vector<int> fill(scratch);
+    fill.reserve(line_cnt);
+    for (const auto &line : layout.lines)
+        fill.push_back(line.first);
+    for (int c = 0; c < n; ++c)
+    {
+        const int line = layout.line_of[c];
+        if (line < 0)
+            continue;
+        layout.order[fill[line]++] = c;
+        TextLine &l = layout.lines[line];
+        l.top = std::min(l.top, stats[c].bbox.y);
+        l.bottom = std::max(l.bottom, stats[c].bbox.y + stats[c].bbox.height);
+    }
+
+    std::pmr::vector<int> bottoms(scratch);
+    for (auto &line : layout.lines)
+    {
+        auto begin = layout.order.begin() + line.first;
+        auto end = begin + line.count;
+        std::sort(begin, end, [&](int a, int b) { return stats[a].centroid.x < stats[b].centroid.x; });
+
+        bottoms.clear();
+        for (auto it = begin; it != end; ++it)
+        {
+            if (stats[*it].size >= options.min_points)
+                bottoms.push_back(stats[*it].bbox.y + stats[*it].bbox.height);
+        }
+        if (!bottoms.empty())
+        {
+            std::nth_element(bottoms.begin(), bottoms.begin() + bottoms.size() / 2, bottoms.end());
+            line.baseline = bottoms[bottoms.size() / 2];
+        }
+        else
+        {
+            line.baseline = line.bottom;
+        }
+        for (auto it = begin; it != end; ++it)
+            layout.baseline_offset[*it] = stats[*it].bbox.y + stats[*it].bbox.height - line.baseline;
+    }
+}
+
+long currentProcessId()
+{
+#ifdef _WIN32
+    return static_cast<long>(_getpid());
+#else
+    return static_cast<long>(getpid());
+#endif
+}
+
+// 輸出檔一律先寫到暫存路徑再 rename 過去：中途當掉只會留下暫存檔，不會有寫一半的正式檔。
+// 同一個檔案可能有好幾個行程同時在寫（spool 裡被收回重做的 shard、共用的結果快取，可能在不同機器上），
+// 所以暫存檔名帶行程 id、每個行程各自的隨機數與流水號，彼此不會寫進同一個暫存檔
+string temporaryPathFor(const string &path)
+{
+    static const uint32_t nonce = std::random_device{}();
+    static std::atomic<uint32_t> sequence{0};
+    std::ostringstream suffix;
+    suffix << ".partial-" << currentProcessId() << "-" << std::hex << nonce << "-" << sequence.fetch_add(1);
+    filesystem::path p(path);
+    // 保留副檔名，cv::imwrite 依副檔名決定格式
+    return (p.parent_path() / (p.stem().string() + suffix.str() + p.extension().string())).string();
+}
+
+bool commitTemporaryFile(const string &temp_path, const string &path)
+{
+    std::error_code ec;
+    filesystem::rename(temp_path, path, ec);
+    if (ec)
+    {
+        cerr << "Failed to move " << temp_path << " to " << path << ": " << ec.message() << endl;
+        return false;
+    }
+    return true;
+}
+
+#ifdef _WIN32
+// 路徑在程式裡一律是 UTF-8；*A 版 Win32 API 會用系統 code page 解讀，中文檔名會開錯檔，所以轉成 UTF-16 走 *W 版
+std::wstring widePath(const string &path)
+{
+    const int length = MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()), nullptr, 0);
+    std::wstring wide(length, L'\0');
+    if (length > 0)
+        MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()), wide.data(), length);
+    return wide;
+}
+#endif
+
+// 跨行程的獨佔鎖（鎖一個獨立的 .lock 檔，被鎖的資料檔本身可以安全地 rename）
+class FileLock
+{
+public:
+    explicit FileLock(const string &lock_path)
+    {
+#ifdef _WIN32
+        handle = CreateFileW(widePath(lock_path).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle != INVALID_HANDLE_VALUE)
+        {
+            OVERLAPPED overlapped = {};
+            locked = LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped) != 0;
+        }
+#else
+        fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd >= 0)
+            locked = flock(fd, LOCK_EX) == 0;
+#endif
+        if (!locked)
+            cerr << "Failed to lock: " << lock_path << endl;
+    }
+
+    FileLock(const FileLock &) = delete;
+    FileLock &operator=(const FileLock &) = delete;
+
+    ~FileLock()
+    {
+#ifdef _WIN32
+        if (locked)
+        {
+            OVERLAPPED overlapped = {};
+            UnlockFileEx(handle, 0, 1, 0, &overlapped);
+        }
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+#else
+        if (locked)
+            flock(fd, LOCK_UN);
+        if (fd >= 0)
+            ::close(fd);
+#endif
+    }
+
+    bool ok() const { return locked; }
+
+private:
+    bool locked = false;
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+};
+
+// 二值化設定庫：取代每次整份重寫的 imgBinHistory.json。
+// 資料是 append-only 的 JSON Lines 日誌，第一行是表頭（含 generation），之後每行一筆操作：
+//   {"op":"put","id":3,"setting":{...}}   新增或取代（同名的設定沿用原本的 id）
+//   {"op":"delete","id":3}
+//   {"op":"clear"}
+// 記憶體內以 id 與名稱各建一個 hash 索引，查詢 O(1)。寫入時先拿檔案鎖，
+// 補讀其他行程在上次之後 append 的紀錄，再配 id、append，所以多個批次 worker 同時寫也安全。
+// compact() 把存活的設定重寫成新檔並把 generation + 1，其他行程看到 generation 變了就整份重讀
+class BinaryThresholdSettingStore
+{
+public:
+    struct Entry
+    {
+        int id;
+        BinaryThresholdSetting setting;
+    };
+
+    // 日誌不存在時建立新檔，並匯入舊的 imgBinHistory.json（若 legacy_json_path 存在）
+    bool open(const string &log_path, const string &legacy_json_path = "")
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        path = log_path;
+        resetLocked();
+        FileLock lock(lockPath());
+        if (!lock.ok())
+            return false;
+
+        if (!filesystem::exists(path))
+        {
+            if (!writeLogLocked({}, 1))
+                return false;
+            if (!legacy_json_path.empty() && filesystem::exists(legacy_json_path))
+            {
+                for (const auto &setting : loadBinaryThresholdSettings(legacy_json_path))
+                    appendPutLocked(setting);
+                cout << "Imported " << entries.size() << " binary threshold settings into: " << path << endl;
+            }
+            return true;
+        }
+        return refreshLocked();
+    }
+
+    // 讀進其他行程新增的紀錄
+    bool refresh()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        FileLock lock(lockPath());
+        return lock.ok() && refreshLocked();
+    }
+
+    // 回傳 id；失敗時回傳 0
+    int put(const BinaryThresholdSetting &setting)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        FileLock lock(lockPath());
+        if (!lock.ok() || !refreshLocked())
+            return 0;
+        return appendPutLocked(setting);
+    }
+
+    bool remove(int id)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        FileLock lock(lockPath());
+        if (!lock.ok() || !refreshLocked() || !by_id.count(id))
+            return false;
+        Json::Value record;
+        record["op"] = "delete";
+        record["id"] = id;
+        if (!appendRecordLocked(record))
+            return false;
+        applyLocked(record);
+        return true;
+    }
+
+    bool clear()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        FileLock lock(lockPath());
+        if (!lock.ok() || !refreshLocked())
+            return false;
+        Json::Value record;
+        record["op"] = "clear";
+        if (!appendRecordLocked(record))
+            return false;
+        applyLocked(record);
+        return true;
+    }
+
+    // 把存活的設定重寫成新日誌（id 不變），丟掉被取代與刪除的紀錄
+    bool compact()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        FileLock lock(lockPath());
+        if (!lock.ok() || !refreshLocked())
+            return false;
+        const size_t before = record_count;
+        if (!writeLogLocked(listLocked(), generation + 1))
+            return false;
+        resetLocked();
+        if (!refreshLocked())
+            return false;
+        cout << "Compacted settings store: " << before << " -> " << record_count << " records" << endl;
+        return true;
+    }
+
+    std::optional<Entry> findById(int id) const
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = by_id.find(id);
+        if (it == by_id.end())
+            return std::nullopt;
+        return entries[it->second];
+    }
+
+    std::optional<Entry> findByName(const string &name) const
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = by_name.find(name);
+        if (it == by_name.end())
+            return std::nullopt;
+        return entries[by_id.at(it->second)];
+    }
+
+    // 依 id 排序的存活設定
+    vector<Entry> list() const
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return listLocked();
+    }
+
+    // 匯入舊格式（JSON 陣列），同名的會被取代
+    bool importJson(const string &json_path)
+    {
+        vector<BinaryThresholdSetting> settings = loadBinaryThresholdSettings(json_path);
+        std::lock_guard<std::mutex> guard(mutex);
+        FileLock lock(lockPath());
+        if (!lock.ok() || !refreshLocked())
+            return false;
+        for (const auto &setting : settings)
+        {
+            if (!appendPutLocked(setting))
+                return false;
+        }
+        return true;
+    }
+
+    void exportJson(const string &json_path) const
+    {
+        vector<BinaryThresholdSetting> settings;
+        for (const auto &entry : list())
+            settings.push_back(entry.setting);
+        saveBinaryThresholdSettings(settings, json_path);
+    }
+
+    const string &logPath() const { return path; }
+
+private:
+    string lockPath() const { return path + ".lock"; }
+
+    void resetLocked()
+    {
+        entries.clear();
+        by_id.clear();
+        by_name.clear();
+        next_id = 1;
+        generation = 0;
+        read_offset = 0;
+        record_count = 0;
+    }
+
+    vector<Entry> listLocked() const
+    {
+        vector<Entry> live;
+        live.reserve(by_id.size());
+        for (const auto &entry : entries)
+        {
+            auto it = by_id.find(entry.id);
+            if (it != by_id.end() && &entries[it->second] == &entry)
+                live.push_back(entry);
+        }
+        std::sort(live.begin(), live.end(), [](const Entry &a, const Entry &b) { return a.id < b.id; });
+        return live;
+    }
+
+    // 表頭記下 next_id，壓縮掉的 id 不會再被配給新設定（舊輸出裡記錄的 id 不會指到別的設定）
+    static string headerFor(uint64_t gen, int first_free_id)
+    {
+        return "{\"store\":\"binary_threshold_settings\",\"version\":1,\"generation\":" + to_string(gen) +
+               ",\"next_id\":" + to_string(first_free_id) + "}";
+    }
+
+    static string serialize(const Json::Value &record)
+    {
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        return Json::writeString(builder, record);
+    }
+
+    bool writeLogLocked(const vector<Entry> &live, uint64_t gen)
+    {
+        const string temp_path = temporaryPathFor(path);
+        {
+            ofstream out(temp_path, ios::binary | ios::trunc);
+            if (!out.is_open())
+            {
+                cerr << "Failed to write settings store: " << path << endl;
+                return false;
+            }
+            out << headerFor(gen, next_id) << '\n';
+            for (const auto &entry : live)
+            {
+                Json::Value record;
+                record["op"] = "put";
+                record["id"] = entry.id;
+                record["setting"] = binaryThresholdSettingToJson(entry.setting);
+                out << serialize(record) << '\n';
+            }
+            if (!out.good())
+                return false;
+        }
+        return commitTemporaryFile(temp_path, path);
+    }
+
+    // 只處理以換行結尾的完整紀錄；表頭的 generation 變了就從頭重讀
+    bool refreshLocked()
+    {
+        ifstream in(path, ios::binary);
+        if (!in.is_open())
+        {
+            cerr << "Failed to open settings store: " << path << endl;
+            return false;
+        }
+        string header;
+        if (!getline(in, header))
+            return false;
+        Json::CharReaderBuilder builder;
+        unique_ptr<Json::CharReader> reader(builder.newCharReader());
+        Json::Value header_value;
+        string errors;
+        if (!reader->parse(header.data(), header.data() + header.size(), &header_value, &errors) ||
+            header_value["version"].asInt() != 1)
+        {
+            cerr << "Unsupported settings store: " << path << endl;
+            return false;
+        }
+        const uint64_t file_generation = header_value["generation"].asUInt64();
+        if (file_generation != generation || read_offset == 0)
+        {
+            resetLocked();
+            generation = file_generation;
+            next_id = std::max(1, header_value["next_id"].asInt());
+            read_offset = static_cast<uint64_t>(in.tellg());
+        }
+
+        in.seekg(static_cast<std::streamoff>(read_offset));
+        string line;
+        while (true)
+        {
+            const std::streamoff line_start = in.tellg();
+            if (!getline(in, line))
+                break;
+            if (in.eof())
+            {
+                // 沒有換行結尾：別的行程寫到一半（或當掉留下的半行），下次再讀
+                in.clear();
+                in.seekg(line_start);
+                break;
+            }
+            read_offset = static_cast<uint64_t>(in.tellg());
+            Json::Value record;
+            if (line.empty() || !reader->parse(line.data(), line.data() + line.size(), &record, &errors))
+                continue;
+            applyLocked(record);
+        }
+        return true;
+    }
+
+    void applyLocked(const Json::Value &record)
+    {
+        ++record_count;
+        const string op = record["op"].asString();
+        if (op == "put")
+        {
+            const int id = record["id"].asInt();
+            BinaryThresholdSetting setting = binaryThresholdSettingFromJson(record["setting"]);
+            auto old_id = by_name.find(setting.name);
+            if (old_id != by_name.end() && old_id->second != id)
+                by_id.erase(old_id->second);
+            auto old = by_id.find(id);
+            if (old != by_id.end() && entries[old->second].setting.name != setting.name)
+                by_name.erase(entries[old->second].setting.name);
+            by_id[id] = entries.size();
+            by_name[setting.name] = id;
+            entries.push_back(Entry{id, std::move(setting)});
+            next_id = std::max(next_id, id + 1);
+        }
+        else if (op == "delete")
+        {
+            auto it = by_id.find(record["id"].asInt());
+            if (it != by_id.end())
+            {
+                by_name.erase(entries[it->second].setting.name);
+                by_id.erase(it);
+            }
+        }
+        else if (op == "clear")
+        {
+            by_id.clear();
+            by_name.clear();
+        }
+    }
+
+    bool appendRecordLocked(const Json::Value &record)
+    {
+        // 上一個寫入者若在行中間當掉，先補換行
+        bool needs_newline = false;
+        {
+            ifstream tail(path, ios::binary | ios::ate);
+            const std::streamoff size = tail.tellg();
+            if (size > 0)
+            {
+                tail.seekg(-1, ios::end);
+                needs_newline = tail.get() != '\n';
+            }
+        }
+        ofstream out(path, ios::binary | ios::app);
+        if (!out.is_open())
+        {
+            cerr << "Failed to append to settings store: " << path << endl;
+            return false;
+        }
+        if (needs_newline)
+            out << '\n';
+        out << serialize(record) << '\n';
+        out.close();
+        if (out.fail())
+            return false;
+        // 持有鎖，檔尾就是剛寫完的位置
+        std::error_code ec;
+        read_offset = filesystem::file_size(path, ec);
+        return !ec;
+    }
+
+    int appendPutLocked(const BinaryThresholdSetting &setting)
+    {
+        auto existing = by_name.find(setting.name);
+        const int id = existing != by_name.end() ? existing->second : next_id;
+        Json::Value record;
+        record["op"] = "put";
+        record["id"] = id;
+        record["setting"] = binaryThresholdSettingToJson(setting);
+        if (!appendRecordLocked(record))
+            return 0;
+        applyLocked(record);
+        return id;
+    }
+
+    string path;
+    vector<Entry> entries;                  // 讀到的每一筆 put（含已被取代的），by_id 指向最新那筆
+    std::unordered_map<int, size_t> by_id;  // id -> entries 索引
+    std::unordered_map<string, int> by_name;
+    int next_id = 1;
+    uint64_t generation = 0;
+    uint64_t read_offset = 0;
+    size_t record_count = 0;
+    mutable std::mutex mutex;
+};
+
+// 設定庫的位置：與 imgBinHistory.json 同一個資料夾
+string getSettingsStorePath()
+{
+    return (filesystem::path(getDocumentPath()).parent_path() / "imgBinSettings.jsonl").string();
+}
+
+// 字形匯出：把每個叢集裁成固定 em 框的遮罩，打包成 atlas 圖檔 + JSON 索引。
+// 字形每滿 shard_glyphs 個就寫出一張 atlas 分片，記憶體裡最多只留一個分片的像素；
+// 索引項目也邊做邊寫到暫存檔，write() 時才接上表頭
+class GlyphAtlasExporter
+{
+public:
+    struct Options
+    {
+        int em_size = 64;          // 每個字形格子的邊長 (px)
+        int padding = 4;           // 格子內留白
+        int min_points = 1;        // 小於此點數的叢集不匯出
+        int shard_glyphs = 4096;   // 每張 atlas 分片的字形數（64 px 時約 16 MB）
+    };
+
+    struct GlyphEntry
+    {
+        int source_index;    // sources[] 的索引
+        int cluster_id;
+        cv::Rect bbox;       // 原圖座標
+        int baseline;        // 原圖座標的基線 y
+        int line;            // 所在文字行（沒有版面分析時為 -1）
+        int order;           // 該頁的閱讀順序
+        int points;
+        float scale;         // 原圖 -> em 框的縮放
+        cv::Point offset;    // 字形在格子內的左上角
+    };
+
+    GlyphAtlasExporter() = default;
+    explicit GlyphAtlasExporter(const Options &opts) : options(opts) {}
+    GlyphAtlasExporter(const GlyphAtlasExporter &) = delete;
+    GlyphAtlasExporter &operator=(const GlyphAtlasExporter &) = delete;
+
+    ~GlyphAtlasExporter()
+    {
+        if (items_file.is_open())
+        {
+            items_file.close();
+            std::error_code ec;
+            filesystem::remove(items_path, ec);
+        }
+    }
+
+    // 指定輸出位置後，滿一個分片就直接寫出；沒呼叫的話全部留到 write() 才寫。
+    // write() 可以重複呼叫（--watch 每輪一次）：寫滿的分片不再重寫，只重寫最後一個未滿的分片與索引
+    bool open(const string &atlas_path, const string &index_path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return openLocked(atlas_path, index_path);
+    }
+
+    // 平行裁切一頁的所有叢集；可由多個執行緒同時呼叫。每頁的暫存都從 scratch 取得。
+    // 有版面分析時依閱讀順序輸出，基線用所在行的基線
+    template <typename Clusters>
+    void addPage(const string &source_path,
+                 std::span<const cv::Point> points,
+                 const Clusters &clusters,
+                 std::span<const ClusterStats> stats,
+                 const PageLayout *layout = nullptr,
+                 std::pmr::memory_resource *scratch = std::pmr::get_default_resource())
+    {
+        const int em = options.em_size;
+        const size_t cell_bytes = static_cast<size_t>(em) * em;
+
+        std::pmr::vector<int> selected(scratch);
+        selected.reserve(clusters.size());
+        if (layout)
+        {
+            for (int c : layout->order)
+            {
+                if (stats[c].size >= options.min_points)
+                    selected.push_back(c);
+            }
+            // 沒掛到任何一行的叢集（line -1）不在閱讀順序裡，接在最後輸出
+            for (size_t c = 0; c < clusters.size(); ++c)
+            {
+                if (layout->line_of[c] < 0 && stats[c].size >= options.min_points)
+                    selected.push_back(static_cast<int>(c));
+            }
+        }
+        else
+        {
+            for (size_t c = 0; c < clusters.size(); ++c)
+            {
+                if (stats[c].size >= options.min_points)
+                    selected.push_back(static_cast<int>(c));
+            }
+        }
+
+        std::pmr::vector<GlyphEntry> page_entries(selected.size(), scratch);
+        std::pmr::vector<uchar> page_pixels(selected.size() * cell_bytes, 0, scratch);
+
+        auto work = [&](size_t begin, size_t end)
+        {
+            for (size_t k = begin; k < end; ++k)
+            {
+                const int c = selected[k];
+                cv::Mat cell(em, em, CV_8UC1, page_pixels.data() + k * cell_bytes);
+                normalizeGlyph(points, clusters[c], stats[c].bbox, cell, page_entries[k]);
+                page_entries[k].cluster_id = c;
+                page_entries[k].bbox = stats[c].bbox;
+                const int line = layout ? layout->line_of[c] : -1;
+                page_entries[k].line = line;
+                page_entries[k].order = static_cast<int>(k);
+                page_entries[k].baseline = line >= 0 ? layout->lines[line].baseline : stats[c].bbox.y + stats[c].bbox.height;
+                page_entries[k].points = stats[c].size;
+            }
+        };
+
+        sharedPool().parallelFor(0, selected.size(), 16, work);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        const int source_index = static_cast<int>(sources.size());
+        sources.push_back(Source{source_path});
+        for (size_t k = 0; k < page_entries.size(); ++k)
+        {
+            if (layout && page_entries[k].line < 0)
+                ++sources[source_index].unlined;
+            ++sources[source_index].glyphs;
+            page_entries[k].source_index = source_index;
+            entries.push_back(page_entries[k]);
+            glyph_pixels.insert(glyph_pixels.end(), page_pixels.begin() + k * cell_bytes,
+                                page_pixels.begin() + (k + 1) * cell_bytes);
+            // 其他匯出執行緒等這個分片寫完；分片大小固定，所以等待時間有上限
+            if (items_file.is_open() && static_cast<int>(entries.size()) >= options.shard_glyphs)
+                closeShardLocked();
+        }
+    }
+
+    // 拿掉一頁先前加入的字形（頁面被刪除或內容變了要重做）。還沒寫滿的分片直接移除；
+    // 已寫滿的分片不重寫，格子留空，只是索引不再列出
+    void removePage(const string &source_path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &source : sources)
+        {
+            if (source.path == source_path)
+                source.dropped = true;
+        }
+        const size_t cell_bytes = static_cast<size_t>(options.em_size) * options.em_size;
+        size_t kept = 0;
+        for (size_t k = 0; k < entries.size(); ++k)
+        {
+            if (sources[entries[k].source_index].dropped)
+                continue;
+            if (kept != k)
+            {
+                entries[kept] = entries[k];
+                std::copy_n(glyph_pixels.begin() + k * cell_bytes, cell_bytes, glyph_pixels.begin() + kept * cell_bytes);
+            }
+            ++kept;
+        }
+        entries.resize(kept);
+        glyph_pixels.resize(kept * cell_bytes);
+    }
+
+    size_t glyphCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = 0;
+        for (const auto &source : sources)
+            count += source.dropped ? 0 : source.glyphs;
+        return count;
+    }
+
+    // 寫進索引的 "metadata"（例如產生這份輸出的二值化設定）
+    void setMetadata(const string &key, const Json::Value &value)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        metadata[key] = value;
+    }
+
+    // 寫出最後一個分片與索引。未滿的分片留在記憶體，之後加入的頁面會繼續填它，下次 write() 再重寫
+    bool write(const string &atlas_path, const string &index_path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!items_file.is_open() && !openLocked(atlas_path, index_path))
+            return false;
+        vector<Shard> listed = shards;
+        vector<string> open_items;
+        if (!entries.empty() || shards.empty())
+        {
+            listed.emplace_back();
+            writeShardLocked(listed.back(), open_items);
+        }
+        items_file.flush();
+        if (!ok || !items_file.good())
+            return false;
+
+        // 上一次輸出比較多分片時，多出來的舊分片不再屬於這份索引
+        for (size_t k = listed.size();; ++k)
+        {
+            std::error_code ec;
+            if (!filesystem::remove(shardPath(k), ec))
+                break;
+        }
+
+        Json::Value atlases(Json::arrayValue);
+        for (const auto &shard : listed)
+        {
+            Json::Value item;
+            item["file"] = shard.file;
+            item["columns"] = shard.columns;
+            item["rows"] = shard.rows;
+            item["glyphs"] = shard.glyphs;
+            atlases.append(item);
+        }
+        // 單一分片時 atlas/columns/rows 與舊格式相同
+        Json::Value head;
+        head["atlas"] = listed.front().file;
+        head["atlases"] = atlases;
+        head["em_size"] = options.em_size;
+        head["columns"] = listed.front().columns;
+        head["rows"] = listed.front().rows;
+        if (!metadata.empty())
+            head["metadata"] = metadata;
+
+        size_t glyphs = 0;
+        const string index_temp = temporaryPathFor(index_path);
+        {
+            ofstream file(index_temp, ios::binary | ios::trunc);
+            ifstream items(items_path, ios::binary);
+            if (!file.is_open() || !items.is_open())
+            {
+                cerr << "Failed to write glyph index: " << index_path << endl;
+                return false;
+            }
+            Json::StreamWriterBuilder builder;
+            builder["indentation"] = "  ";
+            string text = Json::writeString(builder, head);
+            // 表頭物件去掉結尾的 "}"，再接上逐筆寫好的 glyphs 陣列
+            text.erase(text.find_last_of('}'));
+            while (!text.empty() && isspace(static_cast<unsigned char>(text.back())))
+                text.pop_back();
+            file << text << ",\n  \"glyphs\" : [\n";
+            // 暫存檔一行一個字形，依 item_sources 略過已拿掉的頁面
+            string line;
+            for (size_t k = 0; k < item_sources.size() && std::getline(items, line); ++k)
+            {
+                if (sources[item_sources[k]].dropped)
+                    continue;
+                file << (glyphs++ > 0 ? ",\n    " : "    ") << line;
+            }
+            for (const auto &item : open_items)
+                file << (glyphs++ > 0 ? ",\n    " : "    ") << item;
+            file << "\n  ]\n}\n";
+            if (!file.good())
+            {
+                cerr << "Failed to write glyph index: " << index_path << endl;
+                return false;
+            }
+        }
+        if (!commitTemporaryFile(index_temp, index_path))
+            return false;
+        size_t unlined = 0;
+        for (const auto &source : sources)
+            unlined += source.dropped ? 0 : source.unlined;
+        cout << "Exported " << glyphs << " glyphs in " << listed.size() << " atlas shard"
+             << (listed.size() == 1 ? "" : "s") << " to: " << atlas_path << endl;
+        if (unlined > 0)
+            cout << unlined << " glyphs are not on any text line (exported with line -1 after each page's reading order)" << endl;
+        return true;
+    }
+
+private:
+    struct Shard
+    {
+        string file;
+        int columns = 0;
+        int rows = 0;
+        int glyphs = 0;
+    };
+
+    struct Source
+    {
+        string path;
+        size_t glyphs = 0;
+        size_t unlined = 0;   // 不在任何文字行上的字形
+        bool dropped = false; // removePage() 拿掉的，索引不再列出
+    };
+
+    bool openLocked(const string &atlas_path, const string &index_path)
+    {
+        atlas_base = atlas_path;
+        items_path = temporaryPathFor(index_path) + ".glyphs";
+        items_file.open(items_path, ios::binary | ios::trunc);
+        if (!items_file.is_open())
+        {
+            cerr << "Failed to write glyph index: " << index_path << endl;
+            ok = false;
+            return false;
+        }
+        return true;
+    }
+
+    // 分片 0 就是指定的 atlas 檔名，之後是 <stem>_1<ext>、<stem>_2<ext>…
+    string shardPath(size_t k) const
+    {
+        if (k == 0)
+            return atlas_base;
+        filesystem::path p(atlas_base);
+        return (p.parent_path() / (p.stem().string() + "_" + std::to_string(k) + p.extension().string())).string();
+    }
+
+    // 把目前累積的字形打包成分片 shards.size()；items 收到每個字形一行的索引項目
+    bool writeShardLocked(Shard &shard, vector<string> &items)
+    {
+        const int em = options.em_size;
+        const size_t cell_bytes = static_cast<size_t>(em) * em;
+        const int n = static_cast<int>(entries.size());
+        const int columns = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<double>(n)))));
+        const int rows = std::max(1, (n + columns - 1) / columns);
+        const size_t shard_index = shards.size();
+        const string path = shardPath(shard_index);
+
+        cv::Mat atlas = cv::Mat::zeros(rows * em, columns * em, CV_8UC1);
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        items.reserve(items.size() + n);
+        for (int k = 0; k < n; ++k)
+        {
+            const int col = k % columns;
+            const int row = k / columns;
+            cv::Mat glyph(em, em, CV_8UC1, glyph_pixels.data() + k * cell_bytes);
+            cv::Mat cell_roi = atlas(cv::Rect(col * em, row * em, em, em));
+            glyph.copyTo(cell_roi);
+
+            const GlyphEntry &e = entries[k];
+            Json::Value item;
+            item["source"] = sources[e.source_index].path;
+            item["cluster"] = e.cluster_id;
+            Json::Value bbox(Json::arrayValue);
+            bbox.append(e.bbox.x);
+            bbox.append(e.bbox.y);
+            bbox.append(e.bbox.width);
+            bbox.append(e.bbox.height);
+            item["bbox"] = bbox;
+            item["baseline"] = e.baseline;
+            item["line"] = e.line;
+            item["order"] = e.order;
+            item["points"] = e.points;
+            item["atlas"] = static_cast<int>(shard_index);
+            Json::Value cell(Json::arrayValue);
+            cell.append(col);
+            cell.append(row);
+            item["cell"] = cell;
+            item["scale"] = e.scale;
+            Json::Value offset(Json::arrayValue);
+            offset.append(e.offset.x);
+            offset.append(e.offset.y);
+            item["offset"] = offset;
+            items.push_back(Json::writeString(builder, item));
+        }
+
+        const string atlas_temp = temporaryPathFor(path);
+        if (!cv::imwrite(atlas_temp, atlas) || !commitTemporaryFile(atlas_temp, path))
+        {
+            cerr << "Failed to write glyph atlas: " << path << endl;
+            ok = false;
+        }
+        shard = Shard{filesystem::path(path).filename().string(), columns, rows, n};
+        return ok;
+    }
+
+    // 分片寫滿：索引項目接到暫存檔，之後不再重寫，然後清掉像素
+    bool closeShardLocked()
+    {
+        Shard shard;
+        vector<string> items;
+        writeShardLocked(shard, items);
+        for (size_t k = 0; k < items.size(); ++k)
+        {
+            items_file << items[k] << '\n';
+            item_sources.push_back(entries[k].source_index);
+        }
+        ok = ok && items_file.good();
+        shards.push_back(shard);
+        entries.clear();
+        glyph_pixels.clear();
+        glyph_pixels.shrink_to_fit();
+        return ok;
+    }
+
+    // 只畫出該叢集自己的像素（外框內其他叢集的筆畫不會混進來），再等比縮放置中到 em 框
+    void normalizeGlyph(std::span<const cv::Point> points, std::span<const int> indices,
+                        const cv::Rect &bbox, cv::Mat &cell, GlyphEntry &entry) const
+    {
+        const int em = options.em_size;
+
+        // 每個執行緒重複使用同一塊裁切緩衝，只在變大時重新配置
+        thread_local vector<uchar> crop_buffer;
+        const size_t crop_bytes = static_cast<size_t>(bbox.width) * bbox.height;
+        if (crop_buffer.size() < crop_bytes)
+            crop_buffer.resize(crop_bytes);
+        std::fill_n(crop_buffer.begin(), crop_bytes, 0);
+        cv::Mat crop(bbox.height, bbox.width, CV_8UC1, crop_buffer.data());
+        for (int idx : indices)
+        {
+            const cv::Point &p = points[idx];
+            crop.at<uchar>(p.y - bbox.y, p.x - bbox.x) = 255;
+        }
+
+        const int inner = std::max(1, em - 2 * options.padding);
+        const float scale = static_cast<float>(inner) / static_cast<float>(std::max(bbox.width, bbox.height));
+        const int w = std::clamp(static_cast<int>(std::lround(bbox.width * scale)), 1, inner);
+        const int h = std::clamp(static_cast<int>(std::lround(bbox.height * scale)), 1, inner);
+        const cv::Point offset((em - w) / 2, (em - h) / 2);
+
+        cv::Mat target = cell(cv::Rect(offset.x, offset.y, w, h));
+        cv::resize(crop, target, target.size(), 0, 0, scale < 1.0f ? cv::INTER_AREA : cv::INTER_LINEAR);
+
+        entry.scale = scale;
+        entry.offset = offset;
+    }
+
+    Options options;
+    mutable std::mutex mutex;
+    vector<Source> sources;
+    vector<GlyphEntry> entries;   // 還沒寫滿的分片
+    vector<uchar> glyph_pixels;   // 每個字形 em * em bytes，依 entries 順序排列
+    Json::Value metadata;
+    string atlas_base;
+    string items_path;            // 已寫滿分片的索引項目（一行一個 JSON 物件）
+    ofstream items_file;
+    vector<int> item_sources;     // items_path 每一行的 source_index
+    vector<Shard> shards;         // 已寫滿的分片
+    bool ok = true;
+};
+
+// 區域（自適應）二值化：只看亮度 L = (max + min) / 2（與 HLS 的 L 相同），
+// 每個像素的門檻由以它為中心、window x window 視窗內的平均 m 與標準差 s 決定：
+//   Sauvola (method 0): T = m * (1 + k * (s / R - 1))
+//   Niblack (method 1): T = m - k * s（k 取正值：淺色紙上的深色字）
+// 視窗和用積分圖（summed-area table）四角相減求出，耗時與視窗大小無關。
+// 積分圖用 uint32 以 2^32 取模累加：視窗上限 255，視窗內平方和 < 255^4 < 2^32，
+// 所以四角相減在模運算下仍然精確，頁面再大也不會溢位，記憶體也只要 uint64 的一半。
+// 三個步驟都平行：逐列求 L 與水平前綴和（列帶）、往下累加（行帶）、逐像素比門檻（列帶）。
+// 輸出與其他色彩空間同義：比門檻亮的像素（紙）為 255
+void computeAdaptiveMask(const cv::Mat &bgr, int method, const float adaptive_threshold[3],
+                         cv::Mat &binary_mask, PageArena *arena = nullptr)
+{
+    const int rows = bgr.rows;
+    const int cols = bgr.cols;
+    const int half = std::clamp(static_cast<int>(adaptive_threshold[0]), 3, 255) / 2;
+    const double k = adaptive_threshold[1];
+    const double range = std::max(1.0f, adaptive_threshold[2]);
+
+    auto temp = [&](int r, int c, int type) { return arena ? arena->mat(r, c, type) : cv::Mat(r, c, type); };
+    cv::Mat lightness = temp(rows, cols, CV_8UC1);
+    cv::Mat sum = temp(rows + 1, cols + 1, CV_32SC1);
+    cv::Mat sqsum = temp(rows + 1, cols + 1, CV_32SC1);
+
+    std::fill_n(sum.ptr<uint32_t>(0), cols + 1, 0u);
+    std::fill_n(sqsum.ptr<uint32_t>(0), cols + 1, 0u);
+    sharedPool().parallelFor(0, static_cast<size_t>(rows), 64, [&](size_t r0, size_t r1)
+    {
+        for (int y = static_cast<int>(r0); y < static_cast<int>(r1); ++y)
+        {
+            const uchar *src = bgr.ptr<uchar>(y);
+            uchar *l = lightness.ptr<uchar>(y);
+            uint32_t *s = sum.ptr<uint32_t>(y + 1);
+            uint32_t *q = sqsum.ptr<uint32_t>(y + 1);
+            uint32_t run = 0, run_sq = 0;
+            s[0] = q[0] = 0;
+            for (int x = 0; x < cols; ++x)
+            {
+                const int b = src[3 * x], g = src[3 * x + 1], r = src[3 * x + 2];
+                const uint32_t v = static_cast<uint32_t>(std::max({b, g, r}) + std::min({b, g, r}) + 1) >> 1;
+                l[x] = static_cast<uchar>(v);
+                run += v;
+                run_sq += v * v;
+                s[x + 1] = run;
+                q[x + 1] = run_sq;
+            }
+        }
+    });
+
+    // 往下累加：每一行（column）互相獨立，切成行帶各自由上而下掃
+    sharedPool().parallelFor(1, static_cast<size_t>(cols) + 1, 256, [&](size_t c0, size_t c1)
+    {
+        for (int y = 2; y <= rows; ++y)
+        {
+            const uint32_t *s_prev = sum.ptr<uint32_t>(y - 1);
+            const uint32_t *q_prev = sqsum.ptr<uint32_t>(y - 1);
+            uint32_t *s = sum.ptr<uint32_t>(y);
+            uint32_t *q = sqsum.ptr<uint32_t>(y);
+            for (size_t x = c0; x < c1; ++x)
+            {
+                s[x] += s_prev[x];
+                q[x] += q_prev[x];
+            }
+        }
+    });
+
+    // 視窗在邊界處截斷，以實際像素數求平均
+    sharedPool().parallelFor(0, static_cast<size_t>(rows), 64, [&](size_t r0, size_t r1)
+    {
+        for (int y = static_cast<int>(r0); y < static_cast<int>(r1); ++y)
+        {
+            const int y0 = std::max(0, y - half);
+            const int y1 = std::min(rows, y + half + 1);
+            const uint32_t *s_top = sum.ptr<uint32_t>(y0);
+            const uint32_t *s_bottom = sum.ptr<uint32_t>(y1);
+            const uint32_t *q_top = sqsum.ptr<uint32_t>(y0);
+            const uint32_t *q_bottom = sqsum.ptr<uint32_t>(y1);
+            const uchar *l = lightness.ptr<uchar>(y);
+            uchar *out = binary_mask.ptr<uchar>(y);
+            for (int x = 0; x < cols; ++x)
+            {
+                const int x0 = std::max(0, x - half);
+                const int x1 = std::min(cols, x + half + 1);
+                const uint32_t total = s_bottom[x1] - s_bottom[x0] - s_top[x1] + s_top[x0];
+                const uint32_t total_sq = q_bottom[x1] - q_bottom[x0] - q_top[x1] + q_top[x0];
+                const double n = static_cast<double>(y1 - y0) * (x1 - x0);
+                const double mean = total / n;
+                const double deviation = std::sqrt(std::max(0.0, total_sq / n - mean * mean));
+                const double threshold = method == 0 ? mean * (1.0 + k * (deviation / range - 1.0))
+                                                     : mean - k * deviation;
+                out[x] = l[x] >= threshold ? 255 : 0; // 平坦處（s = 0）Niblack 門檻等於亮度，算紙
+            }
+        }
+    });
+}
+
+// Threshold a 3-channel BGR image in the selected color space; returns a 255/0 mask.
+// With an arena every temporary (and the returned mask) lives in arena memory.
+// The image is processed in row bands on the shared pool; each band only touches its own rows.
+// Color spaces 3 and 4 are the adaptive Sauvola / Niblack modes on lightness (see computeAdaptiveMask).
+cv::Mat computeBinaryMask(const cv::Mat &bgr, int color_space,
+                          const float rgb_threshold[3], const float hsl_threshold[3], const float hsv_threshold[3],
+                          const float adaptive_threshold[3] = nullptr, PageArena *arena = nullptr)
+{
+    const bool adaptive = color_space == 3 || color_space == 4;
+    if (!((color_space == 0 && rgb_threshold) || (color_space == 1 && hsl_threshold) || (color_space == 2 && hsv_threshold) ||
+          (adaptive && adaptive_threshold)))
+        return cv::Mat();
+
+    auto temp = [&](int type) { return arena ? arena->mat(bgr.rows, bgr.cols, type) : cv::Mat(bgr.rows, bgr.cols, type); };
+    cv::Mat binary_mask = temp(CV_8UC1);
+    if (adaptive)
+    {
+        computeAdaptiveMask(bgr, color_space - 3, adaptive_threshold, binary_mask, arena);
+        return binary_mask;
+    }
+    cv::Mat converted = color_space == 0 ? cv::Mat() : temp(CV_8UC3);
+    cv::Mat channels[3] = {temp(CV_8UC1), temp(CV_8UC1), temp(CV_8UC1)};
+    cv::Mat masks[3] = {temp(CV_8UC1), temp(CV_8UC1), temp(CV_8UC1)};
+
+    auto band = [&](size_t r0, size_t r1)
+    {
+        const int y0 = static_cast<int>(r0), y1 = static_cast<int>(r1);
+        cv::Mat src = bgr.rowRange(y0, y1);
+        cv::Mat band_mask = binary_mask.rowRange(y0, y1);
+        cv::Mat ch[3] = {channels[0].rowRange(y0, y1), channels[1].rowRange(y0, y1), channels[2].rowRange(y0, y1)};
+        cv::Mat m[3] = {masks[0].rowRange(y0, y1), masks[1].rowRange(y0, y1), masks[2].rowRange(y0, y1)};
+
+        if (color_space == 0)
+        { // RGB
+            cv::split(src, ch);
+
+            cv::threshold(ch[0], m[0], rgb_threshold[2], 255, cv::THRESH_BINARY); // B channel
+            cv::threshold(ch[1], m[1], rgb_threshold[1], 255, cv::THRESH_BINARY); // G channel
+            cv::threshold(ch[2], m[2], rgb_threshold[0], 255, cv::THRESH_BINARY); // R channel
+        }
+        else if (color_space == 1)
+        { // HSL
+            cv::Mat hls_image = converted.rowRange(y0, y1);
+            cv::cvtColor(src, hls_image, cv::COLOR_BGR2HLS);
+            cv::split(hls_image, ch);
+
+            // H channel (0-180 in OpenCV)
+            cv::threshold(ch[0], m[0], hsl_threshold[0], 255, cv::THRESH_BINARY);
+            // L channel (0-255)
+            cv::threshold(ch[1], m[1], hsl_threshold[2] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
+            // S channel (0-255)
+            cv::threshold(ch[2], m[2], hsl_threshold[1] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
+        }
+        else
+        { // HSV
+            cv::Mat hsv_image = converted.rowRange(y0, y1);
+            cv::cvtColor(src, hsv_image, cv::COLOR_BGR2HSV);
+            cv::split(hsv_image, ch);
+
+            // H channel (0-180 in OpenCV)
+            cv::threshold(ch[0], m[0], hsv_threshold[0], 255, cv::THRESH_BINARY);
+            // S channel (0-255)
+            cv::threshold(ch[1], m[1], hsv_threshold[1] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
+            // V channel (0-255)
+            cv::threshold(ch[2], m[2], hsv_threshold[2] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
+        }
+
+        cv::bitwise_and(m[0], m[1], band_mask);
+        cv::bitwise_and(band_mask, m[2], band_mask);
+    };
+
+    sharedPool().parallelFor(0, static_cast<size_t>(bgr.rows), 64, band);
+    return binary_mask;
+}
+
+// 圖檔解碼：WebP 走 libwebp 的進階解碼 API（解碼時順便縮放、多執行緒、直接寫進呼叫端給的記憶體），
+// 不是 WebP、解碼失敗或編譯時沒有 libwebp 就交給 OpenCV
+bool readFileBytes(const string &path, vector<uchar> &bytes)
+{
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file.is_open())
+        return false;
+    const std::streamsize size = file.tellg();
+    file.seekg(0);
+    bytes.resize(static_cast<size_t>(std::max<std::streamsize>(size, 0)));
+    return static_cast<bool>(file.read(reinterpret_cast<char *>(bytes.data()), size));
+}
+
+#ifdef HW_HAVE_LIBWEBP
+// 解成 BGR。target 有給且比原圖小時由 libwebp 在解碼過程中縮放，不必先解出整張再 resize；
+// bgr 已經是對的大小與型別（可以是較大緩衝區的 ROI）就直接寫進去，不另外配置
+bool decodeWebP(const uchar *data, size_t size, cv::Mat &bgr, cv::Size target = cv::Size())
+{
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config) || WebPGetFeatures(data, size, &config.input) != VP8_STATUS_OK)
+        return false;
+    cv::Size out_size(config.input.width, config.input.height);
+    if (target.width > 0 && target.height > 0 && (target.width < out_size.width || target.height < out_size.height))
+    {
+        config.options.use_scaling = 1;
+        config.options.scaled_width = target.width;
+        config.options.scaled_height = target.height;
+        out_size = target;
+    }
+    config.options.use_threads = 1;
+
+    if (bgr.size() != out_size || bgr.type() != CV_8UC3)
+        bgr.create(out_size, CV_8UC3);
+    config.output.colorspace = MODE_BGR;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = bgr.data;
+    config.output.u.RGBA.stride = static_cast<int>(bgr.step);
+    config.output.u.RGBA.size = bgr.step * (bgr.rows - 1) + static_cast<size_t>(bgr.cols) * 3;
+    const bool ok = WebPDecode(data, size, &config) == VP8_STATUS_OK;
+    WebPFreeDecBuffer(&config.output);
+    return ok;
+}
+#endif
+
+// 批次解碼用：WebP 解進 buffer 的左上角並回傳那塊 ROI。buffer 跟著頁面槽位重複使用，
+// 只有遇到比它大的頁面才重新配置；其他格式回傳 imdecode 新配置的圖
+cv::Mat decodePageBgr(const vector<uchar> &bytes, cv::Mat &buffer)
+{
+#ifdef HW_HAVE_LIBWEBP
+    int width = 0, height = 0;
+    if (WebPGetInfo(bytes.data(), bytes.size(), &width, &height))
+    {
+        if (buffer.type() != CV_8UC3 || buffer.cols < width || buffer.rows < height)
+            buffer.create(std::max(buffer.rows, height), std::max(buffer.cols, width), CV_8UC3);
+        cv::Mat page = buffer(cv::Rect(0, 0, width, height));
+        if (decodeWebP(bytes.data(), bytes.size(), page))
+            return page;
+        cerr << "libwebp could not decode the page, trying OpenCV" << endl;
+    }
+#else
+    (void)buffer;
+#endif
+    return cv::imdecode(bytes, cv::IMREAD_COLOR);
+}
+
+cv::Mat readImageBgr(const string &path)
+{
+    vector<uchar> bytes;
+    if (!readFileBytes(path, bytes))
+        return cv::Mat();
+    cv::Mat buffer;
+    return decodePageBgr(bytes, buffer);
+}
+
+// 長寬各縮小 4 倍的灰階圖（頁面 hash 用）：WebP 由 libwebp 在解碼時縮放，
+// 其他格式用 IMREAD_REDUCED_GRAYSCALE_4（JPEG 可以在 DCT 階段就縮小）
+cv::Mat readReducedGray(const string &path)
+{
+    vector<uchar> bytes;
+    if (!readFileBytes(path, bytes))
+        return cv::Mat();
+#ifdef HW_HAVE_LIBWEBP
+    int width = 0, height = 0;
+    if (WebPGetInfo(bytes.data(), bytes.size(), &width, &height))
+    {
+        cv::Mat bgr, gray;
+        if (decodeWebP(bytes.data(), bytes.size(), bgr, cv::Size((width + 3) / 4, (height + 3) / 4)))
+        {
+            cv::cvtColor(bgr, gray, cv::COLOR_BGR2GRAY);
+            return gray;
+        }
+    }
+#endif
+    return cv::imdecode(bytes, cv::IMREAD_REDUCED_GRAYSCALE_4);
+}
+
+#ifdef HW_WITH_GUI
+// Function to load and process image with OpenCV effects
+bool LoadProcessedTextureFromFile(const char *filename, GLuint *out_texture, int *out_width, int *out_height,
+                                  float brightness = 0.0f, float contrast = 1.0f, int blur_kernel = 0, bool grayscale = false,
+                                  bool enable_binary = false, int color_space = 0,
+                                  float rgb_threshold[3] = nullptr, float hsl_threshold[3] = nullptr, float hsv_threshold[3] = nullptr,
+                                  float adaptive_threshold[3] = nullptr)
+{
+    // Load image as 3-channel BGR (WebP goes through libwebp, everything else through OpenCV)
+    image = readImageBgr(filename);
+    if (image.empty())
+    {
+        cerr << "Failed to load image for processing: " << filename << endl;
+        return false;
+    }
+
+    // Ensure image is 3-channel BGR
+    if (image.channels() != 3)
+    {
+        if (image.channels() == 4)
+        {
+            cv::cvtColor(image, image, cv::COLOR_BGRA2BGR);
+        }
+        else if (image.channels() == 1)
+        {
+            cv::cvtColor(image, image, cv::COLOR_GRAY2BGR);
+        }
+    }
+
+    // Apply binary threshold if enabled
+    if (enable_binary)
+    {
+        // Threshold temporaries are reused across reloads instead of reallocated on every slider move
+        static PageArena threshold_arena;
+        threshold_arena.reset();
+        cv::Mat binary_mask = computeBinaryMask(image, color_space, rgb_threshold, hsl_threshold, hsv_threshold,
+                                                adaptive_threshold, &threshold_arena);
+
+        // Apply binary threshold to create pure binary image (0 or 1 values)
+        if (!binary_mask.empty())
+        {
+            // Convert binary mask to pure binary values (0 or 1)
+            cv::Mat pure_binary = threshold_arena.mat(image.rows, image.cols, CV_8UC1);
+            binary_mask.convertTo(pure_binary, CV_8UC1, 1.0 / 255.0); // Convert 255 to 1, 0 stays 0
+
+            // Convert to 3-channel for consistency with the rest of the pipeline
+            cv::Mat binary_3channel = threshold_arena.mat(image.rows, image.cols, CV_8UC3);
+            cv::cvtColor(pure_binary, binary_3channel, cv::COLOR_GRAY2BGR);
+
+            // Scale back to 0-255 range for display purposes
+            binary_3channel.convertTo(image, CV_8UC3, 255.0); // Convert 1 to 255, 0 stays 0
+        }
+    }
+
+    // Apply grayscale conversion if requested
+    if (grayscale)
+    {
+        cv::cvtColor(image, image, cv::COLOR_BGR2GRAY);
+        cv::cvtColor(image, image, cv::COLOR_GRAY2BGR); // Convert back to 3-channel for consistency
+    }
+
+    // Apply brightness and contrast adjustments
+    if (brightness != 0.0f || contrast != 1.0f)
+    {
+        image.convertTo(image, -1, contrast, brightness);
+    }
+
+    // Apply blur if requested
+    if (blur_kernel > 0)
+    {
+        cv::GaussianBlur(image, image, cv::Size(blur_kernel * 2 + 1, blur_kernel * 2 + 1), 0);
+    }
+
+    // Convert BGR to RGB (OpenCV uses BGR by default)
+    cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+
+    // Ensure continuous memory layout
+    if (!image.isContinuous())
+    {
+        image = image.clone();
+    }
+
+    // Create a OpenGL texture identifier
+    GLuint image_texture;
+    glGenTextures(1, &image_texture);
+    glBindTexture(GL_TEXTURE_2D, image_texture);
+
+    // Setup filtering parameters for display
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Upload pixels into texture - specify correct alignment
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+#if defined(GL_UNPACK_ROW_LENGTH) && !defined(__EMSCRIPTEN__)
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+#endif
+
+    // Upload as RGB 3-channel
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.cols, image.rows, 0, GL_RGB, GL_UNSIGNED_BYTE, image.data);
+
+    // Check for OpenGL errors
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR)
+    {
+        cerr << "OpenGL error after processed texture upload: " << error << endl;
+        glDeleteTextures(1, &image_texture);
+        return false;
+    }
+
+    *out_texture = image_texture;
+    *out_width = image.cols;
+    *out_height = image.rows;
+
+    return true;
+}
+#endif
+
+// 有界佇列：滿了就擋住上游（backpressure），close() 之後下游取完就結束。
+// 固定容量的環狀緩衝，push / pop 不配置記憶體
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : slots(std::max<size_t>(1, capacity)) {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&] { return closed || count < slots.size(); });
+        if (closed)
+            return false;
+        slots[(head + count) % slots.size()] = std::move(item);
+        ++count;
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&] { return closed || count > 0; });
+        if (count == 0)
+            return false;
+        item = std::move(slots[head]);
+        head = (head + 1) % slots.size();
+        --count;
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    }
+
+private:
+    vector<T> slots;
+    size_t head = 0;
+    size_t count = 0;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    bool closed = false;
+};
+
+bool isImageFile(const filesystem::path &path)
+{
+    string ext = path.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return (ext == ".webp" || ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".bmp" || ext == ".tiff" || ext == ".tga");
+}
+
+enum class ImageFormat
+{
+    Unknown,
+    Jpeg,
+    Png,
+    Webp,
+    Bmp,
+    Tiff
+};
+
+struct ImageProbe
+{
+    ImageFormat format = ImageFormat::Unknown;
+    int width = 0;  // 0 表示格式認得但讀不到尺寸（例如 TIFF）
+    int height = 0;
+
+    bool hasSize() const { return width > 0 && height > 0; }
+};
+
+const char *imageFormatName(ImageFormat format)
+{
+    switch (format)
+    {
+    case ImageFormat::Jpeg: return "JPEG";
+    case ImageFormat::Png: return "PNG";
+    case ImageFormat::Webp: return "WebP";
+    case ImageFormat::Bmp: return "BMP";
+    case ImageFormat::Tiff: return "TIFF";
+    default: return "Unknown";
+    }
+}
+
+// 副檔名跟實際格式對不對得上（impool 裡常有副檔名是 .jpg 的 WebP）；認不出格式時不算錯
+bool extensionMatchesFormat(const filesystem::path &path, ImageFormat format)
+{
+    string ext = path.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    switch (format)
+    {
+    case ImageFormat::Jpeg: return ext == ".jpg" || ext == ".jpeg";
+    case ImageFormat::Png: return ext == ".png";
+    case ImageFormat::Webp: return ext == ".webp";
+    case ImageFormat::Bmp: return ext == ".bmp";
+    case ImageFormat::Tiff: return ext == ".tiff" || ext == ".tif";
+    default: return true;
+    }
+}
+
+// 只讀檔頭判斷真正的格式與尺寸，不解碼：
+//   PNG   8-byte 簽章後第一個 chunk 是 IHDR，寬高是 big-endian uint32
+//   WebP  RIFF....WEBP 後第一個 chunk：VP8（有損，key frame 起始碼後 14-bit 寬高）、
+//         VP8L（無損，簽章 0x2F 後 14-bit 寬高 - 1）、VP8X（延伸格式，24-bit 畫布寬高 - 1）
+//   JPEG  FFD8 後逐段跳過 APPn/DQT/DHT...，讀到 SOFn 就有寬高；EXIF 縮圖很大時 SOF 可能在幾十 KB 之後，
+//         所以段落超出第一次讀進來的範圍時改用 seek，不把整個檔案讀進來
+//   BMP   BITMAPINFOHEADER（或舊的 BITMAPCOREHEADER）裡的寬高
+ImageProbe probeImageFile(const string &path)
+{
+    ImageProbe probe;
+    ifstream file(path, ios::binary);
+    if (!file.is_open())
+        return probe;
+    uint8_t header[64] = {};
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+    const size_t length = static_cast<size_t>(file.gcount());
+    auto le16 = [&](size_t at) { return static_cast<uint32_t>(header[at] | header[at + 1] << 8); };
+    auto le24 = [&](size_t at) { return le16(at) | static_cast<uint32_t>(header[at + 2]) << 16; };
+    auto le32 = [&](size_t at) { return le24(at) | static_cast<uint32_t>(header[at + 3]) << 24; };
+    auto be32 = [&](size_t at)
+    {
+        return static_cast<uint32_t>(header[at]) << 24 | static_cast<uint32_t>(header[at + 1]) << 16 |
+               static_cast<uint32_t>(header[at + 2]) << 8 | header[at + 3];
+    };
+
+    static const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (length >= 24 && memcmp(header, png_signature, 8) == 0)
+    {
+        probe.format = ImageFormat::Png;
+        if (memcmp(header + 12, "IHDR", 4) == 0 && be32(16) <= INT_MAX && be32(20) <= INT_MAX)
+        {
+            probe.width = static_cast<int>(be32(16));
+            probe.height = static_cast<int>(be32(20));
+        }
+        return probe;
+    }
+
+    if (length >= 16 && memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WEBP", 4) == 0)
+    {
+        probe.format = ImageFormat::Webp;
+        if (length >= 30 && memcmp(header + 12, "VP8 ", 4) == 0 &&
+            header[23] == 0x9D && header[24] == 0x01 && header[25] == 0x2A)
+        {
+            probe.width = static_cast<int>(le16(26) & 0x3FFF);
+            probe.height = static_cast<int>(le16(28) & 0x3FFF);
+        }
+        else if (length >= 25 && memcmp(header + 12, "VP8L", 4) == 0 && header[20] == 0x2F)
+        {
+            const uint32_t bits = le32(21);
+            probe.width = static_cast<int>((bits & 0x3FFF) + 1);
+            probe.height = static_cast<int>(((bits >> 14) & 0x3FFF) + 1);
+        }
+        else if (length >= 30 && memcmp(header + 12, "VP8X", 4) == 0)
+        {
+            probe.width = static_cast<int>(le24(24) + 1);
+            probe.height = static_cast<int>(le24(27) + 1);
+        }
+        return probe;
+    }
+
+    if (length >= 26 && header[0] == 'B' && header[1] == 'M')
+    {
+        probe.format = ImageFormat::Bmp;
+        const uint32_t dib_size = le32(14);
+        if (dib_size == 12)
+        {
+            probe.width = static_cast<int>(le16(18));
+            probe.height = static_cast<int>(le16(20));
+        }
+        else if (dib_size >= 40)
+        {
+            probe.width = std::abs(static_cast<int32_t>(le32(18)));
+            probe.height = std::abs(static_cast<int32_t>(le32(22))); // 負的高度表示由上而下存
+        }
+        return probe;
+    }
+
+    if (length >= 4 && ((memcmp(header, "II*\0", 4) == 0) || (memcmp(header, "MM\0*", 4) == 0)))
+    {
+        probe.format = ImageFormat::Tiff;
+        return probe;
+    }
+
+    if (length >= 3 && header[0] == 0xFF && header[1] == 0xD8 && header[2] == 0xFF)
+    {
+        probe.format = ImageFormat::Jpeg;
+        // 從 SOI 之後逐段往下找，最多看 64 段
+        std::streamoff offset = 2;
+        for (int segment = 0; segment < 64; ++segment)
+        {
+            uint8_t marker[9];
+            file.clear();
+            file.seekg(offset);
+            if (!file.read(reinterpret_cast<char *>(marker), 2) || marker[0] != 0xFF)
+                break;
+            // 段落之間可以有多個 0xFF 填充
+            while (marker[1] == 0xFF)
+            {
+                if (!file.read(reinterpret_cast<char *>(marker + 1), 1))
+                    return probe;
+                ++offset;
+            }
+            const uint8_t type = marker[1];
+            offset += 2;
+            if (type == 0xD8 || type == 0x01 || (type >= 0xD0 && type <= 0xD7))
+                continue; // 沒有長度欄位的標記
+            if (type == 0xD9 || type == 0xDA)
+                break; // 影像結束或掃描資料開始，之後不會再有 SOF
+            if (!file.read(reinterpret_cast<char *>(marker + 2), 7))
+                break;
+            const uint32_t segment_length = static_cast<uint32_t>(marker[2]) << 8 | marker[3];
+            const bool is_sof = type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC;
+            if (is_sof)
+            {
+                probe.height = marker[5] << 8 | marker[6];
+                probe.width = marker[7] << 8 | marker[8];
+                break;
+            }
+            if (segment_length < 2)
+                break;
+            offset += segment_length;
+        }
+        return probe;
+    }
+    return probe;
+}
+
+// 整個清單平行探測（每個檔案只讀檔頭，I/O 次數少，瓶頸在開檔延遲，所以多開幾條一起做）
+vector<ImageProbe> probeImageFiles(const vector<string> &paths)
+{
+    vector<ImageProbe> probes(paths.size());
+    sharedPool().parallelFor(0, paths.size(), 16, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            probes[i] = probeImageFile(paths[i]);
+    });
+    return probes;
+}
+
+vector<string> listImageFiles(const string &directory)
+{
+    vector<string> files;
+    try
+    {
+        for (const auto &entry : filesystem::directory_iterator(directory))
+        {
+            if (entry.is_regular_file() && isImageFile(entry.path()))
+                files.push_back(filesystem::absolute(entry.path()).string());
+        }
+    }
+    catch (const filesystem::filesystem_error &ex)
+    {
+        cerr << "Error listing directory: " << ex.what() << endl;
+    }
+    sort(files.begin(), files.end());
+    return files;
+}
+
+// 自然排序鍵：數字串依數值比較（"IMG (2)" 排在 "IMG (10)" 前面），其餘字元不分大小寫。
+// 數字串編成 0x01、有效位數、去掉前導零的數字，0x01 比任何可見字元小，
+// 所以 std::string 直接比較（以 unsigned char 比）就是自然排序
+string naturalSortKey(const string &name)
+{
+    string key;
+    key.reserve(name.size() + 8);
+    for (size_t i = 0; i < name.size();)
+    {
+        const unsigned char c = static_cast<unsigned char>(name[i]);
+        if (!isdigit(c))
+        {
+            key.push_back(static_cast<char>(tolower(c)));
+            ++i;
+            continue;
+        }
+        size_t end = i;
+        while (end < name.size() && isdigit(static_cast<unsigned char>(name[end])))
+            ++end;
+        size_t first = i;
+        while (first + 1 < end && name[first] == '0')
+            ++first;
+        key.push_back('\x01');
+        key.push_back(static_cast<char>(std::min<size_t>(end - first, 255)));
+        key.append(name, first, end - first);
+        i = end;
+    }
+    return key;
+}
+
+struct DirectoryEntry
+{
+    string name;       // 顯示名稱，目錄結尾加 "/"
+    string path;       // 絕對路徑，點擊時直接用
+    string sort_key;   // naturalSortKey(name)
+    bool is_directory = false;
+    bool is_image = false;
+    uintmax_t size = 0;
+    int64_t mtime = 0; // 修改時間（Unix 秒）
+    ImageProbe probe;  // 圖檔才有：檔頭判斷的實際格式與尺寸
+};
+
+// 目錄索引：背景執行緒列出目錄，每個項目的類型、自然排序鍵、大小、修改時間都在那裡算好，
+// 排序後整份換成新的快照（shared_ptr）。UI 每幀只拿快照來畫，重新整理時 UI 繼續用舊快照，不會卡住。
+// 掃描中又要求重新整理時不另開執行緒，只記下要求，掃完再掃一次最新的目錄。
+// update() 只重新 stat 指定的檔案（DirectoryWatcher 回報的變更），不必重新列整個目錄
+class DirectoryIndex
+{
+public:
+    using Snapshot = std::shared_ptr<const vector<DirectoryEntry>>;
+
+    DirectoryIndex() : entries(std::make_shared<const vector<DirectoryEntry>>()) {}
+    DirectoryIndex(const DirectoryIndex &) = delete;
+    DirectoryIndex &operator=(const DirectoryIndex &) = delete;
+
+    ~DirectoryIndex() { stop(); }
+
+    // 等目前的掃描做完後結束執行緒，之後的 refresh / update 都不再啟動
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // 非同步重新掃描 directory；掃完後 version() 會加一
+    void refresh(const string &directory)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requested_directory = directory;
+        ++requested;
+        startLocked();
+    }
+
+    // 非同步更新幾個檔案（新增、修改或刪除），不在目前目錄裡的路徑略過
+    void update(const vector<string> &paths)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending_updates.insert(pending_updates.end(), paths.begin(), paths.end());
+        startLocked();
+    }
+
+    Snapshot snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries;
+    }
+
+    // 每發布一份新快照加一；UI 用來判斷要不要重建衍生的顯示資料
+    uint64_t version() const { return published.load(std::memory_order_acquire); }
+
+    bool scanning() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return busy;
+    }
+
+    string directory() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return absolute_directory;
+    }
+
+    string error() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return last_error;
+    }
+
+private:
+    void startLocked()
+    {
+        if (busy || stopping)
+            return;
+        busy = true;
+        if (worker.joinable())
+            worker.join(); // 上一個執行緒已經結束（busy 為 false），join 不會等
+        worker = std::thread([this]() { run(); });
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            string directory;
+            uint64_t generation;
+            vector<string> updates;
+            Snapshot current;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping || (completed == requested && pending_updates.empty()))
+                {
+                    busy = false;
+                    return;
+                }
+                directory = requested_directory;
+                generation = requested;
+                if (completed == requested)
+                {
+                    updates.swap(pending_updates);
+                    current = entries;
+                    directory = absolute_directory;
+                }
+            }
+
+            auto list = std::make_shared<vector<DirectoryEntry>>();
+            string error_message;
+            if (updates.empty())
+                scan(directory, *list, error_message);
+            else
+                applyUpdates(directory, *current, updates, *list);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (updates.empty())
+            {
+                absolute_directory = filesystem::absolute(directory).string();
+                last_error = error_message;
+                completed = generation;
+            }
+            else if (completed != requested)
+            {
+                continue; // 更新期間又要求整個重新掃描，這份結果作廢
+            }
+            entries = std::move(list);
+            published.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    static bool makeEntry(const filesystem::directory_entry &item, DirectoryEntry &entry)
+    {
+        // file_time_type 的 clock 各平台不同，換算成 system_clock 的秒數
+        static const auto file_now = filesystem::file_time_type::clock::now();
+        static const auto system_now = std::chrono::system_clock::now();
+        std::error_code ec;
+        if (!item.exists(ec))
+            return false;
+        entry.is_directory = item.is_directory(ec);
+        entry.name = item.path().filename().string();
+        if (entry.is_directory)
+            entry.name += "/";
+        entry.path = filesystem::absolute(item.path(), ec).string();
+        entry.sort_key = naturalSortKey(entry.name);
+        if (!entry.is_directory)
+        {
+            entry.is_image = isImageFile(item.path());
+            entry.size = item.file_size(ec);
+            if (ec)
+                entry.size = 0;
+        }
+        const auto write_time = item.last_write_time(ec);
+        if (!ec)
+        {
+            const auto system_time = system_now + std::chrono::duration_cast<std::chrono::system_clock::duration>(write_time - file_now);
+            entry.mtime = std::chrono::duration_cast<std::chrono::seconds>(system_time.time_since_epoch()).count();
+        }
+        return true;
+    }
+
+    static void sortEntries(vector<DirectoryEntry> &list)
+    {
+        std::sort(list.begin(), list.end(), [](const DirectoryEntry &a, const DirectoryEntry &b)
+        {
+            return a.sort_key != b.sort_key ? a.sort_key < b.sort_key : a.name < b.name;
+        });
+    }
+
+    static void scan(const string &directory, vector<DirectoryEntry> &list, string &error_message)
+    {
+        std::error_code ec;
+        for (filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+        {
+            DirectoryEntry entry;
+            if (makeEntry(*it, entry))
+                list.push_back(std::move(entry));
+        }
+        if (ec)
+        {
+            error_message = "Error reading directory: " + ec.message();
+            cerr << error_message << " (" << directory << ")" << endl;
+        }
+        sharedPool().parallelFor(0, list.size(), 16, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                if (list[i].is_image)
+                    list[i].probe = probeImageFile(list[i].path);
+            }
+        });
+        sortEntries(list);
+    }
+
+    // 舊快照 + 幾個檔案的變更 -> 新快照；同一個檔案先移除再依現況（還在的話）加回去
+    static void applyUpdates(const string &directory, const vector<DirectoryEntry> &current,
+                             const vector<string> &updates, vector<DirectoryEntry> &list)
+    {
+        std::unordered_set<string> touched;
+        vector<DirectoryEntry> added;
+        for (const auto &path : updates)
+        {
+            std::error_code ec;
+            const filesystem::path absolute_path = filesystem::absolute(path, ec);
+            if (ec || !filesystem::equivalent(absolute_path.parent_path(), directory, ec))
+                continue;
+            if (!touched.insert(absolute_path.filename().string()).second)
+                continue;
+            DirectoryEntry entry;
+            if (makeEntry(filesystem::directory_entry(absolute_path, ec), entry))
+            {
+                if (entry.is_image)
+                    entry.probe = probeImageFile(entry.path);
+                added.push_back(std::move(entry));
+            }
+        }
+        list.reserve(current.size() + added.size());
+        for (const auto &entry : current)
+        {
+            string name = entry.name;
+            if (entry.is_directory)
+                name.pop_back();
+            if (!touched.count(name))
+                list.push_back(entry);
+        }
+        std::move(added.begin(), added.end(), std::back_inserter(list));
+        sortEntries(list);
+    }
+
+    mutable std::mutex mutex;
+    std::thread worker;
+    Snapshot entries;
+    string requested_directory;
+    string absolute_directory;
+    string last_error;
+    vector<string> pending_updates;
+    uint64_t requested = 0;
+    uint64_t completed = 0;
+    std::atomic<uint64_t> published{0};
+    bool busy = false;
+    bool stopping = false;
+};
+
+struct FileChange
+{
+    string path;
+    bool removed = false;
+    bool rescan = false; // 事件遺失（inotify 佇列溢位），path 是目錄本身，呼叫端要重新列整個目錄
+};
+
+// 監看一個目錄（不含子目錄）的新增、修改、刪除。Linux 用 inotify，其他平台（或 inotify 失敗時）
+// 每隔 poll_interval 列一次目錄比對大小與修改時間。
+// 掃描器或網路複製常常分好幾次寫入，所以變更不會馬上回報：每個檔案最後一次事件後要安靜 settle_time，
+// 而且這段期間大小與修改時間都沒變，才算寫完。回報的是「目錄/檔名」路徑，由背景執行緒收集，
+// take() 不等待、wait() 等到有變更或逾時
+class DirectoryWatcher
+{
+public:
+    explicit DirectoryWatcher(std::chrono::milliseconds settle = std::chrono::milliseconds(750),
+                              std::chrono::milliseconds poll = std::chrono::milliseconds(1000))
+        : settle_time(settle), poll_interval(poll) {}
+    DirectoryWatcher(const DirectoryWatcher &) = delete;
+    DirectoryWatcher &operator=(const DirectoryWatcher &) = delete;
+
+    ~DirectoryWatcher() { stop(); }
+
+    bool start(const string &dir)
+    {
+        stop();
+        std::error_code ec;
+        if (!filesystem::is_directory(dir, ec))
+        {
+            cerr << "Cannot watch directory: " << dir << endl;
+            return false;
+        }
+        directory = dir;
+        stopping = false;
+#ifdef __linux__
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd >= 0 &&
+            inotify_add_watch(inotify_fd, directory.c_str(),
+                              IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+        {
+            ::close(inotify_fd);
+            inotify_fd = -1;
+        }
+        if (inotify_fd < 0)
+            cerr << "inotify unavailable, polling " << directory << " instead" << endl;
+#endif
+        if (!native())
+            listDirectory(known);
+        worker = std::thread([this]() { run(); });
+        return true;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable())
+            worker.join();
+#ifdef __linux__
+        if (inotify_fd >= 0)
+            ::close(inotify_fd);
+        inotify_fd = -1;
+#endif
+        pending.clear();
+        known.clear();
+    }
+
+    bool native() const
+    {
+#ifdef __linux__
+        return inotify_fd >= 0;
+#else
+        return false;
+#endif
+    }
+
+    vector<FileChange> take()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        vector<FileChange> changes;
+        changes.swap(ready);
+        return changes;
+    }
+
+    vector<FileChange> wait(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready_changed.wait_for(lock, timeout, [this]() { return !ready.empty() || stopping; });
+        vector<FileChange> changes;
+        changes.swap(ready);
+        return changes;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct FileState
+    {
+        uintmax_t size = 0;
+        filesystem::file_time_type mtime{};
+        bool operator==(const FileState &other) const { return size == other.size && mtime == other.mtime; }
+    };
+
+    struct Pending
+    {
+        Clock::time_point last_event;
+        FileState state;
+        bool exists = false;
+    };
+
+    static bool statFile(const filesystem::path &path, FileState &state)
+    {
+        std::error_code ec;
+        if (!filesystem::is_regular_file(path, ec))
+            return false;
+        state.size = filesystem::file_size(path, ec);
+        if (ec)
+            return false;
+        state.mtime = filesystem::last_write_time(path, ec);
+        return !ec;
+    }
+
+    void listDirectory(std::unordered_map<string, FileState> &files) const
+    {
+        files.clear();
+        std::error_code ec;
+        for (filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec))
+        {
+            FileState state;
+            if (statFile(it->path(), state))
+                files[it->path().filename().string()] = state;
+        }
+    }
+
+    // 有事件就重設這個檔案的安靜計時
+    void noteEvent(const string &name, Clock::time_point now)
+    {
+        Pending &entry = pending[name];
+        entry.last_event = now;
+        entry.exists = statFile(filesystem::path(directory) / name, entry.state);
+    }
+
+    void run()
+    {
+        auto next_scan = Clock::now();
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (stopping)
+                    return;
+                // inotify 用 poll() 等事件；輪詢模式在這裡睡到下次掃描或下次要檢查的待定檔案
+                if (!native())
+                    wake.wait_for(lock, std::min<Clock::duration>(settle_time, poll_interval) / 2, [this]() { return stopping; });
+                if (stopping)
+                    return;
+            }
+            const auto now = Clock::now();
+#ifdef __linux__
+            if (native())
+                readEvents();
+#endif
+            if (!native() && now >= next_scan)
+            {
+                std::unordered_map<string, FileState> files;
+                listDirectory(files);
+                for (const auto &[name, state] : files)
+                {
+                    auto old = known.find(name);
+                    if (old == known.end() || !(old->second == state))
+                        noteEvent(name, now);
+                }
+                for (const auto &[name, state] : known)
+                {
+                    if (!files.count(name))
+                        noteEvent(name, now);
+                }
+                known.swap(files);
+                next_scan = now + poll_interval;
+            }
+            settle(Clock::now());
+        }
+    }
+
+#ifdef __linux__
+    void readEvents()
+    {
+        pollfd descriptor{inotify_fd, POLLIN, 0};
+        const int timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(settle_time).count() / 4 + 1);
+        if (::poll(&descriptor, 1, timeout) <= 0)
+            return;
+        alignas(inotify_event) char buffer[16384];
+        const auto now = Clock::now();
+        bool overflow = false;
+        while (true)
+        {
+            const ssize_t length = ::read(inotify_fd, buffer, sizeof(buffer));
+            if (length <= 0)
+                break;
+            for (ssize_t offset = 0; offset < length;)
+            {
+                const auto *event = reinterpret_cast<const inotify_event *>(buffer + offset);
+                if (event->mask & IN_Q_OVERFLOW)
+                    overflow = true;
+                else if (event->len > 0 && !(event->mask & IN_ISDIR))
+                    noteEvent(event->name, now);
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+        if (!overflow)
+            return;
+        // 核心佇列滿了，中間丟掉的事件無從得知，只能請呼叫端重列整個目錄；
+        // 還在等安靜的檔案照常計時，寫完後會再回報一次
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(FileChange{directory, false, true});
+        }
+        ready_changed.notify_all();
+    }
+#endif
+
+    // 安靜夠久、而且狀態跟最後一次事件時一樣的檔案才回報；狀態變了就當作新的事件重新計時
+    void settle(Clock::time_point now)
+    {
+        vector<FileChange> settled;
+        for (auto it = pending.begin(); it != pending.end();)
+        {
+            Pending &entry = it->second;
+            if (now - entry.last_event < settle_time)
+            {
+                ++it;
+                continue;
+            }
+            FileState state;
+            const bool exists = statFile(filesystem::path(directory) / it->first, state);
+            if (exists != entry.exists || (exists && !(state == entry.state)))
+            {
+                entry.last_event = now;
+                entry.exists = exists;
+                entry.state = state;
+                ++it;
+                continue;
+            }
+            settled.push_back(FileChange{(filesystem::path(directory) / it->first).string(), !exists});
+            it = pending.erase(it);
+        }
+        if (settled.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.insert(ready.end(), settled.begin(), settled.end());
+        }
+        ready_changed.notify_all();
+    }
+
+    std::chrono::milliseconds settle_time;
+    std::chrono::milliseconds poll_interval;
+    string directory;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable ready_changed;
+    vector<FileChange> ready;
+    bool stopping = false;
+    // 以下只有 worker 執行緒會碰
+    std::unordered_map<string, Pending> pending;
+    std::unordered_map<string, FileState> known; // 輪詢模式上一次列出的檔案
+#ifdef __linux__
+    int inotify_fd = -1;
+#endif
+};
+
+// 近似重複頁面：impool 裡同一張紙常被重掃很多次。每頁從縮小解碼的灰階圖算出
+// 64-bit pHash（32x32 DCT 的低頻 8x8）與 dHash（9x8 相鄰差），再用 multi-index 把 pHash 切成 8 個 byte 建表：
+// 距離 <= 7 的兩個 hash 至少有一個 byte 完全相同（鴿籠原理），所以只需比對同桶的候選
+struct PageHash
+{
+    uint64_t phash = 0;
+    uint64_t dhash = 0;
+    bool valid = false;
+};
+
+inline int hammingDistance(uint64_t a, uint64_t b)
+{
+    return std::popcount(a ^ b);
+}
+
+PageHash computePageHash(const cv::Mat &gray)
+{
+    PageHash hash;
+    if (gray.empty() || gray.type() != CV_8UC1)
+        return hash;
+
+    // 正規化 DCT-II 的前 8 個基底，32 點
+    static const std::array<float, 8 * 32> basis = []()
+    {
+        std::array<float, 8 * 32> table{};
+        for (int u = 0; u < 8; ++u)
+        {
+            const double alpha = u == 0 ? std::sqrt(1.0 / 32.0) : std::sqrt(2.0 / 32.0);
+            for (int x = 0; x < 32; ++x)
+                table[u * 32 + x] = static_cast<float>(alpha * std::cos((2 * x + 1) * u * CV_PI / 64.0));
+        }
+        return table;
+    }();
+
+    cv::Mat small;
+    cv::resize(gray, small, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+
+    // 可分離：先對每一列做 8 個水平頻率，再對 8 個垂直頻率做一次
+    float rows_dct[32][8];
+    for (int y = 0; y < 32; ++y)
+    {
+        const uchar *row = small.ptr<uchar>(y);
+        for (int u = 0; u < 8; ++u)
+        {
+            float sum = 0.0f;
+            for (int x = 0; x < 32; ++x)
+                sum += row[x] * basis[u * 32 + x];
+            rows_dct[y][u] = sum;
+        }
+    }
+    float coeffs[64];
+    for (int v = 0; v < 8; ++v)
+    {
+        for (int u = 0; u < 8; ++u)
+        {
+            float sum = 0.0f;
+            for (int y = 0; y < 32; ++y)
+                sum += rows_dct[y][u] * basis[v * 32 + y];
+            coeffs[v * 8 + u] = sum;
+        }
+    }
+
+    // 與去掉 DC 後的中位數比較
+    float sorted[63];
+    std::copy(coeffs + 1, coeffs + 64, sorted);
+    std::nth_element(sorted, sorted + 31, sorted + 63);
+    const float median = sorted[31];
+    for (int k = 0; k < 64; ++k)
+    {
+        if (coeffs[k] > median)
+            hash.phash |= uint64_t(1) << k;
+    }
+
+    cv::Mat tiny;
+    cv::resize(small, tiny, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+    for (int y = 0; y < 8; ++y)
+    {
+        const uchar *row = tiny.ptr<uchar>(y);
+        for (int x = 0; x < 8; ++x)
+        {
+            if (row[x] < row[x + 1])
+                hash.dhash |= uint64_t(1) << (y * 8 + x);
+        }
+    }
+    hash.valid = true;
+    return hash;
+}
+
+// 縮小解碼（readReducedGray）後算 hash；所有頁面在共用 pool 上平行處理
+vector<PageHash> hashImageFiles(const vector<string> &paths)
+{
+    vector<PageHash> hashes(paths.size());
+    sharedPool().parallelFor(0, paths.size(), 1, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            cv::Mat gray = readReducedGray(paths[i]);
+            if (gray.empty())
+            {
+                cerr << "Failed to load image for hashing: " << paths[i] << endl;
+                continue;
+            }
+            hashes[i] = computePageHash(gray);
+        }
+    });
+    return hashes;
+}
+
+class PerceptualHashIndex
+{
+public:
+    static constexpr int max_exact_distance = 7; // 8 個 byte 分段，距離 <= 7 的查詢不會漏
+
+    void build(std::span<const uint64_t> keys)
+    {
+        hashes.assign(keys.begin(), keys.end());
+        for (int t = 0; t < 8; ++t)
+        {
+            // 每一段是一張 256 桶的 CSR 表
+            auto &offsets = bucket_offsets[t];
+            offsets.assign(257, 0);
+            for (uint64_t h : hashes)
+                ++offsets[chunk(h, t) + 1];
+            for (int b = 0; b < 256; ++b)
+                offsets[b + 1] += offsets[b];
+            auto &ids = bucket_ids[t];
+            ids.resize(hashes.size());
+            vector<int> fill(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < hashes.size(); ++i)
+                ids[fill[chunk(hashes[i], t)]++] = static_cast<int>(i);
+        }
+    }
+
+    // 回傳距離 <= max_distance 的所有項目（包含自己）。每個候選只在它第一個相同的分段被回報，不需要去重
+    void query(uint64_t key, int max_distance, vector<int> &out) const
+    {
+        out.clear();
+        if (hashes.empty())
+            return;
+        for (int t = 0; t < 8; ++t)
+        {
+            const int b = chunk(key, t);
+            const auto &offsets = bucket_offsets[t];
+            for (int k = offsets[b]; k < offsets[b + 1]; ++k)
+            {
+                const int id = bucket_ids[t][k];
+                const uint64_t h = hashes[id];
+                bool reported_earlier = false;
+                for (int s = 0; s < t && !reported_earlier; ++s)
+                    reported_earlier = chunk(h, s) == chunk(key, s);
+                if (!reported_earlier && hammingDistance(h, key) <= max_distance)
+                    out.push_back(id);
+            }
+        }
+    }
+
+    size_t size() const { return hashes.size(); }
+
+private:
+    static int chunk(uint64_t h, int t) { return static_cast<int>((h >> (t * 8)) & 0xFF); }
+
+    vector<uint64_t> hashes;
+    vector<int> bucket_offsets[8];
+    vector<int> bucket_ids[8];
+};
+
+// 每頁的代表頁索引：自己就是代表時為自己。pHash 距離 <= max_distance 且 dHash 距離 <= 2 * max_distance
+// 才算同一張，代表頁是群組裡索引最小的（頁面清單已排序，所以是檔名最前面的那張）
+vector<int> findDuplicatePages(const vector<PageHash> &hashes, int max_distance)
+{
+    // 分段索引只保證距離 <= max_exact_distance 的查詢不漏，更大的距離結果會不完整
+    max_distance = std::clamp(max_distance, 0, PerceptualHashIndex::max_exact_distance);
+    const int n = static_cast<int>(hashes.size());
+    vector<int> representative(n);
+    std::iota(representative.begin(), representative.end(), 0);
+
+    vector<uint64_t> keys(n);
+    for (int i = 0; i < n; ++i)
+        keys[i] = hashes[i].phash;
+    PerceptualHashIndex index;
+    index.build(keys);
+
+    auto find = [&](int x)
+    {
+        while (representative[x] != x)
+        {
+            representative[x] = representative[representative[x]];
+            x = representative[x];
+        }
+        return x;
+    };
+    vector<int> matches;
+    for (int i = 0; i < n; ++i)
+    {
+        if (!hashes[i].valid)
+            continue;
+        index.query(keys[i], max_distance, matches);
+        for (int j : matches)
+        {
+            if (j <= i || !hashes[j].valid || hammingDistance(hashes[i].dhash, hashes[j].dhash) > 2 * max_distance)
+                continue;
+            const int ri = find(i);
+            const int rj = find(j);
+            if (ri != rj)
+                representative[std::max(ri, rj)] = std::min(ri, rj);
+        }
+    }
+    for (int i = 0; i < n; ++i)
+        representative[i] = find(i);
+    return representative;
+}
+
+// GUI 的「Group Duplicates」在背景執行緒算 hash 與分組（hashImageFiles 本身分散到 sharedPool），
+// UI 每個 frame 用 take() 取回結果。跟 DirectoryIndex 一樣新的請求蓋掉舊的，只發布最新那次的結果
+class DuplicateGrouper
+{
+public:
+    struct Result
+    {
+        vector<string> names;
+        vector<int> representative; // names 的索引
+        double seconds = 0.0;
+    };
+
+    DuplicateGrouper() = default;
+    DuplicateGrouper(const DuplicateGrouper &) = delete;
+    DuplicateGrouper &operator=(const DuplicateGrouper &) = delete;
+
+    ~DuplicateGrouper() { stop(); }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        if (worker.joinable())
+            worker.join();
+    }
+
+    void submit(vector<string> names, vector<string> paths, int max_distance)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending_names = std::move(names);
+        pending_paths = std::move(paths);
+        pending_distance = max_distance;
+        ++requested;
+        if (busy || stopping)
+            return;
+        busy = true;
+        if (worker.joinable())
+            worker.join(); // 上一個執行緒已經結束（busy 為 false），join 不會等
+        worker = std::thread([this]() { run(); });
+    }
+
+    bool take(Result &out)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ready)
+            return false;
+        out = std::move(*ready);
+        ready.reset();
+        return true;
+    }
+
+    bool running() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return busy;
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            Result result;
+            vector<string> paths;
+            int max_distance;
+            uint64_t generation;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping || completed == requested)
+                {
+                    busy = false;
+                    return;
+                }
+                result.names.swap(pending_names);
+                paths.swap(pending_paths);
+                max_distance = pending_distance;
+                generation = requested;
+            }
+            const auto t0 = std::chrono::steady_clock::now();
+            result.representative = findDuplicatePages(hashImageFiles(paths), max_distance);
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            completed = generation;
+            if (completed == requested)
+                ready = std::move(result);
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::thread worker;
+    vector<string> pending_names;
+    vector<string> pending_paths;
+    int pending_distance = 0;
+    uint64_t requested = 0;
+    uint64_t completed = 0;
+    std::optional<Result> ready;
+    bool busy = false;
+    bool stopping = false;
+};
+
+// Ink mask (255 = ink) in the same sense the GUI clusters: dark pixels after thresholding
+// ink 已經是同大小的 CV_8UC1（arena 的或呼叫端的緩衝區）就直接寫進去
+void computeInkMaskInto(const cv::Mat &bgr, const BinaryThresholdSetting &setting, cv::Mat &ink, PageArena *arena = nullptr)
+{
+    if (setting.enable_binary)
+    {
+        cv::Mat binary_mask = computeBinaryMask(bgr, setting.color_space,
+                                                setting.rgb_threshold, setting.hsl_threshold, setting.hsv_threshold,
+                                                setting.adaptive_threshold, arena);
+        if (!binary_mask.empty())
+        {
+            cv::bitwise_not(binary_mask, ink);
+            return;
+        }
+    }
+    cv::cvtColor(bgr, ink, cv::COLOR_BGR2GRAY);
+    cv::bitwise_not(ink, ink);
+}
+
+cv::Mat computeInkMask(const cv::Mat &bgr, const BinaryThresholdSetting &setting, PageArena *arena = nullptr)
+{
+    cv::Mat ink = arena ? arena->mat(bgr.rows, bgr.cols, CV_8UC1) : cv::Mat();
+    computeInkMaskInto(bgr, setting, ink, arena);
+    return ink;
+}
+
+// 叢集前的遮罩清理（255 = 墨跡）：去掉雜點、補起筆畫的小缺口，少餵一些雜訊點給叢集。
+// 依序執行：開運算（先侵蝕再膨脹，去掉塞不下 open_size x open_size 方塊的細小墨跡）、
+// 閉運算（先膨脹再侵蝕，補起小於 close_size 的缺口）、再去掉面積小於 min_area 的 8 連通墨跡塊
+struct MorphologyOptions
+{
+    int open_size = 0;  // <= 1 表示不做；偶數會進位成奇數
+    int close_size = 0;
+    int min_area = 0;   // 像素數，0 表示不做
+
+    bool enabled() const { return open_size > 1 || close_size > 1 || min_area > 0; }
+};
+
+// 方形結構元素的侵蝕（min）/ 膨脹（max），拆成水平與垂直兩次一維濾波。
+// 一維用 van Herk / Gil-Werman：切成長度 w = 2r + 1 的區塊，求區塊內由左往右的前綴極值 g
+// 與由右往左的後綴極值 h；視窗 [i, i + 2r] 最多跨過一個區塊邊界，所以結果 = op(h[i], g[i + 2r])，
+// 每像素固定三次比較，與 w 無關。超出影像的部分補 pad（侵蝕補 255、膨脹補 0），邊界不受影響。
+// 水平一次處理一列（列帶平行）；垂直把整列當向量運算（行帶平行），內層迴圈是逐元素 min/max，編譯器會向量化
+template <bool IsMax>
+void extremumFilter(const cv::Mat &src, cv::Mat &dst, int size, PageArena *arena = nullptr)
+{
+    const int rows = src.rows;
+    const int cols = src.cols;
+    const int r = size / 2;
+    const int w = 2 * r + 1;
+    const uchar pad = IsMax ? 0 : 255;
+    auto op = [](uchar a, uchar b) { return IsMax ? std::max(a, b) : std::min(a, b); };
+
+    cv::Mat horizontal = arena ? arena->mat(rows, cols, CV_8UC1) : cv::Mat(rows, cols, CV_8UC1);
+    sharedPool().parallelFor(0, static_cast<size_t>(rows), 16, [&](size_t r0, size_t r1)
+    {
+        const int length = cols + 2 * r;
+        thread_local vector<uchar> buffer;
+        buffer.resize(static_cast<size_t>(length) * 3);
+        uchar *p = buffer.data();
+        uchar *g = p + length;
+        uchar *h = g + length;
+        for (int y = static_cast<int>(r0); y < static_cast<int>(r1); ++y)
+        {
+            std::fill_n(p, r, pad);
+            std::copy_n(src.ptr<uchar>(y), cols, p + r);
+            std::fill_n(p + r + cols, r, pad);
+            for (int block = 0; block < length; block += w)
+            {
+                const int end = std::min(block + w, length);
+                g[block] = p[block];
+                for (int i = block + 1; i < end; ++i)
+                    g[i] = op(g[i - 1], p[i]);
+                h[end - 1] = p[end - 1];
+                for (int i = end - 2; i >= block; --i)
+                    h[i] = op(h[i + 1], p[i]);
+            }
+            uchar *out = horizontal.ptr<uchar>(y);
+            for (int x = 0; x < cols; ++x)
+                out[x] = op(h[x], g[x + 2 * r]);
+        }
+    });
+
+    dst.create(rows, cols, CV_8UC1);
+    sharedPool().parallelFor(0, static_cast<size_t>(cols), 64, [&](size_t c0, size_t c1)
+    {
+        const int length = rows + 2 * r;
+        const size_t width = c1 - c0;
+        thread_local vector<uchar> buffer;
+        buffer.resize(static_cast<size_t>(length) * width * 2);
+        uchar *g = buffer.data();
+        uchar *h = g + static_cast<size_t>(length) * width;
+        vector<uchar> pad_row(width, pad);
+        auto input = [&](int i) { return (i < r || i >= r + rows) ? pad_row.data() : horizontal.ptr<uchar>(i - r) + c0; };
+        for (int block = 0; block < length; block += w)
+        {
+            const int end = std::min(block + w, length);
+            std::copy_n(input(block), width, g + static_cast<size_t>(block) * width);
+            for (int i = block + 1; i < end; ++i)
+            {
+                const uchar *in = input(i);
+                const uchar *prev = g + static_cast<size_t>(i - 1) * width;
+                uchar *row = g + static_cast<size_t>(i) * width;
+                for (size_t j = 0; j < width; ++j)
+                    row[j] = op(prev[j], in[j]);
+            }
+            std::copy_n(input(end - 1), width, h + static_cast<size_t>(end - 1) * width);
+            for (int i = end - 2; i >= block; --i)
+            {
+                const uchar *in = input(i);
+                const uchar *next = h + static_cast<size_t>(i + 1) * width;
+                uchar *row = h + static_cast<size_t>(i) * width;
+                for (size_t j = 0; j < width; ++j)
+                    row[j] = op(next[j], in[j]);
+            }
+        }
+        for (int y = 0; y < rows; ++y)
+        {
+            const uchar *hy = h + static_cast<size_t>(y) * width;
+            const uchar *gy = g + static_cast<size_t>(y + 2 * r) * width;
+            uchar *out = dst.ptr<uchar>(y) + c0;
+            for (size_t j = 0; j < width; ++j)
+                out[j] = op(hy[j], gy[j]);
+        }
+    });
+}
+
+// 去掉面積小於 min_area 的 8 連通墨跡塊；回傳去掉的像素數
+size_t removeSmallComponents(cv::Mat &ink, int min_area, PageArena *arena = nullptr)
+{
+    cv::Mat labels = arena ? arena->mat(ink.rows, ink.cols, CV_32SC1) : cv::Mat();
+    cv::Mat stats, centroids;
+    const int count = cv::connectedComponentsWithStats(ink, labels, stats, centroids, 8, CV_32S);
+    vector<uchar> remove(static_cast<size_t>(std::max(count, 1)), 0);
+    bool any = false;
+    for (int label = 1; label < count; ++label)
+    {
+        remove[label] = stats.at<int>(label, cv::CC_STAT_AREA) < min_area;
+        any = any || remove[label];
+    }
+    if (!any)
+        return 0;
+    std::atomic<size_t> removed{0};
+    sharedPool().parallelFor(0, static_cast<size_t>(ink.rows), 64, [&](size_t r0, size_t r1)
+    {
+        size_t local = 0;
+        for (int y = static_cast<int>(r0); y < static_cast<int>(r1); ++y)
+        {
+            const int *label = labels.ptr<int>(y);
+            uchar *row = ink.ptr<uchar>(y);
+            for (int x = 0; x < ink.cols; ++x)
+            {
+                if (remove[label[x]])
+                {
+                    row[x] = 0;
+                    ++local;
+                }
+            }
+        }
+        removed += local;
+    });
+    return removed;
+}
+
+// 就地清理墨跡遮罩；回傳清理前後墨跡像素數的差（正值表示少了這麼多雜訊點）
+long long applyMorphology(cv::Mat &ink, const MorphologyOptions &options, PageArena *arena = nullptr)
+{
+    if (!options.enabled() || ink.empty())
+        return 0;
+    const long long before = cv::countNonZero(ink);
+    // 半徑達到頁面長邊時每個像素的視窗都已蓋住整頁，再大結果也一樣；先夾住，
+    // 避免 --open 2147483647 之類的值讓 extremumFilter 的列長溢位、配置巨大的緩衝區
+    const int max_size = 2 * std::max(ink.rows, ink.cols) + 1;
+    const int open_size = std::min(options.open_size, max_size);
+    const int close_size = std::min(options.close_size, max_size);
+    if (open_size > 1)
+    {
+        extremumFilter<false>(ink, ink, open_size, arena);
+        extremumFilter<true>(ink, ink, open_size, arena);
+    }
+    if (close_size > 1)
+    {
+        extremumFilter<true>(ink, ink, close_size, arena);
+        extremumFilter<false>(ink, ink, close_size, arena);
+    }
+    if (options.min_area > 0)
+        removeSmallComponents(ink, options.min_area, arena);
+    return before - cv::countNonZero(ink);
+}
+
+// findNonZero 的替代：先數再填，輸出直接寫進呼叫端給的（可以是 arena 的）vector
+void gatherInkPoints(const cv::Mat &ink, std::pmr::vector<cv::Point> &points)
+{
+    points.clear();
+    points.reserve(static_cast<size_t>(cv::countNonZero(ink)));
+    for (int y = 0; y < ink.rows; ++y)
+    {
+        const uchar *row = ink.ptr<uchar>(y);
+        for (int x = 0; x < ink.cols; ++x)
+        {
+            if (row[x])
+                points.push_back(cv::Point(x, y));
+        }
+    }
+}
+
+// writemyfont 樣板頁：整頁是固定的字格。先用投影找出格線，再直接裁出每一格，
+// 只有需要清理的格子（格內墨跡碰到格線附近）才跑叢集分析，省掉整頁的叢集
+struct PageGrid
+{
+    std::pmr::vector<int> xs;        // 直線中心 x，由左而右
+    std::pmr::vector<int> ys;        // 橫線中心 y，由上而下
+    std::pmr::vector<int> x_widths;  // 各直線的粗細
+    std::pmr::vector<int> y_widths;  // 各橫線的粗細
+
+    explicit PageGrid(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+        : xs(resource), ys(resource), x_widths(resource), y_widths(resource) {}
+
+    int rows() const { return ys.size() < 2 ? 0 : static_cast<int>(ys.size()) - 1; }
+    int cols() const { return xs.size() < 2 ? 0 : static_cast<int>(xs.size()) - 1; }
+
+    // 格子內部（扣掉兩側格線的一半粗細與 margin）
+    cv::Rect cellRect(int row, int col, int margin) const
+    {
+        const int x0 = xs[col] + x_widths[col] / 2 + 1 + margin;
+        const int x1 = xs[col + 1] - x_widths[col + 1] / 2 - margin;
+        const int y0 = ys[row] + y_widths[row] / 2 + 1 + margin;
+        const int y1 = ys[row + 1] - y_widths[row + 1] / 2 - margin;
+        return cv::Rect(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0));
+    }
+};
+
+struct PageGridOptions
+{
+    float min_line_fraction = 0.3f;  // 格線至少要橫跨頁面這個比例
+    float peak_fraction = 0.6f;      // 投影值達到最大值的這個比例才算格線
+    float spacing_tolerance = 0.15f; // 相鄰格線間距與中位數的容許誤差
+    int min_cells = 2;               // 每個方向至少要有幾格才算樣板頁
+    int margin = 2;                  // 裁格子時再往內縮的距離
+    float border_fraction = 0.04f;   // 格子內緣這個比例寬的一圈有墨跡，就要清理
+    int min_points = 4;              // 清理時點數更少的叢集當雜點丟掉
+};
+
+// 一維投影 -> 格線。連續超過門檻的一段合成一條線，再挑出間距最規則的最長一串
+void findGridLines(std::span<const int> profile, int threshold, float tolerance,
+                          std::pmr::vector<int> &centers, std::pmr::vector<int> &widths,
+                          std::pmr::memory_resource *scratch)
+{
+    std::pmr::vector<int> seg_center(scratch), seg_width(scratch);
+    const int n = static_cast<int>(profile.size());
+    for (int i = 0; i < n;)
+    {
+        if (profile[i] < threshold)
+        {
+            ++i;
+            continue;
+        }
+        int j = i;
+        while (j < n && profile[j] >= threshold)
+            ++j;
+        seg_center.push_back((i + j - 1) / 2);
+        seg_width.push_back(j - i);
+        i = j;
+    }
+
+    centers.clear();
+    widths.clear();
+    if (seg_center.size() < 2)
+        return;
+
+    std::pmr::vector<int> spacing(scratch);
+    for (size_t k = 1; k < seg_center.size(); ++k)
+        spacing.push_back(seg_center[k] - seg_center[k - 1]);
+    std::pmr::vector<int> sorted(spacing.begin(), spacing.end(), scratch);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    const int median = sorted[sorted.size() / 2];
+
+    // 最長的一串「間距接近中位數」的連續格線
+    size_t best_begin = 0, best_len = 0;
+    for (size_t k = 0; k < spacing.size();)
+    {
+        if (std::abs(spacing[k] - median) > tolerance * median)
+        {
+            ++k;
+            continue;
+        }
+        size_t e = k;
+        while (e < spacing.size() && std::abs(spacing[e] - median) <= tolerance * median)
+            ++e;
+        if (e - k > best_len)
+        {
+            best_begin = k;
+            best_len = e - k;
+        }
+        k = e;
+    }
+    if (best_len == 0)
+        return;
+    centers.assign(seg_center.begin() + best_begin, seg_center.begin() + best_begin + best_len + 1);
+    widths.assign(seg_width.begin() + best_begin, seg_width.begin() + best_begin + best_len + 1);
+}
+
+// 在墨跡遮罩上找樣板格線；找不到夠規則的格子就回傳 false，呼叫端改跑整頁叢集
+bool detectPageGrid(const cv::Mat &ink, PageGrid &grid,
+                    std::pmr::memory_resource *scratch = std::pmr::get_default_resource(),
+                    const PageGridOptions &options = PageGridOptions())
+{
+    grid.xs.clear();
+    grid.ys.clear();
+    grid.x_widths.clear();
+    grid.y_widths.clear();
+    if (ink.empty() || ink.type() != CV_8UC1)
+        return false;
+
+    std::pmr::vector<int> row_profile(ink.rows, 0, scratch);
+    std::pmr::vector<int> col_profile(ink.cols, 0, scratch);
+    for (int y = 0; y < ink.rows; ++y)
+    {
+        const uchar *row = ink.ptr<uchar>(y);
+        int count = 0;
+        for (int x = 0; x < ink.cols; ++x)
+        {
+            const int on = row[x] >= 128;
+            count += on;
+            col_profile[x] += on;
+        }
+        row_profile[y] = count;
+    }
+
+    auto threshold = [&](std::span<const int> profile, int length)
+    {
+        const int peak = *std::max_element(profile.begin(), profile.end());
+        return std::max(static_cast<int>(options.min_line_fraction * length),
+                        static_cast<int>(options.peak_fraction * peak));
+    };
+    findGridLines(row_profile, threshold(row_profile, ink.cols), options.spacing_tolerance, grid.ys, grid.y_widths, scratch);
+    findGridLines(col_profile, threshold(col_profile, ink.rows), options.spacing_tolerance, grid.xs, grid.x_widths, scratch);
+    return grid.rows() >= options.min_cells && grid.cols() >= options.min_cells;
+}
+
+// 依格子順序（由上而下、由左而右）收集格內的墨跡點；每個非空格子輸出成一組。
+// 乾淨的格子整格就是一個字；墨跡碰到格子內緣的才在格內做叢集，
+// 丟掉貼著格線的細長殘線與雜點，剩下的合成一個字
+void extractTemplateCells(const cv::Mat &ink, const PageGrid &grid, double radius,
+                          std::pmr::vector<cv::Point> &points, ClusterCSR &cells,
+                          std::pmr::memory_resource *scratch = std::pmr::get_default_resource(),
+                          const PageGridOptions &options = PageGridOptions())
+{
+    points.clear();
+    cells.offsets.assign(1, 0);
+    cells.indices.clear();
+
+    int line_width = 1;
+    for (int w : grid.x_widths)
+        line_width = std::max(line_width, w);
+    for (int w : grid.y_widths)
+        line_width = std::max(line_width, w);
+    const int residue = 2 * line_width + 2;
+
+    std::pmr::vector<int> keep(scratch);
+    for (int r = 0; r < grid.rows(); ++r)
+    {
+        for (int c = 0; c < grid.cols(); ++c)
+        {
+            const cv::Rect rect = grid.cellRect(r, c, options.margin) & cv::Rect(0, 0, ink.cols, ink.rows);
+            if (rect.width <= 0 || rect.height <= 0)
+                continue;
+            const int border = std::max(2, static_cast<int>(options.border_fraction * std::min(rect.width, rect.height)));
+            const cv::Rect inner(rect.x + border, rect.y + border, rect.width - 2 * border, rect.height - 2 * border);
+
+            const size_t first = points.size();
+            bool dirty = false;
+            for (int y = rect.y; y < rect.y + rect.height; ++y)
+            {
+                const uchar *row = ink.ptr<uchar>(y);
+                for (int x = rect.x; x < rect.x + rect.width; ++x)
+                {
+                    if (!row[x])
+                        continue;
+                    points.push_back(cv::Point(x, y));
+                    dirty = dirty || !inner.contains(cv::Point(x, y));
+                }
+            }
+            if (points.size() == first)
+                continue;
+
+            std::span<const cv::Point> cell_points(points.data() + first, points.size() - first);
+            if (!dirty)
+            {
+                for (size_t i = first; i < points.size(); ++i)
+                    cells.indices.push_back(static_cast<int>(i));
+            }
+            else
+            {
+                ClusterCSR parts(scratch);
+                clusterInkPoints(cell_points, ink.size(), radius, parts, scratch);
+                for (size_t k = 0; k < parts.size(); ++k)
+                {
+                    int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+                    for (int idx : parts[k])
+                    {
+                        min_x = std::min(min_x, cell_points[idx].x);
+                        min_y = std::min(min_y, cell_points[idx].y);
+                        max_x = std::max(max_x, cell_points[idx].x);
+                        max_y = std::max(max_y, cell_points[idx].y);
+                    }
+                    const bool touches_border = min_x < inner.x || min_y < inner.y ||
+                                                max_x >= inner.x + inner.width || max_y >= inner.y + inner.height;
+                    const bool thin = max_x - min_x < residue || max_y - min_y < residue;
+                    if (static_cast<int>(parts[k].size()) < options.min_points || (touches_border && thin))
+                        continue;
+                    for (int idx : parts[k])
+                        cells.indices.push_back(static_cast<int>(first) + idx);
+                }
+            }
+            if (cells.indices.size() > static_cast<size_t>(cells.offsets.back()))
+                cells.offsets.push_back(static_cast<int>(cells.indices.size()));
+        }
+    }
+}
+
+// 結果快取：同一張圖、同一組設定重跑時直接取回遮罩、點、叢集 CSR 與統計。
+// key = 來源檔內容的 hash 與處理參數（二值化設定、半徑、模式）的 hash 合成，
+// 記憶體裡是有容量上限的 LRU，磁碟上每個 key 一個檔，先寫暫存檔再 rename，當掉也不會留下半個檔
+
+// MurmurHash64A
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (size * m);
+    const uchar *bytes = static_cast<const uchar *>(data);
+    const size_t words = size / 8;
+    for (size_t i = 0; i < words; ++i)
+    {
+        uint64_t k;
+        memcpy(&k, bytes + i * 8, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    const uchar *tail = bytes + words * 8;
+    switch (size & 7)
+    {
+    case 7: h ^= uint64_t(tail[6]) << 48; [[fallthrough]];
+    case 6: h ^= uint64_t(tail[5]) << 40; [[fallthrough]];
+    case 5: h ^= uint64_t(tail[4]) << 32; [[fallthrough]];
+    case 4: h ^= uint64_t(tail[3]) << 24; [[fallthrough]];
+    case 3: h ^= uint64_t(tail[2]) << 16; [[fallthrough]];
+    case 2: h ^= uint64_t(tail[1]) << 8; [[fallthrough]];
+    case 1: h ^= uint64_t(tail[0]);
+            h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// 處理參數的 hash：設定以 JSON 序列化（不含名稱，名稱不影響結果），extra 放半徑、模式等其他會改變結果的東西
+uint64_t hashProcessingParameters(const BinaryThresholdSetting &setting, const string &extra)
+{
+    Json::Value params = binaryThresholdSettingToJson(setting);
+    params.removeMember("name");
+    params["extra"] = extra;
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    const string text = Json::writeString(builder, params);
+    return hashBytes(text.data(), text.size());
+}
+
+inline uint64_t resultCacheKey(uint64_t content_hash, uint64_t parameter_hash)
+{
+    return hashBytes(&parameter_hash, sizeof(parameter_hash), content_hash);
+}
+
+struct CachedPageResult
+{
+    cv::Mat ink;                 // 墨跡遮罩 (CV_8UC1, 255 = ink)
+    vector<cv::Point> points;    // 叢集索引所指的點
+    vector<int> offsets;         // ClusterCSR::offsets
+    vector<int> indices;         // ClusterCSR::indices
+    vector<ClusterStats> stats;
+
+    size_t bytes() const
+    {
+        return ink.total() + points.size() * sizeof(cv::Point) + (offsets.size() + indices.size()) * sizeof(int) +
+               stats.size() * sizeof(ClusterStats);
+    }
+};
+
+class ResultCache
+{
+public:
+    // directory 為空字串時只用記憶體
+    explicit ResultCache(const string &dir = "", size_t memory_budget_bytes = size_t(256) << 20)
+        : directory(dir), memory_budget(memory_budget_bytes)
+    {
+        if (!directory.empty())
+        {
+            std::error_code ec;
+            filesystem::create_directories(directory, ec);
+            if (ec)
+            {
+                cerr << "Failed to create result cache directory: " << directory << endl;
+                directory.clear();
+            }
+        }
+    }
+
+    std::shared_ptr<const CachedPageResult> find(uint64_t key)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = lookup.find(key);
+            if (it != lookup.end())
+            {
+                lru.splice(lru.begin(), lru, it->second);
+                ++hit_count;
+                return it->second->second;
+            }
+        }
+        if (!directory.empty())
+        {
+            auto result = std::make_shared<CachedPageResult>();
+            if (readEntry(entryPath(key), key, *result))
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++hit_count;
+                insertLocked(key, result);
+                return result;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        ++miss_count;
+        return nullptr;
+    }
+
+    void store(uint64_t key, std::shared_ptr<const CachedPageResult> result)
+    {
+        if (!result)
+            return;
+        if (!directory.empty() && !writeEntry(entryPath(key), key, *result))
+            cerr << "Failed to write result cache entry for key " << std::hex << key << std::dec << endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        insertLocked(key, std::move(result));
+    }
+
+    size_t hits() const { return hit_count; }
+    size_t misses() const { return miss_count; }
+
+private:
+    static constexpr uint32_t file_magic = 0x43525748; // "HWRC"
+    static constexpr uint32_t file_version = 1;
+
+    string entryPath(uint64_t key) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+        return (filesystem::path(directory) / name).string();
+    }
+
+    void insertLocked(uint64_t key, std::shared_ptr<const CachedPageResult> result)
+    {
+        auto it = lookup.find(key);
+        if (it != lookup.end())
+        {
+            memory_used -= it->second->second->bytes();
+            lru.erase(it->second);
+            lookup.erase(it);
+        }
+        memory_used += result->bytes();
+        lru.emplace_front(key, std::move(result));
+        lookup[key] = lru.begin();
+        // 至少留住最新的一筆
+        while (memory_used > memory_budget && lru.size() > 1)
+        {
+            memory_used -= lru.back().second->bytes();
+            lookup.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    template <typename T>
+    static void writeVector(ofstream &file, const vector<T> &v)
+    {
+        const uint64_t count = v.size();
+        file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        file.write(reinterpret_cast<const char *>(v.data()), static_cast<std::streamsize>(count * sizeof(T)));
+    }
+
+    template <typename T>
+    static bool readVector(ifstream &file, vector<T> &v, uint64_t max_count)
+    {
+        uint64_t count = 0;
+        if (!file.read(reinterpret_cast<char *>(&count), sizeof(count)) || count > max_count)
+            return false;
+        v.resize(static_cast<size_t>(count));
+        return static_cast<bool>(file.read(reinterpret_cast<char *>(v.data()), static_cast<std::streamsize>(count * sizeof(T))));
+    }
+
+    // 檔案格式：magic, version, key, 遮罩 PNG, points, offsets, indices, stats（各自前置 uint64 數量）
+    static bool writeEntry(const string &path, uint64_t key, const CachedPageResult &result)
+    {
+        vector<uchar> png;
+        if (!result.ink.empty() && !cv::imencode(".png", result.ink, png))
+            return false;
+
+        const string temp_path = temporaryPathFor(path);
+        {
+            ofstream file(temp_path, ios::binary | ios::trunc);
+            if (!file.is_open())
+                return false;
+            file.write(reinterpret_cast<const char *>(&file_magic), sizeof(file_magic));
+            file.write(reinterpret_cast<const char *>(&file_version), sizeof(file_version));
+            file.write(reinterpret_cast<const char *>(&key), sizeof(key));
+            writeVector(file, png);
+            writeVector(file, result.points);
+            writeVector(file, result.offsets);
+            writeVector(file, result.indices);
+            writeVector(file, result.stats);
+            if (!file.good())
+                return false;
+        }
+        return commitTemporaryFile(temp_path, path);
+    }
+
+    static bool readEntry(const string &path, uint64_t key, CachedPageResult &result)
+    {
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file.is_open())
+            return false;
+        const uint64_t file_size = static_cast<uint64_t>(file.tellg());
+        file.seekg(0);
+
+        uint32_t magic = 0, version = 0;
+        uint64_t stored_key = 0;
+        file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+        file.read(reinterpret_cast<char *>(&version), sizeof(version));
+        file.read(reinterpret_cast<char *>(&stored_key), sizeof(stored_key));
+        if (!file || magic != file_magic || version != file_version || stored_key != key)
+            return false;
+
+        vector<uchar> png;
+        if (!readVector(file, png, file_size) ||
+            !readVector(file, result.points, file_size / sizeof(cv::Point)) ||
+            !readVector(file, result.offsets, file_size / sizeof(int)) ||
+            !readVector(file, result.indices, file_size / sizeof(int)) ||
+            !readVector(file, result.stats, file_size / sizeof(ClusterStats)))
+        {
+            return false;
+        }
+        if (!png.empty())
+        {
+            result.ink = cv::imdecode(png, cv::IMREAD_GRAYSCALE);
+            if (result.ink.empty())
+                return false;
+        }
+        return validEntry(result);
+    }
+
+    // 快取目錄可能是多台機器、服務與批次共用的，壞掉的項目當成沒命中，不能讓後面的輸出越界：
+    // offsets 從 0 開始不遞減、結尾等於 indices 的數量，索引都指向 points，
+    // 點落在遮罩內，統計的點數與外框跟從點與叢集重新算出來的相同（質心是浮點數，不同機器可能差一點，不比）
+    static bool validEntry(const CachedPageResult &result)
+    {
+        if (result.offsets.empty())
+            return result.indices.empty() && result.stats.empty();
+        if (result.offsets.front() != 0 || static_cast<size_t>(result.offsets.back()) != result.indices.size() ||
+            result.stats.size() != result.offsets.size() - 1 ||
+            std::adjacent_find(result.offsets.begin(), result.offsets.end(), std::greater<int>()) != result.offsets.end())
+        {
+            return false;
+        }
+        const size_t point_count = result.points.size();
+        if (std::any_of(result.indices.begin(), result.indices.end(),
+                        [&](int idx) { return idx < 0 || static_cast<size_t>(idx) >= point_count; }))
+        {
+            return false;
+        }
+        if (!result.ink.empty() &&
+            std::any_of(result.points.begin(), result.points.end(), [&](const cv::Point &p)
+                        { return p.x < 0 || p.y < 0 || p.x >= result.ink.cols || p.y >= result.ink.rows; }))
+        {
+            return false;
+        }
+
+        ClusterCSR clusters;
+        clusters.offsets.assign(result.offsets.begin(), result.offsets.end());
+        clusters.indices.assign(result.indices.begin(), result.indices.end());
+        std::pmr::vector<ClusterStats> expected;
+        computeClusterStats(result.points, clusters, expected);
+        return std::equal(expected.begin(), expected.end(), result.stats.begin(), [](const ClusterStats &a, const ClusterStats &b)
+                          { return a.size == b.size && a.bbox.x == b.bbox.x && a.bbox.y == b.bbox.y && a.bbox.width == b.bbox.width &&
+                                   a.bbox.height == b.bbox.height; });
+    }
+
+    string directory;
+    size_t memory_budget;
+    size_t memory_used = 0;
+    std::list<std::pair<uint64_t, std::shared_ptr<const CachedPageResult>>> lru;
+    std::unordered_map<uint64_t, decltype(lru)::iterator> lookup;
+    std::mutex mutex;
+    std::atomic<size_t> hit_count{0};
+    std::atomic<size_t> miss_count{0};
+};
+
+// GUI 的叢集背景工作：按鈕按下後，讀檔查快取、二值化遮罩、清理、取點、叢集、統計與分行全部在這條執行緒做，
+// UI 執行緒只送出請求、每個 frame 用 take() 取回結果。密集的頁面先送出一份抽樣的預覽叢集，
+// 精確叢集（含筆畫合併與統計）接著在同一條執行緒算完再送一次。新的請求蓋掉還沒開始的舊請求；
+// 已經在跑的做完時如果又有新請求，結果直接丟掉。
+// 上一次精確叢集的狀態（IncrementalClusterer）只有這條執行緒會碰，同一頁小幅改門檻時只重算變動的像素
+class BackgroundClusterer
+{
+public:
+    struct Request
+    {
+        uint64_t generation = 0; // UI 用來認出結果屬於哪一次請求
+        cv::Mat rgb;             // 顯示中的影像；載入新圖時 image 換成新的緩衝，不會改寫這一份
+        string source;           // 來源檔（快取 key 與增量叢集用）
+        uint64_t parameter_hash = 0;
+        double radius = 5.0;
+        bool merge_strokes = false;
+        bool template_grid = false;
+        MorphologyOptions morphology;
+        double preview_budget_ms = 8.0;
+    };
+
+    struct Result
+    {
+        uint64_t generation = 0;
+        string source;
+        bool preview = false;         // 抽樣的預覽，之後還會有精確結果
+        PreviewClusterInfo preview_info;
+        bool cached = false;
+        long long cleanup_removed = -1; // 遮罩清理拿掉的墨跡像素，沒做清理或取自快取時為 -1
+        vector<cv::Point> points;
+        vector<vector<int>> clusters;
+        std::pmr::vector<ClusterStats> stats;
+        PageLayout layout;
+        size_t stroke_count = 0;
+        double ms = 0.0;
+    };
+
+    // cache 可為 nullptr；必須比這個物件活得久
+    explicit BackgroundClusterer(ResultCache *cache = nullptr) : result_cache(cache) {}
+    BackgroundClusterer(const BackgroundClusterer &) = delete;
+    BackgroundClusterer &operator=(const BackgroundClusterer &) = delete;
+
+    ~BackgroundClusterer() { stop(); }
+
+    // 等目前的工作做完後結束執行緒，之後不再接受請求
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            pending.reset();
+        }
+        if (worker.joinable())
+            worker.join();
+    }
+
+    void submit(Request request)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping)
+            return;
+        pending = std::move(request);
+        if (busy)
+            return;
+        busy = true;
+        if (worker.joinable())
+            worker.join(); // 上一個執行緒已經結束（busy 為 false），join 不會等
+        worker = std::thread([this]() { run(); });
+    }
+
+    // 有做完的結果就取出，沒有回傳 nullopt
+    std::optional<Result> take()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::optional<Result> result = std::move(ready);
+        ready.reset();
+        return result;
+    }
+
+    bool running() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return busy;
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            Request request;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping || !pending)
+                {
+                    busy = false;
+                    return;
+                }
+                request = std::move(*pending);
+                pending.reset();
+            }
+            process(request);
+        }
+    }
+
+    bool superseded() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stopping || pending.has_value();
+    }
+
+    void process(const Request &request)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        Result result;
+        result.generation = request.generation;
+        result.source = request.source;
+
+        // 快取 key：來源檔內容 + 影響顯示影像的效果 + 叢集選項
+        vector<uchar> source_bytes;
+        const bool have_source = result_cache && readFileBytes(request.source, source_bytes);
+        const uint64_t cache_key = have_source ? resultCacheKey(hashBytes(source_bytes.data(), source_bytes.size()),
+                                                                request.parameter_hash)
+                                               : 0;
+        if (auto cached = have_source ? result_cache->find(cache_key) : nullptr)
+        {
+            result.cached = true;
+            result.points.assign(cached->points.begin(), cached->points.end());
+            ClusterCSR csr;
+            csr.offsets.assign(cached->offsets.begin(), cached->offsets.end());
+            csr.indices.assign(cached->indices.begin(), cached->indices.end());
+            result.stats.assign(cached->stats.begin(), cached->stats.end());
+            result.stroke_count = csr.size();
+            cout << "Loaded " << csr.size() << " clusters from result cache" << endl;
+            publish(std::move(result), csr, t0);
+            return;
+        }
+
+        cv::Mat ink;
+        cv::cvtColor(request.rgb, ink, cv::COLOR_RGB2GRAY);
+        cv::bitwise_not(ink, ink);
+        const long long cleaned = applyMorphology(ink, request.morphology);
+        result.cleanup_removed = request.morphology.enabled() ? cleaned : -1;
+        if (cleaned != 0)
+            cout << "Mask cleanup removed " << cleaned << " ink pixels" << endl;
+        cv::findNonZero(ink, result.points);
+        cout << "Comparison of non-zero points to total pixels:" << endl;
+        cout << " - Non-zero points found: " << result.points.size() << endl;
+        cout << " - Total pixels in image: " << ink.total() << endl;
+        cout << (result.points.size() == ink.total() ? "Result: All pixels in the image are non-zero."
+                                                     : "Result: Not all pixels in the image are non-zero.")
+             << endl;
+
+        ClusterCSR csr;
+        PageGrid grid;
+        const bool on_grid = request.template_grid && detectPageGrid(ink, grid);
+        if (on_grid)
+        {
+            std::pmr::vector<cv::Point> cell_points;
+            extractTemplateCells(ink, grid, request.radius, cell_points, csr);
+            result.points.assign(cell_points.begin(), cell_points.end());
+            cout << "Template grid: " << grid.rows() << " x " << grid.cols() << " cells, " << csr.size() << " non-empty" << endl;
+        }
+        else
+        {
+            IncrementalClusterer::UpdateStats delta;
+            if (incremental_source == request.source && incremental.matches(ink.size(), request.radius) &&
+                incremental.update(ink, 0.1, &delta))
+            {
+                incremental.extract(result.points, csr);
+                cout << "Incremental clustering: +" << delta.added << " / -" << delta.removed << " pixels, "
+                     << delta.reclustered_components << " clusters re-labeled" << endl;
+            }
+            else
+            {
+                // 頁面小到預算內就直接是精確結果，否則先送出預覽，再接著算精確叢集
+                PreviewClusterInfo info;
+                previewClusterInkPoints(result.points, ink.size(), request.radius, request.preview_budget_ms, csr, &info);
+                if (info.cell > 1)
+                {
+                    Result preview;
+                    preview.generation = result.generation;
+                    preview.source = result.source;
+                    preview.preview = true;
+                    preview.preview_info = info;
+                    preview.cleanup_removed = result.cleanup_removed;
+                    preview.points = result.points;
+                    computeClusterStats(preview.points, csr, preview.stats);
+                    preview.stroke_count = csr.size();
+                    if (request.merge_strokes)
+                        mergeStrokes(preview.points, preview.stats, csr);
+                    cout << "Preview: " << preview.stats.size() << " clusters from " << info.samples << " of "
+                         << preview.points.size() << " points (" << info.cell
+                         << " px cells), exact clustering running in background" << endl;
+                    publish(std::move(preview), csr, t0);
+                    if (superseded())
+                        return;
+                    csr = ClusterCSR();
+                    clusterInkPoints(result.points, ink.size(), request.radius, csr);
+                    cout << "Exact clustering: " << csr.size() << " strokes in "
+                         << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() << " ms" << endl;
+                }
+                incremental.reset(ink, result.points, csr, request.radius);
+                incremental_source = request.source;
+            }
+        }
+        computeClusterStats(result.points, csr, result.stats);
+        result.stroke_count = csr.size();
+        if (request.merge_strokes && !on_grid)
+            mergeStrokes(result.points, result.stats, csr);
+        if (superseded())
+            return;
+
+        if (have_source)
+        {
+            auto cached = std::make_shared<CachedPageResult>();
+            cached->ink = ink;
+            cached->points = result.points;
+            cached->offsets.assign(csr.offsets.begin(), csr.offsets.end());
+            cached->indices.assign(csr.indices.begin(), csr.indices.end());
+            cached->stats.assign(result.stats.begin(), result.stats.end());
+            result_cache->store(cache_key, std::move(cached));
+        }
+        publish(std::move(result), csr, t0);
+    }
+
+    static void mergeStrokes(std::span<const cv::Point> points, std::pmr::vector<ClusterStats> &stats, ClusterCSR &csr)
+    {
+        ClusterCSR characters;
+        mergeStrokeClusters(stats, csr, characters);
+        csr = std::move(characters);
+        computeClusterStats(points, csr, stats);
+    }
+
+    // 分行、轉成 UI 用的巢狀清單；沒有更新的請求在排隊才交給 UI
+    void publish(Result &&result, const ClusterCSR &csr, std::chrono::steady_clock::time_point t0)
+    {
+        result.clusters = csr.toNested();
+        analyzeLayout(result.stats, result.layout);
+        result.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pending && !stopping)
+            ready = std::move(result);
+    }
+
+    ResultCache *result_cache;
+    mutable std::mutex mutex;
+    std::thread worker;
+    std::optional<Request> pending;
+    std::optional<Result> ready;
+    bool busy = false;
+    bool stopping = false;
+    // 以下只有 worker 執行緒會碰
+    IncrementalClusterer incremental;
+    string incremental_source;
+};
+
+struct BatchOptions
+{
+    string input_dir = "../impool";
+    string output_dir = "../batch_output";
+    BinaryThresholdSetting setting;
+    int setting_id = 0;      // 設定庫裡的 id，0 表示沒有指定（內建預設值）
+    double radius = 5.0;
+    unsigned decode_threads = 2;
+    unsigned threshold_threads = 2;
+    unsigned cluster_threads = 1;
+    unsigned export_threads = 1;
+    size_t queue_depth = 4;
+    bool merge_strokes = false;
+    bool template_grid = false;
+    MorphologyOptions morphology; // 叢集前的遮罩清理
+    int dedup_distance = -1; // >= 0 時先找出近似重複頁，只處理每組的代表頁
+    bool use_cache = true;
+    string cache_dir;        // 空字串表示 output_dir/cache
+    bool fresh = false;      // 忽略 batch_journal.jsonl，全部重跑
+    size_t memory_budget_mb = 0; // 解碼中頁面的估計記憶體上限，0 表示不限制
+};
+
+// 除了二值化設定之外會改變結果的參數，跟設定一起組成結果快取的 key（批次與 --serve 共用，快取可以互通）
+string processingExtra(const BatchOptions &options)
+{
+    std::ostringstream extra;
+    extra << "radius=" << options.radius << ";merge_strokes=" << options.merge_strokes
+          << ";template_grid=" << options.template_grid << ";open=" << options.morphology.open_size
+          << ";close=" << options.morphology.close_size << ";despeckle=" << options.morphology.min_area;
+    return extra.str();
+}
+
+// 批次處理的一頁。PageJob 本身是預先建立、重複使用的槽位，
+// 除了解碼出來的 bgr 以外，所有每頁暫存都放在自己的 arena 裡，回收時整個 reset
+struct PageJob
+{
+    size_t index = 0;
+    const string *path = nullptr;
+    uint64_t cache_key = 0;
+    std::shared_ptr<const CachedPageResult> cached; // 命中快取時直接跳過 threshold 與 cluster
+    cv::Size page_size;
+    bool resumed = false;   // 日誌裡已完成的頁面
+    bool processed = false; // 已有叢集結果（算出來的或快取來的），可以記進日誌
+    size_t budget_bytes = 0; // 向 MemoryBudget 借的估計 bytes，匯出後歸還
+    uint64_t source_size = 0;   // 讀檔前的大小與修改時間，記進日誌
+    int64_t source_mtime = 0;
+    bool stamped = false;
+    PageArena arena;
+    cv::Mat decode_buffer; // WebP 直接解進這裡（bgr 是它的 ROI），跟 arena 一樣超過高水位才在 recycle 釋放
+    cv::Mat bgr;
+    cv::Mat ink;
+    std::pmr::vector<cv::Point> points{&arena};
+    ClusterCSR clusters{&arena};
+    std::pmr::vector<ClusterStats> stats{&arena};
+    PageLayout layout{&arena};
+
+    // 先丟掉指向 arena 的容器，再把 arena 倒回起點
+    void recycle()
+    {
+        cached.reset();
+        cache_key = 0;
+        page_size = cv::Size();
+        resumed = false;
+        processed = false;
+        budget_bytes = 0;
+        source_size = 0;
+        source_mtime = 0;
+        stamped = false;
+        bgr.release();
+        ink.release();
+        points = std::pmr::vector<cv::Point>(&arena);
+        clusters = ClusterCSR(&arena);
+        stats = std::pmr::vector<ClusterStats>(&arena);
+        layout = PageLayout(&arena);
+        arena.reset();
+        if (decode_buffer.total() * decode_buffer.elemSize() > arena.retainLimit())
+            decode_buffer.release();
+    }
+};
+
+// 叢集結果的二進位檔 (.hwcl)：給 OCR、排字等下游直接 mmap 讀取，不需要解析。
+// 全部是 little-endian、4/8 byte 對齊的固定結構，讀取端直接把 span 指到映射記憶體上：
+//   ClusterFileHeader
+//   每頁：ClusterRecord[cluster_count]，接著 PixelRun[run_count]（頁首 8 byte 對齊）
+//   ClusterFilePage[page_count]              （位於 page_table_offset）
+//   字串表：各頁來源路徑（UTF-8，不以 0 結尾）
+// 讀取端只依表頭記的 offset 找資料，所以頁面資料可以邊做邊寫，頁表最後才接上。
+// --watch 的後續幾輪把新頁面與新頁表接在檔尾，最後才改表頭；表頭 file_size 之後可能還有正在追加的資料
+// 每個叢集的像素以水平 run 表示（依 y、x 排序），ClusterRecord 記錄它在該頁 run 陣列中的範圍
+struct ClusterFileHeader
+{
+    char magic[4];                // "HWCL"
+    uint32_t version;
+    uint32_t page_count;
+    uint32_t reserved;
+    uint64_t page_table_offset;
+    uint64_t string_table_offset;
+    uint64_t file_size;
+};
+
+struct ClusterFilePage
+{
+    uint64_t offset;              // ClusterRecord 陣列的位置
+    uint32_t source_offset;       // 字串表內的位置
+    uint32_t source_length;
+    int32_t width;
+    int32_t height;
+    uint32_t cluster_count;
+    uint32_t run_count;
+};
+
+struct ClusterRecord
+{
+    int32_t x, y, width, height;  // 外框
+    float centroid_x, centroid_y;
+    int32_t size;                 // 像素數
+    uint32_t first_run;
+    uint32_t run_count;
+    int32_t line;                 // 文字行（沒有版面分析時為 -1）
+};
+
+struct PixelRun
+{
+    int32_t y;
+    int32_t x;
+    int32_t length;
+};
+
+static_assert(sizeof(ClusterFileHeader) == 40 && sizeof(ClusterFilePage) == 32 &&
+              sizeof(ClusterRecord) == 40 && sizeof(PixelRun) == 12,
+              "cluster file structs must not contain padding");
+
+constexpr uint32_t cluster_file_version = 1;
+
+// 收集多頁叢集結果寫成 .hwcl；addPage 可由多個執行緒同時呼叫。
+// open() 之後每頁做完就寫進暫存檔，記憶體裡只留頁表與路徑；沒呼叫 open() 時先收在記憶體，write() 時一起寫。
+// write() 之後還可以繼續 addPage / removePage 再 write()：新頁面直接追加到已提交的檔案，舊頁表留在原處不再使用
+class ClusterFileWriter
+{
+public:
+    ClusterFileWriter() = default;
+    ClusterFileWriter(const ClusterFileWriter &) = delete;
+    ClusterFileWriter &operator=(const ClusterFileWriter &) = delete;
+
+    ~ClusterFileWriter()
+    {
+        if (file.is_open())
+        {
+            file.close();
+            std::error_code ec;
+            filesystem::remove(temp_path, ec);
+        }
+    }
+
+    bool open(const string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return openLocked(path);
+    }
+
+    template <typename Clusters>
+    void addPage(const string &source_path, cv::Size page_size,
+                 std::span<const cv::Point> points, const Clusters &clusters,
+                 std::span<const ClusterStats> stats, const PageLayout *layout = nullptr)
+    {
+        PageData page;
+        page.source = source_path;
+        page.width = page_size.width;
+        page.height = page_size.height;
+        page.records.resize(clusters.size());
+
+        vector<cv::Point> sorted;
+        for (size_t c = 0; c < clusters.size(); ++c)
+        {
+            sorted.clear();
+            for (int idx : clusters[c])
+                sorted.push_back(points[idx]);
+            std::sort(sorted.begin(), sorted.end(), [](const cv::Point &a, const cv::Point &b)
+                      { return a.y != b.y ? a.y < b.y : a.x < b.x; });
+
+            ClusterRecord &r = page.records[c];
+            r.x = stats[c].bbox.x;
+            r.y = stats[c].bbox.y;
+            r.width = stats[c].bbox.width;
+            r.height = stats[c].bbox.height;
+            r.centroid_x = stats[c].centroid.x;
+            r.centroid_y = stats[c].centroid.y;
+            r.size = stats[c].size;
+            r.first_run = static_cast<uint32_t>(page.runs.size());
+            r.line = layout ? layout->line_of[c] : -1;
+            for (size_t k = 0; k < sorted.size(); ++k)
+            {
+                const cv::Point &p = sorted[k];
+                if (k > 0 && p.y == sorted[k - 1].y && p.x == sorted[k - 1].x)
+                    continue;
+                if (page.runs.size() > r.first_run && page.runs.back().y == p.y &&
+                    page.runs.back().x + page.runs.back().length == p.x)
+                    ++page.runs.back().length;
+                else
+                    page.runs.push_back(PixelRun{p.y, p.x, 1});
+            }
+            r.run_count = static_cast<uint32_t>(page.runs.size()) - r.first_run;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file.is_open() || (committed && reopenLocked()))
+            appendPageLocked(page);
+        else
+            pages.push_back(std::move(page));
+    }
+
+    // 拿掉一頁（頁面被刪除或要重做）；資料留在檔案裡，只是頁表不再指向它
+    void removePage(const string &source_path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::erase_if(pages, [&](const PageData &page) { return page.source == source_path; });
+        size_t kept = 0;
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            if (table_sources[i] == source_path)
+                continue;
+            table[kept] = table[i];
+            table_sources[kept] = std::move(table_sources[i]);
+            ++kept;
+        }
+        table.resize(kept);
+        table_sources.resize(kept);
+    }
+
+    size_t pageCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return table.size() + pages.size();
+    }
+
+    bool write(const string &path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!file.is_open() && !(committed ? reopenLocked() : openLocked(path)))
+            return false;
+
+        // 字串表每次重建，拿掉的頁面不留路徑
+        string strings;
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            table[i].source_offset = static_cast<uint32_t>(strings.size());
+            strings += table_sources[i];
+        }
+        ClusterFileHeader header{};
+        memcpy(header.magic, "HWCL", 4);
+        header.version = cluster_file_version;
+        header.page_count = static_cast<uint32_t>(table.size());
+        header.page_table_offset = cursor;
+        header.string_table_offset = cursor + table.size() * sizeof(ClusterFilePage);
+        header.file_size = header.string_table_offset + strings.size();
+
+        padToLocked(cursor);
+        file.write(reinterpret_cast<const char *>(table.data()), static_cast<std::streamsize>(table.size() * sizeof(ClusterFilePage)));
+        file.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+        // 資料與頁表先落地，最後才把表頭指過來
+        file.flush();
+        file.seekp(0);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.close();
+        if (!ok || !file.good())
+        {
+            cerr << "Failed to write cluster file: " << path << endl;
+            if (!committed)
+            {
+                std::error_code ec;
+                filesystem::remove(temp_path, ec);
+            }
+            return false;
+        }
+        if (!committed && !commitTemporaryFile(temp_path, path))
+            return false;
+        committed = true;
+        final_path = path;
+        cursor = written = header.file_size;
+        cout << "Wrote " << table.size() << " pages of clusters to: " << path << endl;
+        return true;
+    }
+
+private:
+    struct PageData
+    {
+        string source;
+        int width = 0;
+        int height = 0;
+        vector<ClusterRecord> records;
+        vector<PixelRun> runs;
+    };
+
+    static uint64_t align8(uint64_t v) { return (v + 7) & ~uint64_t(7); }
+
+    // 已提交過：重新打開同一個檔案接在目前頁表之後寫，讀取端在表頭更新前看到的都還是舊的完整內容
+    bool reopenLocked()
+    {
+        file.open(final_path, ios::binary | ios::in | ios::out);
+        if (!file.is_open())
+        {
+            cerr << "Failed to write cluster file: " << final_path << endl;
+            ok = false;
+            return false;
+        }
+        file.seekp(static_cast<std::streamoff>(written));
+        return true;
+    }
+
+    bool openLocked(const string &path)
+    {
+        temp_path = temporaryPathFor(path);
+        file.open(temp_path, ios::binary | ios::trunc);
+        if (!file.is_open())
+        {
+            cerr << "Failed to write cluster file: " << path << endl;
+            ok = false;
+            return false;
+        }
+        // 表頭最後才知道，先佔位
+        const ClusterFileHeader placeholder{};
+        file.write(reinterpret_cast<const char *>(&placeholder), sizeof(placeholder));
+        cursor = written = sizeof(ClusterFileHeader);
+        for (auto &page : pages)
+            appendPageLocked(page);
+        pages.clear();
+        return true;
+    }
+
+    void padToLocked(uint64_t offset)
+    {
+        static const char zeros[8] = {};
+        if (offset > written)
+            file.write(zeros, static_cast<std::streamsize>(offset - written));
+        written = offset;
+    }
+
+    void appendPageLocked(const PageData &page)
+    {
+        ClusterFilePage entry{};
+        entry.offset = align8(cursor);
+        entry.source_length = static_cast<uint32_t>(page.source.size());
+        entry.width = page.width;
+        entry.height = page.height;
+        entry.cluster_count = static_cast<uint32_t>(page.records.size());
+        entry.run_count = static_cast<uint32_t>(page.runs.size());
+
+        padToLocked(entry.offset);
+        file.write(reinterpret_cast<const char *>(page.records.data()),
+                   static_cast<std::streamsize>(page.records.size() * sizeof(ClusterRecord)));
+        file.write(reinterpret_cast<const char *>(page.runs.data()),
+                   static_cast<std::streamsize>(page.runs.size() * sizeof(PixelRun)));
+        cursor = align8(entry.offset + page.records.size() * sizeof(ClusterRecord) + page.runs.size() * sizeof(PixelRun));
+        written = entry.offset + page.records.size() * sizeof(ClusterRecord) + page.runs.size() * sizeof(PixelRun);
+        ok = ok && file.good();
+        table.push_back(entry);
+        table_sources.push_back(page.source);
+    }
+
+    vector<PageData> pages;        // open() 之前收到的頁面
+    vector<ClusterFilePage> table; // 已寫進檔案的頁面
+    vector<string> table_sources;  // table 各頁的來源路徑
+    string temp_path;
+    string final_path;
+    ofstream file;
+    uint64_t cursor = 0;           // 下一頁的起點（8 byte 對齊）
+    uint64_t written = 0;          // 實際寫到的位置
+    bool committed = false;        // write() 成功過，final_path 已是完整的檔案
+    bool ok = true;
+    mutable std::mutex mutex;
+};
+
+// 唯讀記憶體映射
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const string &path)
+    {
+        close();
+#ifdef _WIN32
+        file_handle = CreateFileW(widePath(path).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_handle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+        size = static_cast<size_t>(file_size.QuadPart);
+        mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping_handle)
+        {
+            close();
+            return false;
+        }
+        data = static_cast<const uchar *>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size = static_cast<size_t>(st.st_size);
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        data = mapped == MAP_FAILED ? nullptr : static_cast<const uchar *>(mapped);
+#endif
+        if (!data)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping_handle)
+            CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(file_handle);
+        mapping_handle = nullptr;
+        file_handle = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap(const_cast<uchar *>(data), size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    const uchar *bytes() const { return data; }
+    size_t length() const { return size; }
+
+private:
+    const uchar *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping_handle = nullptr;
+#endif
+};
+
+// 零複製讀取：open() 只檢查表頭與各段範圍，之後所有資料都是直接指向映射記憶體的 span
+class ClusterFileReader
+{
+public:
+    struct PageView
+    {
+        std::string_view source;
+        int width;
+        int height;
+        std::span<const ClusterRecord> clusters;
+        std::span<const PixelRun> runs;
+
+        std::span<const PixelRun> runsOf(size_t c) const
+        {
+            return runs.subspan(clusters[c].first_run, clusters[c].run_count);
+        }
+    };
+
+    bool open(const string &path)
+    {
+        header = nullptr;
+        table = nullptr;
+        if (!file.open(path))
+        {
+            cerr << "Failed to map cluster file: " << path << endl;
+            return false;
+        }
+        const uchar *base = file.bytes();
+        header = reinterpret_cast<const ClusterFileHeader *>(base);
+        bool ok = file.length() >= sizeof(ClusterFileHeader) && memcmp(header->magic, "HWCL", 4) == 0 &&
+                  header->version == cluster_file_version && header->file_size <= file.length();
+        // 表頭 file_size 之後可能是寫入端正在追加的下一輪資料，只看表頭涵蓋的範圍
+        const uint64_t size = ok ? header->file_size : 0;
+        auto fits = [&](uint64_t offset, uint64_t bytes) { return offset <= size && bytes <= size - offset; };
+
+        ok = ok && header->page_table_offset % 8 == 0 &&
+                  fits(header->page_table_offset, uint64_t(header->page_count) * sizeof(ClusterFilePage)) &&
+                  fits(header->string_table_offset, 0);
+        if (ok)
+        {
+            table = reinterpret_cast<const ClusterFilePage *>(base + header->page_table_offset);
+            const uint64_t string_bytes = size - header->string_table_offset;
+            for (uint32_t i = 0; i < header->page_count && ok; ++i)
+            {
+                const ClusterFilePage &p = table[i];
+                ok = p.offset % 8 == 0 &&
+                     fits(p.offset, uint64_t(p.cluster_count) * sizeof(ClusterRecord) + uint64_t(p.run_count) * sizeof(PixelRun)) &&
+                     uint64_t(p.source_offset) + p.source_length <= string_bytes;
+                const auto *records = reinterpret_cast<const ClusterRecord *>(base + p.offset);
+                for (uint32_t c = 0; c < p.cluster_count && ok; ++c)
+                    ok = uint64_t(records[c].first_run) + records[c].run_count <= p.run_count;
+            }
+        }
+        if (!ok)
+        {
+            cerr << "Invalid cluster file: " << path << endl;
+            header = nullptr;
+            table = nullptr;
+            file.close();
+        }
+        return ok;
+    }
+
+    size_t pageCount() const { return header ? header->page_count : 0; }
+
+    PageView page(size_t i) const
+    {
+        const ClusterFilePage &p = table[i];
+        const uchar *base = file.bytes();
+        const auto *records = reinterpret_cast<const ClusterRecord *>(base + p.offset);
+        const auto *runs = reinterpret_cast<const PixelRun *>(base + p.offset + p.cluster_count * sizeof(ClusterRecord));
+        return PageView{
+            std::string_view(reinterpret_cast<const char *>(base + header->string_table_offset + p.source_offset), p.source_length),
+            p.width, p.height,
+            std::span<const ClusterRecord>(records, p.cluster_count),
+            std::span<const PixelRun>(runs, p.run_count)};
+    }
+
+private:
+    MappedFile file;
+    const ClusterFileHeader *header = nullptr;
+    const ClusterFilePage *table = nullptr;
+};
+
+// 除錯用：把 .hwcl 轉成 JSON（run 以 [y, x, length] 表示）
+bool convertClusterFileToJson(const string &cluster_path, const string &json_path)
+{
+    ClusterFileReader reader;
+    if (!reader.open(cluster_path))
+        return false;
+
+    Json::Value root;
+    root["version"] = cluster_file_version;
+    Json::Value pages(Json::arrayValue);
+    for (size_t i = 0; i < reader.pageCount(); ++i)
+    {
+        const ClusterFileReader::PageView view = reader.page(i);
+        Json::Value page;
+        page["source"] = string(view.source);
+        page["width"] = view.width;
+        page["height"] = view.height;
+        Json::Value clusters(Json::arrayValue);
+        for (size_t c = 0; c < view.clusters.size(); ++c)
+        {
+            const ClusterRecord &r = view.clusters[c];
+            Json::Value cluster;
+            Json::Value bbox(Json::arrayValue);
+            bbox.append(r.x);
+            bbox.append(r.y);
+            bbox.append(r.width);
+            bbox.append(r.height);
+            cluster["bbox"] = bbox;
+            Json::Value centroid(Json::arrayValue);
+            centroid.append(r.centroid_x);
+            centroid.append(r.centroid_y);
+            cluster["centroid"] = centroid;
+            cluster["size"] = r.size;
+            cluster["line"] = r.line;
+            Json::Value runs(Json::arrayValue);
+            for (const PixelRun &run : view.runsOf(c))
+            {
+                Json::Value item(Json::arrayValue);
+                item.append(run.y);
+                item.append(run.x);
+                item.append(run.length);
+                runs.append(item);
+            }
+            cluster["runs"] = runs;
+            clusters.append(cluster);
+        }
+        page["clusters"] = clusters;
+        pages.append(page);
+    }
+    root["pages"] = pages;
+
+    ofstream file(json_path);
+    if (!file.is_open())
+    {
+        cerr << "Failed to write cluster JSON: " << json_path << endl;
+        return false;
+    }
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "  ";
+    unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+    writer->write(root, &file);
+    cout << "Converted " << reader.pageCount() << " pages to: " << json_path << endl;
+    return true;
+}
+
+// 批次工作日誌：每完成一頁就 append 一行 JSON（頁面路徑 + 結果快取 key + 讀檔前的大小與修改時間）並 flush。
+// 重跑時日誌裡的頁面只要大小與修改時間都沒變，就直接從結果快取取回，不用再讀檔、解碼、叢集；
+// 當掉時最後一行可能只寫一半，讀取時解析失敗的行直接略過。
+// 第一行記錄處理參數的 hash，參數不同的舊日誌不能沿用，會重新開始
+class BatchJournal
+{
+public:
+    struct Stamp
+    {
+        uint64_t size = 0;
+        int64_t mtime = 0; // file_time_type 的 tick 數，只跟同一台機器上的自己比
+        bool operator==(const Stamp &other) const { return size == other.size && mtime == other.mtime; }
+    };
+
+    static bool stampOf(const string &page, Stamp &stamp)
+    {
+        std::error_code ec;
+        stamp.size = filesystem::file_size(page, ec);
+        if (ec)
+            return false;
+        const auto mtime = filesystem::last_write_time(page, ec);
+        if (ec)
+            return false;
+        stamp.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+        return true;
+    }
+
+    // fresh 為 true 時忽略既有日誌
+    bool open(const string &journal_path, uint64_t parameter_hash, bool fresh)
+    {
+        path = journal_path;
+        completed.clear();
+        const string header = headerFor(parameter_hash);
+
+        bool reuse = false;
+        if (!fresh)
+        {
+            ifstream in(path);
+            string line;
+            if (in.is_open() && getline(in, line) && line == header)
+            {
+                reuse = true;
+                Json::CharReaderBuilder builder;
+                unique_ptr<Json::CharReader> reader(builder.newCharReader());
+                while (getline(in, line))
+                {
+                    Json::Value item;
+                    string errors;
+                    if (!reader->parse(line.data(), line.data() + line.size(), &item, &errors) ||
+                        !item["page"].isString() || !item["key"].isString() ||
+                        !item["size"].isUInt64() || !item["mtime"].isInt64())
+                        continue;
+                    Entry &entry = completed[item["page"].asString()];
+                    entry.key = strtoull(item["key"].asCString(), nullptr, 16);
+                    entry.stamp.size = item["size"].asUInt64();
+                    entry.stamp.mtime = item["mtime"].asInt64();
+                }
+            }
+            else if (in.is_open())
+            {
+                cout << "Batch journal was written with different settings, starting over: " << path << endl;
+            }
+        }
+
+        // 上次當掉時最後一行可能沒寫完，先補上換行，新的紀錄才不會接在半行後面
+        bool needs_newline = false;
+        if (reuse)
+        {
+            ifstream tail(path, ios::binary | ios::ate);
+            if (tail.tellg() > 0)
+            {
+                tail.seekg(-1, ios::end);
+                needs_newline = tail.get() != '\n';
+            }
+        }
+
+        file.open(path, reuse ? ios::app : ios::trunc);
+        if (!file.is_open())
+        {
+            cerr << "Failed to open batch journal: " << path << endl;
+            return false;
+        }
+        if (!reuse)
+            file << header << '\n';
+        else if (needs_newline)
+            file << '\n';
+        file.flush();
+        return true;
+    }
+
+    // current 是這頁現在的大小與修改時間；跟日誌記的不同就表示檔案換過，不能沿用
+    bool find(const string &page, const Stamp &current, uint64_t &key) const
+    {
+        auto it = completed.find(page);
+        if (it == completed.end() || !(it->second.stamp == current))
+            return false;
+        key = it->second.key;
+        return true;
+    }
+
+    size_t completedCount() const { return completed.size(); }
+
+    // stamp 要在讀檔之前取得：讀檔之後才被改掉的頁面，下次大小或時間就對不上
+    void append(const string &page, uint64_t key, const Stamp &stamp)
+    {
+        Json::Value item;
+        item["page"] = page;
+        char hex[32];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+        item["key"] = hex;
+        item["size"] = Json::UInt64(stamp.size);
+        item["mtime"] = Json::Int64(stamp.mtime);
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "";
+        const string line = Json::writeString(builder, item);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        file << line << '\n';
+        file.flush();
+    }
+
+private:
+    static string headerFor(uint64_t parameter_hash)
+    {
+        char hex[32];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(parameter_hash));
+        return string("{\"journal\":2,\"parameters\":\"") + hex + "\"}";
+    }
+
+    struct Entry
+    {
+        uint64_t key = 0;
+        Stamp stamp;
+    };
+
+    string path;
+    std::unordered_map<string, Entry> completed; // 只在 open 時寫入，之後唯讀
+    ofstream file;
+    std::mutex mutex;
+};
+
+// decode -> threshold -> cluster -> export 串流管線
+// 每個 stage 有自己的執行緒數，stage 之間是有界佇列，記憶體上限由佇列深度決定而不是頁數
+// 批次的記憶體預算：解碼前依檔頭探測到的尺寸估計這頁在管線裡要用多少記憶體，
+// 在途頁面的估計總量超過上限時解碼 stage 先等，等前面的頁面匯出歸還。
+// 單頁就超過上限時，等到沒有其他頁面在途才放行，不會卡死
+class MemoryBudget
+{
+public:
+    // 每像素：BGR 3 + 墨跡遮罩 1 + 二值化暫存 9（三個色版與三個遮罩）+ 點座標與叢集約 3
+    static constexpr size_t bytes_per_pixel = 16;
+
+    explicit MemoryBudget(size_t limit_bytes) : limit(limit_bytes) {}
+
+    static size_t estimate(const ImageProbe &probe)
+    {
+        return probe.hasSize() ? static_cast<size_t>(probe.width) * probe.height * bytes_per_pixel : 0;
+    }
+
+    void acquire(size_t bytes)
+    {
+        if (limit == 0 || bytes == 0)
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&]() { return in_use == 0 || in_use + bytes <= limit; });
+        in_use += bytes;
+        peak = std::max(peak, in_use);
+    }
+
+    void release(size_t bytes)
+    {
+        if (limit == 0 || bytes == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_use -= bytes;
+        }
+        released.notify_all();
+    }
+
+    size_t peakBytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peak;
+    }
+
+private:
+    size_t limit;
+    size_t in_use = 0;
+    size_t peak = 0;
+    mutable std::mutex mutex;
+    std::condition_variable released;
+};
+
+class BatchPipeline
+{
+public:
+    using JobPtr = PageJob *;
+    using JobQueue = BoundedQueue<JobPtr>;
+
+    explicit BatchPipeline(const BatchOptions &opts) : options(opts) {}
+
+    // changed：內容變了的頁面（--watch 回報的），不能沿用日誌裡的舊結果；nullptr 時比對上次處理時的大小與修改時間。
+    // 同一個 pipeline 再次 run() 只處理新的與變更的頁面，輸出接在上一輪後面，不再重新探測、載入或重寫其他頁面
+    int run(const vector<string> &all_pages, const std::unordered_set<string> *changed = nullptr)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        const bool first_run = !started;
+        if (first_run)
+            start();
+
+        std::unordered_set<string> modified;
+        if (changed)
+        {
+            modified = *changed;
+        }
+        else
+        {
+            for (const auto &page : all_pages)
+            {
+                auto done = done_pages.find(page);
+                BatchJournal::Stamp stamp;
+                if (done != done_pages.end() && !(BatchJournal::stampOf(page, stamp) && stamp == done->second))
+                    modified.insert(page);
+            }
+        }
+
+        // 重複頁直接沿用代表頁的結果，不進管線
+        vector<int> representative;
+        vector<string> unique_pages;
+        if (options.dedup_distance >= 0)
+        {
+            representative = findDuplicatePages(pageHashes(all_pages, &modified), options.dedup_distance);
+            for (size_t i = 0; i < all_pages.size(); ++i)
+            {
+                if (representative[i] == static_cast<int>(i))
+                    unique_pages.push_back(all_pages[i]);
+            }
+            const double hash_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            cout << "Duplicate scan: " << all_pages.size() << " pages, " << unique_pages.size() << " unique ("
+                 << std::fixed << std::setprecision(2) << hash_seconds << " s)" << endl;
+        }
+        const vector<string> &targets = options.dedup_distance >= 0 ? unique_pages : all_pages;
+
+        // 這一輪只做沒處理過的與內容變了的頁面
+        vector<string> pages;
+        for (const auto &page : targets)
+        {
+            if (!done_pages.count(page) || modified.count(page))
+                pages.push_back(page);
+        }
+        // 要重做的、被刪除的、變成別頁重複的，先從上一輪的輸出拿掉
+        const std::unordered_set<string> target_set(targets.begin(), targets.end());
+        size_t dropped = 0;
+        for (auto it = done_pages.begin(); it != done_pages.end();)
+        {
+            if (target_set.count(it->first) && !modified.count(it->first))
+            {
+                ++it;
+                continue;
+            }
+            exporter.removePage(it->first);
+            cluster_file.removePage(it->first);
+            it = done_pages.erase(it);
+            ++dropped;
+        }
+        if (!first_run && pages.empty() && dropped == 0)
+        {
+            if (options.dedup_distance >= 0)
+                return writeDuplicateIndex(all_pages, representative) ? 0 : 1;
+            return 0;
+        }
+
+        // 只讀檔頭就知道每頁的實際格式與尺寸：副檔名不符的先警告，尺寸給記憶體預算用
+        const vector<ImageProbe> probes = probeImageFiles(pages);
+        double megapixels = 0.0;
+        cv::Size largest;
+        for (size_t i = 0; i < pages.size(); ++i)
+        {
+            if (!extensionMatchesFormat(pages[i], probes[i].format))
+                cerr << "Warning: " << pages[i] << " is " << imageFormatName(probes[i].format)
+                     << " data with a wrong extension" << endl;
+            megapixels += static_cast<double>(probes[i].width) * probes[i].height / 1e6;
+            if (static_cast<double>(probes[i].width) * probes[i].height > largest.area())
+                largest = cv::Size(probes[i].width, probes[i].height);
+        }
+        cout << "Probed " << pages.size() << " pages: " << std::fixed << std::setprecision(1) << megapixels
+             << " megapixels, largest " << largest.width << "x" << largest.height << endl;
+        MemoryBudget budget(options.memory_budget_mb << 20);
+
+        // 同時在途的頁數上限 = 每個 stage 的執行緒 + 每條佇列的深度
+        const size_t slot_cnt = options.decode_threads + options.threshold_threads + options.cluster_threads +
+                                options.export_threads + 3 * options.queue_depth;
+        vector<unique_ptr<PageJob>> slots;
+        JobQueue free_slots(slot_cnt);
+        for (size_t i = 0; i < slot_cnt; ++i)
+        {
+            slots.push_back(make_unique<PageJob>());
+            // 閒置槽位留著的記憶體不算進預算，所以每槽保留的上限按預算平分
+            if (options.memory_budget_mb > 0)
+                slots.back()->arena.setRetainLimit((options.memory_budget_mb << 20) / slot_cnt);
+            free_slots.push(slots.back().get());
+        }
+        JobQueue decoded(options.queue_depth);
+        JobQueue thresholded(options.queue_depth);
+        JobQueue clustered(options.queue_depth);
+        ResultCache &cache = *result_cache;
+        // 每頁做完（包括失敗的）記下讀檔前的大小與修改時間，下一輪沒變就不再處理
+        vector<BatchJournal::Stamp> page_stamps(pages.size());
+        vector<char> page_done(pages.size(), 0);
+        std::atomic<size_t> resumed{0};
+        std::atomic<size_t> next_page{0};
+        std::atomic<size_t> exported{0};
+        std::atomic<size_t> failed{0};
+        vector<std::thread> threads;
+
+        // decode: 來源是頁面清單本身
+        startStage(threads, options.decode_threads, nullptr, &decoded, [&](JobPtr) -> JobPtr
+        {
+            const size_t i = next_page.fetch_add(1);
+            if (i >= pages.size())
+                return nullptr;
+            JobPtr job = nullptr;
+            free_slots.pop(job);
+            job->index = i;
+            job->path = &pages[i];
+            uint64_t journal_key = 0;
+            BatchJournal::Stamp stamp;
+            job->stamped = BatchJournal::stampOf(*job->path, stamp);
+            job->source_size = stamp.size;
+            job->source_mtime = stamp.mtime;
+            if (journaling && job->stamped && !modified.count(*job->path) && journal.find(*job->path, stamp, journal_key))
+            {
+                // 日誌裡完成過的頁面連檔案都不用讀
+                job->cached = cache.find(journal_key);
+                if (job->cached)
+                {
+                    job->cache_key = journal_key;
+                    job->resumed = true;
+                    ++resumed;
+                    return job;
+                }
+            }
+            if (options.use_cache)
+            {
+                // 讀一次檔案：同一份 bytes 先算內容 hash 查快取，沒命中再解碼
+                vector<uchar> bytes;
+                if (readFileBytes(*job->path, bytes))
+                {
+                    job->cache_key = resultCacheKey(hashBytes(bytes.data(), bytes.size()), parameter_hash);
+                    job->cached = cache.find(job->cache_key);
+                    if (job->cached)
+                        return job;
+                    job->budget_bytes = MemoryBudget::estimate(probes[i]);
+                    budget.acquire(job->budget_bytes);
+                    job->bgr = decodePageBgr(bytes, job->decode_buffer);
+                }
+            }
+            else
+            {
+                job->budget_bytes = MemoryBudget::estimate(probes[i]);
+                budget.acquire(job->budget_bytes);
+                vector<uchar> bytes;
+                if (readFileBytes(*job->path, bytes))
+                    job->bgr = decodePageBgr(bytes, job->decode_buffer);
+            }
+            if (job->bgr.empty())
+            {
+                cerr << "Failed to load image for processing: " << *job->path << endl;
+                ++failed;
+            }
+            return job;
+        });
+
+        startStage(threads, options.threshold_threads, &decoded, &thresholded, [&](JobPtr job) -> JobPtr
+        {
+            if (!job->bgr.empty())
+            {
+                job->ink = computeInkMask(job->bgr, options.setting, &job->arena);
+                applyMorphology(job->ink, options.morphology, &job->arena);
+            }
+            job->bgr.release();
+            return job;
+        });
+
+        startStage(threads, options.cluster_threads, &thresholded, &clustered, [&](JobPtr job) -> JobPtr
+        {
+            if (job->cached)
+            {
+                const CachedPageResult &cached = *job->cached;
+                job->points.assign(cached.points.begin(), cached.points.end());
+                job->clusters.offsets.assign(cached.offsets.begin(), cached.offsets.end());
+                job->clusters.indices.assign(cached.indices.begin(), cached.indices.end());
+                job->stats.assign(cached.stats.begin(), cached.stats.end());
+                job->page_size = cached.ink.size();
+                analyzeLayout(job->stats, job->layout, &job->arena);
+                job->processed = true;
+            }
+            else if (!job->ink.empty())
+            {
+                job->page_size = job->ink.size();
+                PageGrid grid(&job->arena);
+                const bool on_grid = options.template_grid && detectPageGrid(job->ink, grid, &job->arena);
+                if (on_grid)
+                {
+                    extractTemplateCells(job->ink, grid, options.radius, job->points, job->clusters, &job->arena);
+                }
+                else
+                {
+                    gatherInkPoints(job->ink, job->points);
+                    clusterInkPoints(job->points, job->ink.size(), options.radius, job->clusters, &job->arena);
+                }
+                computeClusterStats(job->points, job->clusters, job->stats);
+                if (options.merge_strokes && !on_grid)
+                {
+                    ClusterCSR characters(&job->arena);
+                    mergeStrokeClusters(job->stats, job->clusters, characters, &job->arena);
+                    job->clusters = std::move(characters);
+                    computeClusterStats(job->points, job->clusters, job->stats);
+                }
+                analyzeLayout(job->stats, job->layout, &job->arena);
+                job->processed = true;
+
+                if (options.use_cache)
+                {
+                    auto result = std::make_shared<CachedPageResult>();
+                    result->ink = job->ink.clone();
+                    result->points.assign(job->points.begin(), job->points.end());
+                    result->offsets.assign(job->clusters.offsets.begin(), job->clusters.offsets.end());
+                    result->indices.assign(job->clusters.indices.begin(), job->clusters.indices.end());
+                    result->stats.assign(job->stats.begin(), job->stats.end());
+                    cache.store(job->cache_key, std::move(result));
+                }
+            }
+            job->ink.release();
+            return job;
+        });
+
+        startStage(threads, options.export_threads, &clustered, nullptr, [&](JobPtr job) -> JobPtr
+        {
+            if (job->clusters.size() > 0)
+            {
+                exporter.addPage(*job->path, job->points, job->clusters, job->stats, &job->layout, &job->arena);
+                cluster_file.addPage(*job->path, job->page_size, job->points, job->clusters, job->stats, &job->layout);
+                cout << "[" << (exported.fetch_add(1) + 1) << "/" << pages.size() << "] "
+                     << filesystem::path(*job->path).filename().string() << ": "
+                     << job->clusters.size() << " clusters, " << job->layout.lines.size() << " lines"
+                     << (job->resumed ? " (resumed)" : "") << endl;
+            }
+            // 快取已寫好才記進日誌，日誌裡的 key 一定找得到結果
+            if (journaling && job->processed && !job->resumed && job->stamped)
+                journal.append(*job->path, job->cache_key, BatchJournal::Stamp{job->source_size, job->source_mtime});
+            if (job->stamped)
+            {
+                page_stamps[job->index] = BatchJournal::Stamp{job->source_size, job->source_mtime};
+                page_done[job->index] = 1;
+            }
+            budget.release(job->budget_bytes);
+            job->recycle();
+            free_slots.push(job);
+            return nullptr;
+        });
+
+        for (auto &th : threads)
+            th.join();
+        for (size_t i = 0; i < pages.size(); ++i)
+        {
+            if (page_done[i])
+                done_pages[pages[i]] = page_stamps[i];
+        }
+
+        bool ok = exporter.write(atlas_base + ".png", atlas_base + ".json");
+        ok = cluster_file.write(cluster_path) && ok;
+        if (options.dedup_distance >= 0)
+            ok = writeDuplicateIndex(all_pages, representative) && ok;
+
+        size_t arena_bytes = 0;
+        size_t released_bytes = 0;
+        for (const auto &slot : slots)
+        {
+            arena_bytes += slot->arena.capacity();
+            released_bytes += slot->arena.releasedBytes();
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        cout << "Batch finished: " << exported.load() << " pages exported, " << failed.load() << " failed, "
+             << dropped << " earlier pages dropped, "
+             << std::fixed << std::setprecision(2) << seconds << " s ("
+             << (seconds > 0.0 ? exported.load() / seconds : 0.0) << " pages/s), "
+             << slot_cnt << " page slots using " << arena_bytes / (1024.0 * 1024.0) << " MB of arena memory ("
+             << released_bytes / (1024.0 * 1024.0) << " MB released above the high-water mark)" << endl;
+        if (options.memory_budget_mb > 0)
+            cout << "Memory budget: peak " << budget.peakBytes() / (1024.0 * 1024.0) << " MB of "
+                 << options.memory_budget_mb << " MB estimated in flight" << endl;
+        if (options.use_cache)
+            cout << "Result cache: " << cache.hits() << " hits, " << cache.misses() << " misses, "
+                 << resumed.load() << " pages resumed from journal" << endl;
+        return ok && failed.load() == 0 ? 0 : 1;
+    }
+
+private:
+    // 第一次 run()：打開跨輪共用的輸出、快取與日誌
+    void start()
+    {
+        filesystem::create_directories(options.output_dir);
+        Json::Value setting_info;
+        setting_info["id"] = options.setting_id;
+        setting_info["name"] = options.setting.name;
+        setting_info["values"] = binaryThresholdSettingToJson(options.setting);
+        exporter.setMetadata("setting", setting_info);
+        atlas_base = (filesystem::path(options.output_dir) / "batch_atlas").string();
+        exporter.open(atlas_base + ".png", atlas_base + ".json");
+        cluster_path = (filesystem::path(options.output_dir) / "batch_clusters.hwcl").string();
+        cluster_file.open(cluster_path);
+        result_cache = make_unique<ResultCache>(options.use_cache ? (options.cache_dir.empty() ? (filesystem::path(options.output_dir) / "cache").string()
+                                                                                               : options.cache_dir)
+                                                                  : string());
+        parameter_hash = hashProcessingParameters(options.setting, processingExtra(options));
+
+        // 日誌只記 key，結果本身在快取裡，所以沒有快取就沒辦法續跑
+        journaling = options.use_cache &&
+                     journal.open((filesystem::path(options.output_dir) / "batch_journal.jsonl").string(),
+                                  parameter_hash, options.fresh);
+        if (journaling && journal.completedCount() > 0)
+            cout << "Resuming: " << journal.completedCount() << " pages already completed" << endl;
+        started = true;
+    }
+
+    // 同一個 pipeline 重複 run()（--watch）時只替新的或變更的頁面算 hash
+    vector<PageHash> pageHashes(const vector<string> &pages, const std::unordered_set<string> *changed)
+    {
+        vector<string> missing;
+        for (const auto &page : pages)
+        {
+            if (!known_hashes.count(page) || (changed && changed->count(page)))
+                missing.push_back(page);
+        }
+        vector<PageHash> computed = hashImageFiles(missing);
+        for (size_t i = 0; i < missing.size(); ++i)
+            known_hashes[missing[i]] = computed[i];
+        vector<PageHash> hashes;
+        hashes.reserve(pages.size());
+        for (const auto &page : pages)
+            hashes.push_back(known_hashes[page]);
+        return hashes;
+    }
+
+    // 重複頁 -> 代表頁的對照，代表頁的字形就在 batch_atlas 裡
+    bool writeDuplicateIndex(const vector<string> &all_pages, const vector<int> &representative) const
+    {
+        Json::Value root;
+        root["distance"] = options.dedup_distance;
+        Json::Value items(Json::arrayValue);
+        for (size_t i = 0; i < all_pages.size(); ++i)
+        {
+            if (representative[i] == static_cast<int>(i))
+                continue;
+            Json::Value item;
+            item["page"] = all_pages[i];
+            item["same_as"] = all_pages[representative[i]];
+            items.append(item);
+        }
+        root["duplicates"] = items;
+
+        const string path = (filesystem::path(options.output_dir) / "batch_duplicates.json").string();
+        const string temp_path = temporaryPathFor(path);
+        {
+            ofstream file(temp_path);
+            if (!file.is_open())
+            {
+                cerr << "Failed to write duplicate index: " << path << endl;
+                return false;
+            }
+            Json::StreamWriterBuilder builder;
+            builder["indentation"] = "  ";
+            unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
+            writer->write(root, &file);
+        }
+        return commitTemporaryFile(temp_path, path);
+    }
+
+    // 啟動一個 stage；in 為 nullptr 時 fn 自行產生工作直到回傳 nullptr，
+    // 最後一個結束的執行緒負責關閉下游佇列
+    template <typename Fn>
+    void startStage(vector<std::thread> &threads, unsigned count, JobQueue *in, JobQueue *out, Fn fn)
+    {
+        count = std::max(1u, count);
+        auto remaining = make_shared<std::atomic<unsigned>>(count);
+        for (unsigned t = 0; t < count; ++t)
+        {
+            threads.emplace_back([=]() mutable
+            {
+                JobPtr job = nullptr;
+                while (in ? in->pop(job) : true)
+                {
+                    JobPtr result = fn(job);
+                    if (!result)
+                    {
+                        if (!in)
+                            break;
+                        continue;
+                    }
+                    if (out && !out->push(result))
+                        break;
+                }
+                if (remaining->fetch_sub(1) == 1 && out)
+                    out->close();
+            });
+        }
+    }
+
+    BatchOptions options;
+    std::unordered_map<string, PageHash> known_hashes;
+    // 以下跨 run() 保留，第一次 run() 由 start() 建立
+    bool started = false;
+    GlyphAtlasExporter exporter;
+    ClusterFileWriter cluster_file;
+    string atlas_base;
+    string cluster_path;
+    unique_ptr<ResultCache> result_cache;
+    uint64_t parameter_hash = 0;
+    BatchJournal journal;
+    bool journaling = false;
+    std::unordered_map<string, BatchJournal::Stamp> done_pages; // 已在輸出裡（或處理失敗）的頁面與當時的大小、修改時間
+};
+
+// Command line: --batch [dir] [--out dir] [--setting name] [--radius r]
+//               [--decode-threads n] [--threshold-threads n] [--cluster-threads n] [--export-threads n] [--queue-depth n]
+//               [--setting-id n] [--merge-strokes] [--template-grid] [--dedup] [--dedup-distance n] [--cache dir] [--no-cache] [--fresh]
+//               [--open n] [--close n] [--despeckle area] [--watch] [--memory-budget MB]
+//               [--spool dir [--shards n] [--workers n] [--lease-seconds s]]
+void printBatchUsage()
+{
+    cerr << "Usage: --batch [dir] [--out dir] [--setting name] [--setting-id n] [--radius r]\n"
+            "               [--decode-threads n] [--threshold-threads n] [--cluster-threads n] [--export-threads n] [--queue-depth n]\n"
+            "               [--merge-strokes] [--template-grid] [--dedup] [--dedup-distance n] [--cache dir] [--no-cache] [--fresh]\n"
+            "               [--open n] [--close n] [--despeckle area] [--watch] [--memory-budget MB]\n"
+            "               [--spool dir [--shards n] [--workers n] [--lease-seconds s]]" << endl;
+}
+
+// 命令列的數字：整個字串都要是該型別範圍內的數字（"12abc"、"-1" 給無號數、超出範圍都算失敗）
+template <typename T>
+bool parseNumber(const string &text, T &value)
+{
+    const char *end = text.data() + text.size();
+    const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    return !text.empty() && ec == std::errc() && ptr == end;
+}
+// 分片批次（--batch ... --spool dir）：協調者把頁面依檔名 hash 分成 shard 寫進 spool 目錄，
+// worker 行程（--workers n 在本機啟動，或在其他機器上執行 --worker --spool dir）以租約檔認領 shard、
+// 各自跑一條 BatchPipeline；租約的心跳停了就收回給別的 worker，全部完成後合併成一份 manifest。
+// spool 放在共用目錄（NFS / SMB）就能跨機器。spool 目錄內容：
+//   plan.json                   處理參數與每個 shard 的頁面（相對於輸入目錄）
+//   leases/shard-<k>.json       租約：worker、主機、pid、心跳次數；以排他建立檔案來認領
+//   done/shard-<k>.json         完成紀錄：輸出目錄、頁數、失敗數
+//   shards/shard-<k>-<worker>/  該次執行的批次輸出（atlas、hwcl、journal），每次認領各自一個目錄
+//   cache/                      共用結果快取：收回重做的 shard 直接取回已經做完的頁面
+// 租約是否過期由協調者用自己的時鐘判斷（心跳次數多久沒變），各機器的時鐘不必同步
+struct SpoolOptions
+{
+    string dir;
+    size_t shards = 0;         // 0 表示自動（本機 worker 數的 4 倍，至少 16）
+    unsigned local_workers = 0;
+    int lease_seconds = 60;
+};
+
+bool readJsonFile(const string &path, Json::Value &value)
+{
+    ifstream file(path);
+    if (!file.is_open())
+        return false;
+    Json::CharReaderBuilder builder;
+    string errors;
+    return Json::parseFromStream(builder, file, &value, &errors);
+}
+
+// 先寫暫存檔再 rename，讀的一方不會看到寫了一半的檔案
+bool writeJsonFile(const string &path, const Json::Value &value)
+{
+    const string temp_path = temporaryPathFor(path);
+    {
+        ofstream file(temp_path, ios::trunc);
+        if (!file.is_open())
+            return false;
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "  ";
+        file << Json::writeString(builder, value) << "\n";
+        if (!file.good())
+            return false;
+    }
+    return commitTemporaryFile(temp_path, path);
+}
+
+Json::Value batchOptionsToJson(const BatchOptions &options)
+{
+    Json::Value value;
+    value["setting"] = binaryThresholdSettingToJson(options.setting);
+    value["setting_id"] = options.setting_id;
+    value["radius"] = options.radius;
+    value["decode_threads"] = options.decode_threads;
+    value["threshold_threads"] = options.threshold_threads;
+    value["cluster_threads"] = options.cluster_threads;
+    value["export_threads"] = options.export_threads;
+    value["queue_depth"] = Json::UInt64(options.queue_depth);
+    value["merge_strokes"] = options.merge_strokes;
+    value["template_grid"] = options.template_grid;
+    value["open"] = options.morphology.open_size;
+    value["close"] = options.morphology.close_size;
+    value["despeckle"] = options.morphology.min_area;
+    value["memory_budget_mb"] = Json::UInt64(options.memory_budget_mb);
+    return value;
+}
+
+BatchOptions batchOptionsFromJson(const Json::Value &value)
+{
+    BatchOptions options;
+    options.setting = binaryThresholdSettingFromJson(value["setting"]);
+    options.setting_id = value.get("setting_id", 0).asInt();
+    options.radius = value.get("radius", options.radius).asDouble();
+    options.decode_threads = value.get("decode_threads", options.decode_threads).asUInt();
+    options.threshold_threads = value.get("threshold_threads", options.threshold_threads).asUInt();
+    options.cluster_threads = value.get("cluster_threads", options.cluster_threads).asUInt();
+    options.export_threads = value.get("export_threads", options.export_threads).asUInt();
+    options.queue_depth = value.get("queue_depth", Json::UInt64(options.queue_depth)).asUInt64();
+    options.merge_strokes = value.get("merge_strokes", false).asBool();
+    options.template_grid = value.get("template_grid", false).asBool();
+    options.morphology.open_size = value.get("open", 0).asInt();
+    options.morphology.close_size = value.get("close", 0).asInt();
+    options.morphology.min_area = value.get("despeckle", 0).asInt();
+    options.memory_budget_mb = value.get("memory_budget_mb", 0).asUInt64();
+    return options;
+}
+
+class SpoolDirectory
+{
+public:
+    explicit SpoolDirectory(const string &dir) : root(filesystem::absolute(dir)) {}
+
+    string planPath() const { return (root / "plan.json").string(); }
+    string leasePath(size_t shard) const { return (root / "leases" / ("shard-" + to_string(shard) + ".json")).string(); }
+    string donePath(size_t shard) const { return (root / "done" / ("shard-" + to_string(shard) + ".json")).string(); }
+    string cacheDir() const { return (root / "cache").string(); }
+    string outputDir(size_t shard, const string &worker) const
+    {
+        return (root / "shards" / ("shard-" + to_string(shard) + "-" + worker)).string();
+    }
+    const filesystem::path &path() const { return root; }
+
+    bool prepare() const
+    {
+        std::error_code ec;
+        for (const char *sub : {"leases", "done", "shards", "cache"})
+            filesystem::create_directories(root / sub, ec);
+        return !ec;
+    }
+
+    bool isDone(size_t shard) const { return filesystem::exists(donePath(shard)); }
+
+    // 排他建立租約檔（"wx"：已存在就失敗），同一個 shard 只有一個 worker 拿得到
+    bool claim(size_t shard, const Json::Value &lease) const
+    {
+        const string path = leasePath(shard);
+        FILE *file = std::fopen(path.c_str(), "wx");
+        if (!file)
+            return false;
+        Json::StreamWriterBuilder builder;
+        const string text = Json::writeString(builder, lease);
+        std::fwrite(text.data(), 1, text.size(), file);
+        std::fclose(file);
+        return true;
+    }
+
+    // 租約檔還在，而且是這個行程認領的（--id 可能跟別台機器重複，所以連主機與 pid 一起比）
+    bool holds(size_t shard, const Json::Value &lease) const
+    {
+        Json::Value current;
+        return readJsonFile(leasePath(shard), current) && current["worker"] == lease["worker"] &&
+               current["host"] == lease["host"] && current["pid"] == lease["pid"];
+    }
+
+    // 租約還在且還是自己的才續約；被收回就回傳 false
+    bool renew(size_t shard, Json::Value &lease) const
+    {
+        if (!holds(shard, lease))
+            return false;
+        lease["heartbeat"] = lease["heartbeat"].asUInt64() + 1;
+        return writeJsonFile(leasePath(shard), lease);
+    }
+
+    void release(size_t shard) const
+    {
+        std::error_code ec;
+        filesystem::remove(leasePath(shard), ec);
+    }
+
+private:
+    filesystem::path root;
+};
+
+string hostName()
+{
+#ifdef _WIN32
+    const char *name = getenv("COMPUTERNAME");
+    return name ? name : "localhost";
+#else
+    char name[256] = {};
+    if (gethostname(name, sizeof(name) - 1) != 0)
+        return "localhost";
+    return name;
+#endif
+}
+
+#ifdef _WIN32
+// Windows 的子行程只拿到一整行命令列，由 C runtime 自己切回 argv：含空白、tab 或引號的參數要加引號，
+// 引號前的反斜線要加倍、引號本身跳脫，否則路徑裡的空白（C:\Program Files\...）會把後面的參數全部錯開
+string quoteCommandLineArgument(const string &arg)
+{
+    if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == string::npos)
+        return arg;
+    string quoted = "\"";
+    size_t backslashes = 0;
+    for (char c : arg)
+    {
+        if (c == '\\')
+        {
+            ++backslashes;
+            continue;
+        }
+        // 只有接在引號前的反斜線是跳脫字元
+        quoted.append(c == '"' ? backslashes * 2 + 1 : backslashes, '\\');
+        backslashes = 0;
+        quoted.push_back(c);
+    }
+    quoted.append(backslashes * 2, '\\'); // 結尾的反斜線後面接的是收尾的引號
+    quoted.push_back('"');
+    return quoted;
+}
+#endif
+
+// 本機 worker 子行程：啟動、不阻塞地檢查是否已結束
+class LocalProcess
+{
+public:
+    bool start(const vector<string> &args)
+    {
+#ifdef _WIN32
+        string command_line;
+        for (const auto &arg : args)
+            command_line += (command_line.empty() ? "" : " ") + quoteCommandLineArgument(arg);
+        STARTUPINFOA startup = {};
+        startup.cb = sizeof(startup);
+        PROCESS_INFORMATION info = {};
+        if (!CreateProcessA(args[0].c_str(), command_line.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &info))
+            return false;
+        CloseHandle(info.hThread);
+        handle = info.hProcess;
+        return true;
+#else
+        vector<char *> argv;
+        for (const auto &arg : args)
+            argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+        return posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) == 0;
+#endif
+    }
+
+    // 結束時回傳 true 並填入結束碼（被訊號終止時為 -1）
+    bool finished(int &exit_code)
+    {
+#ifdef _WIN32
+        if (!handle)
+            return false;
+        if (WaitForSingleObject(handle, 0) != WAIT_OBJECT_0)
+            return false;
+        DWORD code = 0;
+        GetExitCodeProcess(handle, &code);
+        CloseHandle(handle);
+        handle = nullptr;
+        exit_code = static_cast<int>(code);
+        return true;
+#else
+        if (pid <= 0)
+            return false;
+        int status = 0;
+        if (waitpid(pid, &status, WNOHANG) != pid)
+            return false;
+        pid = 0;
+        exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        return true;
+#endif
+    }
+
+    bool running() const
+    {
+#ifdef _WIN32
+        return handle != nullptr;
+#else
+        return pid > 0;
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE handle = nullptr;
+#else
+    pid_t pid = 0;
+#endif
+};
+
+// 租約期限在分片時寫進計畫；協調者收回租約與 worker 心跳（期限的 1/3）都用這個值，重跑時不會對不上
+int planLeaseSeconds(const Json::Value &plan)
+{
+    return std::max(3, plan.get("lease_seconds", 60).asInt());
+}
+
+// 合併各 shard 的結果：每頁指向所屬 shard 的 hwcl 與頁序，叢集資料本身留在各自的 hwcl 裡（可直接 mmap）
+bool writeSpoolManifest(const SpoolDirectory &spool, const Json::Value &plan, const string &output_dir)
+{
+    Json::Value manifest;
+    manifest["input_dir"] = plan["input_dir"];
+    manifest["options"] = plan["options"];
+    manifest["shards"] = Json::Value(Json::arrayValue);
+    manifest["pages"] = Json::Value(Json::arrayValue);
+    manifest["pages_without_clusters"] = Json::Value(Json::arrayValue);
+    size_t failed_shards = 0;
+    bool ok = true;
+    const filesystem::path input_dir(plan["input_dir"].asString());
+    for (Json::ArrayIndex k = 0; k < plan["shards"].size(); ++k)
+    {
+        Json::Value done;
+        if (!readJsonFile(spool.donePath(k), done))
+        {
+            cerr << "Missing result for shard " << k << endl;
+            ok = false;
+            continue;
+        }
+        if (done["status"].asInt() != 0)
+            ++failed_shards;
+        const string cluster_path = (spool.path() / done["output_dir"].asString() / "batch_clusters.hwcl").string();
+        Json::Value shard = done;
+        shard["clusters_file"] = cluster_path;
+        manifest["shards"].append(shard);
+
+        std::unordered_set<string> found;
+        ClusterFileReader reader;
+        if (filesystem::exists(cluster_path) && reader.open(cluster_path))
+        {
+            for (size_t i = 0; i < reader.pageCount(); ++i)
+            {
+                const ClusterFileReader::PageView page = reader.page(i);
+                Json::Value entry;
+                entry["path"] = string(page.source);
+                entry["shard"] = k;
+                entry["clusters_file"] = cluster_path;
+                entry["page_index"] = Json::UInt64(i);
+                entry["width"] = page.width;
+                entry["height"] = page.height;
+                entry["clusters"] = Json::UInt64(page.clusters.size());
+                manifest["pages"].append(entry);
+                found.insert(filesystem::path(page.source).filename().string());
+            }
+        }
+        for (const auto &name : plan["shards"][k])
+        {
+            // 用檔名比對：其他機器上的 worker 可能從不同的掛載路徑讀輸入
+            if (!found.count(filesystem::path(name.asString()).filename().string()))
+                manifest["pages_without_clusters"].append((input_dir / name.asString()).string());
+        }
+    }
+    manifest["failed_shards"] = Json::UInt64(failed_shards);
+
+    filesystem::create_directories(output_dir);
+    const string manifest_path = (filesystem::path(output_dir) / "batch_manifest.json").string();
+    if (!writeJsonFile(manifest_path, manifest))
+    {
+        cerr << "Failed to write " << manifest_path << endl;
+        return false;
+    }
+    cout << "Manifest: " << manifest["pages"].size() << " pages with clusters from " << manifest["shards"].size()
+         << " shards written to " << manifest_path << endl;
+    return ok && failed_shards == 0;
+}
+
+int runSpoolCoordinator(const BatchOptions &options, const vector<string> &pages, const SpoolOptions &spool_options,
+                        const string &executable)
+{
+    SpoolDirectory spool(spool_options.dir);
+    if (!spool.prepare())
+    {
+        cerr << "Failed to prepare spool directory: " << spool_options.dir << endl;
+        return 1;
+    }
+
+    // 已經有計畫（協調者當掉後重跑）就沿用，完成的 shard 不重做；--fresh 重新分片。
+    // 沿用前先確認是同一批工作：輸入目錄、會影響結果的參數、頁面清單有任何不同就拒絕，
+    // 否則新頁面會被略過，完成的 shard 也是用舊參數做的
+    const filesystem::path input_dir = filesystem::absolute(options.input_dir);
+    Json::Value plan;
+    if (!options.fresh && readJsonFile(spool.planPath(), plan) && plan["shards"].isArray() && plan["shards"].size() > 0)
+    {
+        const BatchOptions planned = batchOptionsFromJson(plan["options"]);
+        std::unordered_set<string> planned_pages;
+        for (const auto &shard : plan["shards"])
+        {
+            for (const auto &name : shard)
+                planned_pages.insert(name.asString());
+        }
+        size_t new_pages = 0;
+        for (const auto &page : pages)
+            new_pages += planned_pages.erase(filesystem::path(page).lexically_relative(input_dir).generic_string()) == 0;
+        string mismatch;
+        if (plan["input_dir"].asString() != input_dir.string())
+            mismatch = "it was planned for " + plan["input_dir"].asString();
+        else if (hashProcessingParameters(planned.setting, processingExtra(planned)) !=
+                 hashProcessingParameters(options.setting, processingExtra(options)))
+            mismatch = "it was planned with different processing parameters";
+        else if (new_pages > 0 || !planned_pages.empty())
+            mismatch = "the input folder has " + to_string(new_pages) + " pages not in the plan and " +
+                       to_string(planned_pages.size()) + " planned pages are gone";
+        if (!mismatch.empty())
+        {
+            cerr << "Cannot resume spool " << spool_options.dir << ": " << mismatch
+                 << ". Run again with --fresh to re-shard." << endl;
+            return 2;
+        }
+        cout << "Resuming spool " << spool_options.dir << " (" << plan["shards"].size() << " shards)" << endl;
+        if (planLeaseSeconds(plan) != spool_options.lease_seconds)
+            cout << "Using the planned lease of " << planLeaseSeconds(plan) << " s; --lease-seconds "
+                 << spool_options.lease_seconds << " applies to new spools" << endl;
+    }
+    else
+    {
+        if (options.fresh)
+        {
+            std::error_code ec;
+            for (const char *sub : {"leases", "done"})
+            {
+                filesystem::remove_all(spool.path() / sub, ec);
+                filesystem::create_directories(spool.path() / sub, ec);
+            }
+        }
+        size_t shard_cnt = spool_options.shards ? spool_options.shards
+                                                : std::max<size_t>(16, size_t(spool_options.local_workers) * 4);
+        shard_cnt = std::max<size_t>(1, std::min(shard_cnt, pages.size()));
+        plan = Json::Value();
+        plan["input_dir"] = input_dir.string();
+        plan["options"] = batchOptionsToJson(options);
+        plan["lease_seconds"] = spool_options.lease_seconds;
+        plan["shards"] = Json::Value(Json::arrayValue);
+        for (size_t k = 0; k < shard_cnt; ++k)
+            plan["shards"].append(Json::Value(Json::arrayValue));
+        // 依檔名 hash 分片：同一頁不論重跑幾次、頁面清單怎麼變，都落在同一個 shard
+        for (const auto &page : pages)
+        {
+            const string name = filesystem::path(page).lexically_relative(input_dir).generic_string();
+            plan["shards"][Json::ArrayIndex(hashBytes(name.data(), name.size()) % shard_cnt)].append(name);
+        }
+        if (!writeJsonFile(spool.planPath(), plan))
+        {
+            cerr << "Failed to write spool plan" << endl;
+            return 1;
+        }
+        cout << "Sharded " << pages.size() << " pages into " << shard_cnt << " shards in " << spool_options.dir << endl;
+    }
+    const size_t shard_cnt = plan["shards"].size();
+
+    vector<LocalProcess> workers(spool_options.local_workers);
+    vector<int> restarts(workers.size(), 0);
+    auto startWorker = [&](size_t w)
+    {
+        const vector<string> args = {executable, "--worker", "--spool", spool_options.dir, "--id",
+                                     hostName() + "-" + to_string(currentProcessId()) + "-" + to_string(w)};
+        if (!workers[w].start(args))
+            cerr << "Failed to start local worker " << w << endl;
+    };
+    for (size_t w = 0; w < workers.size(); ++w)
+        startWorker(w);
+    if (!workers.empty())
+        cout << "Started " << workers.size() << " local workers" << endl;
+
+    // 每個租約最後一次看到的心跳與看到的時間（協調者自己的時鐘）
+    struct LeaseSeen
+    {
+        string content;
+        std::chrono::steady_clock::time_point since;
+    };
+    std::unordered_map<size_t, LeaseSeen> seen;
+    const auto lease_timeout = std::chrono::seconds(planLeaseSeconds(plan));
+    size_t reported = SIZE_MAX;
+    while (true)
+    {
+        size_t done_cnt = 0;
+        const auto now = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < shard_cnt; ++k)
+        {
+            if (spool.isDone(k))
+            {
+                ++done_cnt;
+                seen.erase(k);
+                continue;
+            }
+            vector<uchar> bytes;
+            if (!readFileBytes(spool.leasePath(k), bytes))
+            {
+                seen.erase(k);
+                continue;
+            }
+            const string content(bytes.begin(), bytes.end());
+            auto it = seen.find(k);
+            if (it == seen.end() || it->second.content != content)
+            {
+                seen[k] = LeaseSeen{content, now};
+            }
+            else if (now - it->second.since > lease_timeout)
+            {
+                Json::Value lease;
+                readJsonFile(spool.leasePath(k), lease);
+                cout << "Lease on shard " << k << " held by " << lease.get("worker", "?").asString()
+                     << " expired, reassigning" << endl;
+                spool.release(k);
+                seen.erase(k);
+            }
+        }
+        if (done_cnt != reported)
+        {
+            cout << "Shards done: " << done_cnt << "/" << shard_cnt << endl;
+            reported = done_cnt;
+        }
+        if (done_cnt == shard_cnt)
+            break;
+
+        // 當掉的本機 worker 重新啟動（它的租約會過期後被別人接手）
+        for (size_t w = 0; w < workers.size(); ++w)
+        {
+            int exit_code = 0;
+            if (workers[w].finished(exit_code) && exit_code != 0 && restarts[w] < 3)
+            {
+                cerr << "Local worker " << w << " exited with code " << exit_code << ", restarting" << endl;
+                ++restarts[w];
+                startWorker(w);
+            }
+        }
+        // 本機 worker 全部結束、重啟次數也用完，而且沒有其他 worker 持有還活著的租約：沒有人會再做剩下的 shard
+        const bool locals_gone = !workers.empty() &&
+                                 std::none_of(workers.begin(), workers.end(), [](const LocalProcess &worker) { return worker.running(); });
+        if (locals_gone && seen.empty())
+        {
+            string unfinished;
+            for (size_t k = 0; k < shard_cnt; ++k)
+            {
+                if (!spool.isDone(k))
+                    unfinished += (unfinished.empty() ? "" : ", ") + to_string(k);
+            }
+            cerr << "All local workers have exited and none are left to restart; unfinished shards: " << unfinished
+                 << ". Run the coordinator again to resume, or start workers with --worker --spool " << spool_options.dir << endl;
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    // 全部完成後 worker 會自己結束
+    for (auto &worker : workers)
+    {
+        int exit_code = 0;
+        while (worker.running() && !worker.finished(exit_code))
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return writeSpoolManifest(spool, plan, options.output_dir) ? 0 : 1;
+}
+
+// --worker --spool dir [--id name] [--input dir]：認領 shard 直到全部完成。
+// --input 給輸入目錄在這台機器上掛在不同路徑時用
+int runWorkerCommand(int argc, char **argv)
+{
+    string spool_dir;
+    string worker_id = hostName() + "-" + to_string(currentProcessId());
+    string input_override;
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        auto value = [&]() -> string
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "Missing value for " << arg << endl;
+                exit(2);
+            }
+            return argv[++i];
+        };
+        if (arg == "--spool")
+            spool_dir = value();
+        else if (arg == "--id")
+            worker_id = value();
+        else if (arg == "--input")
+            input_override = value();
+        else
+        {
+            cerr << "Unknown worker option: " << arg << endl;
+            return 2;
+        }
+    }
+    if (spool_dir.empty())
+    {
+        cerr << "Usage: --worker --spool <dir> [--id name] [--input dir]" << endl;
+        return 2;
+    }
+
+    SpoolDirectory spool(spool_dir);
+    Json::Value plan;
+    // 其他機器上的 worker 可能比協調者先啟動
+    while (!readJsonFile(spool.planPath(), plan) || !plan["shards"].isArray())
+    {
+        cout << "Waiting for spool plan in " << spool_dir << endl;
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+    }
+    const size_t shard_cnt = plan["shards"].size();
+    const filesystem::path input_dir = input_override.empty() ? filesystem::path(plan["input_dir"].asString())
+                                                              : filesystem::path(input_override);
+    const int lease_seconds = planLeaseSeconds(plan);
+    BatchOptions options = batchOptionsFromJson(plan["options"]);
+    options.cache_dir = spool.cacheDir();
+
+    // 從不同的 shard 開始找，worker 多時比較不會搶同一個租約
+    const size_t start = static_cast<size_t>(hashBytes(worker_id.data(), worker_id.size()) % std::max<size_t>(1, shard_cnt));
+    size_t completed = 0;
+    while (true)
+    {
+        bool all_done = true;
+        size_t claimed = SIZE_MAX;
+        Json::Value lease;
+        lease["worker"] = worker_id;
+        lease["host"] = hostName();
+        lease["pid"] = Json::Int64(currentProcessId());
+        lease["heartbeat"] = 0;
+        for (size_t j = 0; j < shard_cnt && claimed == SIZE_MAX; ++j)
+        {
+            const size_t k = (start + j) % shard_cnt;
+            if (spool.isDone(k))
+                continue;
+            all_done = false;
+            if (!spool.claim(k, lease))
+                continue;
+            // 認領前一刻可能剛好有人做完
+            if (spool.isDone(k))
+                spool.release(k);
+            else
+                claimed = k;
+        }
+        if (all_done)
+            break;
+        if (claimed == SIZE_MAX)
+        {
+            // 其餘 shard 都有人在做；等它們完成或租約被收回
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+
+        vector<string> pages;
+        for (const auto &name : plan["shards"][Json::ArrayIndex(claimed)])
+            pages.push_back((input_dir / name.asString()).string());
+        options.output_dir = spool.outputDir(claimed, worker_id);
+        cout << "Worker " << worker_id << " processing shard " << claimed << " (" << pages.size() << " pages)" << endl;
+
+        // 心跳：定期改寫租約；發現租約被收回就停止續約，結果不記為完成
+        std::atomic<bool> finished{false};
+        std::atomic<bool> lost{false};
+        std::mutex heartbeat_mutex;
+        std::condition_variable heartbeat_wake;
+        std::thread heartbeat([&]
+        {
+            std::unique_lock<std::mutex> lock(heartbeat_mutex);
+            while (!heartbeat_wake.wait_for(lock, std::chrono::seconds(lease_seconds / 3), [&] { return finished.load(); }))
+            {
+                if (!spool.renew(claimed, lease))
+                {
+                    lost = true;
+                    return;
+                }
+            }
+        });
+
+        const auto t0 = std::chrono::steady_clock::now();
+        BatchPipeline pipeline(options);
+        const int status = pipeline.run(pages);
+        {
+            std::lock_guard<std::mutex> lock(heartbeat_mutex);
+            finished = true;
+        }
+        heartbeat_wake.notify_all();
+        heartbeat.join();
+
+        // 最後一次心跳之後租約也可能過期被收回，寫完成紀錄前再確認一次
+        if (lost || !spool.holds(claimed, lease))
+        {
+            cerr << "Lease on shard " << claimed << " was reassigned, discarding this attempt" << endl;
+            continue;
+        }
+        Json::Value done;
+        done["shard"] = Json::UInt64(claimed);
+        done["worker"] = worker_id;
+        done["host"] = hostName();
+        done["output_dir"] = filesystem::path(options.output_dir).lexically_relative(spool.path()).generic_string();
+        done["pages"] = Json::UInt64(pages.size());
+        done["status"] = status;
+        done["seconds"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (!writeJsonFile(spool.donePath(claimed), done))
+        {
+            cerr << "Failed to record shard " << claimed << " as done" << endl;
+            spool.release(claimed);
+            return 1;
+        }
+        spool.release(claimed);
+        ++completed;
+    }
+    cout << "Worker " << worker_id << " finished: " << completed << " shards" << endl;
+    return 0;
+}
+
+int runBatchCommand(int argc, char **argv)
+{
+    BatchOptions opts;
+    opts.setting.enable_binary = true;
+    string setting_name;
+    int setting_id = 0;
+    bool watch = false;
+    SpoolOptions spool;
+
+    int i = 2;
+    if (i < argc && argv[i][0] != '-')
+        opts.input_dir = argv[i++];
+    for (; i < argc; ++i)
+    {
+        string arg = argv[i];
+        auto value = [&]() -> string
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "Missing value for " << arg << endl;
+                exit(2);
+            }
+            return argv[++i];
+        };
+        auto number = [&](auto &target)
+        {
+            const string text = value();
+            if (!parseNumber(text, target))
+            {
+                cerr << "Invalid value for " << arg << ": " << text << endl;
+                printBatchUsage();
+                exit(2);
+            }
+        };
+        if (arg == "--out")
+            opts.output_dir = value();
+        else if (arg == "--setting")
+            setting_name = value();
+        else if (arg == "--setting-id")
+            number(setting_id);
+        else if (arg == "--radius")
+        {
+            number(opts.radius);
+            if (!std::isfinite(opts.radius) || opts.radius < 0.0)
+            {
+                cerr << "--radius must be a non-negative number" << endl;
+                return 2;
+            }
+        }
+        else if (arg == "--decode-threads")
+            number(opts.decode_threads);
+        else if (arg == "--threshold-threads")
+            number(opts.threshold_threads);
+        else if (arg == "--cluster-threads")
+            number(opts.cluster_threads);
+        else if (arg == "--export-threads")
+            number(opts.export_threads);
+        else if (arg == "--queue-depth")
+            number(opts.queue_depth);
+        else if (arg == "--merge-strokes")
+            opts.merge_strokes = true;
+        else if (arg == "--template-grid")
+            opts.template_grid = true;
+        else if (arg == "--open")
+            number(opts.morphology.open_size);
+        else if (arg == "--close")
+            number(opts.morphology.close_size);
+        else if (arg == "--despeckle")
+            number(opts.morphology.min_area);
+        else if (arg == "--dedup")
+        {
+            if (opts.dedup_distance < 0)
+                opts.dedup_distance = 4;
+        }
+        else if (arg == "--dedup-distance")
+        {
+            number(opts.dedup_distance);
+            if (opts.dedup_distance < 0 || opts.dedup_distance > PerceptualHashIndex::max_exact_distance)
+            {
+                cerr << "--dedup-distance must be between 0 and " << PerceptualHashIndex::max_exact_distance << endl;
+                return 2;
+            }
+        }
+        else if (arg == "--cache")
+            opts.cache_dir = value();
+        else if (arg == "--no-cache")
+            opts.use_cache = false;
+        else if (arg == "--fresh")
+            opts.fresh = true;
+        else if (arg == "--watch")
+            watch = true;
+        else if (arg == "--memory-budget")
+            number(opts.memory_budget_mb);
+        else if (arg == "--spool")
+            spool.dir = value();
+        else if (arg == "--shards")
+            number(spool.shards);
+        else if (arg == "--workers")
+            number(spool.local_workers);
+        else if (arg == "--lease-seconds")
+        {
+            number(spool.lease_seconds);
+            spool.lease_seconds = std::max(3, spool.lease_seconds);
+        }
+        else
+        {
+            cerr << "Unknown batch option: " << arg << endl;
+            return 2;
+        }
+    }
+
+    if (!setting_name.empty() || setting_id != 0)
+    {
+        BinaryThresholdSettingStore store;
+        if (!store.open(getSettingsStorePath(), getDocumentPath()))
+            return 2;
+        auto entry = setting_id != 0 ? store.findById(setting_id) : store.findByName(setting_name);
+        if (!entry)
+        {
+            cerr << "Binary threshold setting not found: "
+                 << (setting_id != 0 ? "id " + to_string(setting_id) : setting_name) << endl;
+            return 2;
+        }
+        opts.setting = entry->setting;
+        opts.setting_id = entry->id;
+    }
+
+    vector<string> pages = listImageFiles(opts.input_dir);
+    cout << "Batch processing " << pages.size() << " images from " << opts.input_dir << endl;
+    if (!spool.dir.empty())
+    {
+        if (watch)
+        {
+            cerr << "--watch cannot be combined with --spool" << endl;
+            return 2;
+        }
+        if (opts.dedup_distance >= 0)
+            cerr << "--dedup is ignored with --spool (each shard only sees its own pages)" << endl;
+        if (pages.empty())
+            return 0;
+        // 本機 worker 執行的是同一個執行檔
+        string executable = argv[0];
+#ifdef _WIN32
+        char module_path[MAX_PATH] = {};
+        if (GetModuleFileNameA(nullptr, module_path, MAX_PATH) > 0)
+            executable = module_path;
+#elif defined(__linux__)
+        std::error_code ec;
+        const filesystem::path self = filesystem::read_symlink("/proc/self/exe", ec);
+        if (!ec)
+            executable = self.string();
+#endif
+        return runSpoolCoordinator(opts, pages, spool, executable);
+    }
+    BatchPipeline pipeline(opts);
+    int status = pipeline.run(pages);
+    if (!watch)
+        return status;
+
+    // --watch：之後只處理監看到的新頁面與變更頁面，結果接在既有輸出後面，不再重新列目錄；
+    // 監看漏了事件（inotify 佇列溢位）時才重列一次，靠大小與修改時間找出變過的頁面
+    DirectoryWatcher watcher;
+    if (!watcher.start(opts.input_dir))
+        return 1;
+    cout << "Watching " << opts.input_dir << (watcher.native() ? " (inotify)" : " (polling)")
+         << " for new pages, press Ctrl+C to stop" << endl;
+    while (true)
+    {
+        vector<FileChange> changes = watcher.wait(std::chrono::hours(1));
+        if (std::any_of(changes.begin(), changes.end(), [](const FileChange &change) { return change.rescan; }))
+        {
+            pages = listImageFiles(opts.input_dir);
+            cout << "Missed file events, rescanning " << pages.size() << " images in " << opts.input_dir << endl;
+            status = pipeline.run(pages);
+            continue;
+        }
+        std::unordered_set<string> changed;
+        size_t removed = 0;
+        for (const auto &change : changes)
+        {
+            if (!isImageFile(change.path))
+                continue;
+            const string path = filesystem::absolute(change.path).string();
+            auto it = std::lower_bound(pages.begin(), pages.end(), path);
+            const bool listed = it != pages.end() && *it == path;
+            if (change.removed)
+            {
+                if (listed)
+                {
+                    pages.erase(it);
+                    ++removed;
+                }
+                continue;
+            }
+            if (!listed)
+                pages.insert(it, path);
+            changed.insert(path);
+        }
+        if (changed.empty() && removed == 0)
+            continue;
+        cout << "Detected " << changed.size() << " new or changed pages, " << removed << " removed" << endl;
+        status = pipeline.run(pages, &changed);
+    }
+    return status;
+}
+
+// 常駐處理服務（--serve）：在 Unix domain socket 上接工作，省掉每次批次啟動、載入設定與冷快取的成本。
+// 協定是一行一個 JSON，一條連線可以連續送多個工作，結果每頁做完就先送回，不等整個工作結束：
+//   {"id": "a1", "pages": ["/scans/p1.webp", ...], "setting": "名稱"（或 "setting_id": 3）, "radius": 5,
+//    "merge_strokes": false, "open": 0, "close": 0, "despeckle": 0}
+//     -> {"job": "a1", "accepted": 頁數, "queue_depth": n}
+//     -> 每頁 {"job", "index", "page", "status": "ok", "cached", "width", "height",
+//              "clusters": [[x, y, w, h, cx, cy, size], ...], "latency_ms"}，失敗時 "status": "failed" 與 "error"
+//     -> {"job": "a1", "done": true, "pages", "failed", "elapsed_ms"}
+//   {"command": "stats"}    -> 佇列深度、吞吐量、延遲等計數
+//   {"command": "shutdown"} -> 不再收新工作，佇列裡的頁面做完後結束
+struct ServiceOptions
+{
+    string socket_path = "/tmp/handwriting.sock";
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency() / 4); // 同時處理的頁數，每頁內部再用共用執行緒池
+    bool use_cache = true;
+    string cache_dir = "../result_cache";
+    size_t decode_cache_mb = 512;
+};
+
+// 解碼後頁面的 LRU，key 是檔案內容 hash：同一頁換設定重跑時不用再解碼
+class DecodeCache
+{
+public:
+    explicit DecodeCache(size_t budget_bytes) : budget(budget_bytes) {}
+
+    std::shared_ptr<const cv::Mat> find(uint64_t key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = lookup.find(key);
+        if (it == lookup.end())
+        {
+            ++miss_count;
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second);
+        ++hit_count;
+        return it->second->second;
+    }
+
+    void store(uint64_t key, std::shared_ptr<const cv::Mat> page)
+    {
+        const size_t page_bytes = page->total() * page->elemSize();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (page_bytes > budget || lookup.count(key))
+            return;
+        used += page_bytes;
+        lru.emplace_front(key, std::move(page));
+        lookup[key] = lru.begin();
+        while (used > budget)
+        {
+            used -= lru.back().second->total() * lru.back().second->elemSize();
+            lookup.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    Json::Value counters() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Json::Value value;
+        value["hits"] = Json::UInt64(hit_count);
+        value["misses"] = Json::UInt64(miss_count);
+        value["entries"] = Json::UInt64(lru.size());
+        value["bytes"] = Json::UInt64(used);
+        return value;
+    }
+
+private:
+    using Entry = std::pair<uint64_t, std::shared_ptr<const cv::Mat>>;
+    mutable std::mutex mutex;
+    std::list<Entry> lru;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> lookup;
+    size_t budget;
+    size_t used = 0;
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+};
 
-    // Apply binary threshold if enabled
-    if (enable_binary)
+// 最近 1024 筆延遲（ms）的平均、p50、p95、最大值，另外累計全部筆數
+class LatencyWindow
+{
+public:
+    void add(double ms)
     {
-        cv::Mat binary_mask;
+        std::lock_guard<std::mutex> lock(mutex);
+        samples[count % samples.size()] = ms;
+        ++count;
+    }
 
-        if (color_space == 0 && rgb_threshold)
-        { // RGB
-            cv::Mat bgr_channels[3];
-            cv::split(image, bgr_channels);
+    Json::Value summary() const
+    {
+        vector<double> recent;
+        size_t total = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            total = count;
+            recent.assign(samples.begin(), samples.begin() + std::min(count, samples.size()));
+        }
+        Json::Value value;
+        value["count"] = Json::UInt64(total);
+        if (recent.empty())
+            return value;
+        auto percentile = [&](double p)
+        {
+            auto nth = recent.begin() + static_cast<ptrdiff_t>(p * (recent.size() - 1) + 0.5);
+            std::nth_element(recent.begin(), nth, recent.end());
+            return *nth;
+        };
+        value["mean"] = std::accumulate(recent.begin(), recent.end(), 0.0) / recent.size();
+        value["p50"] = percentile(0.50);
+        value["p95"] = percentile(0.95);
+        value["max"] = *std::max_element(recent.begin(), recent.end());
+        return value;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::array<double, 1024> samples{};
+    size_t count = 0;
+};
 
-            cv::Mat b_mask, g_mask, r_mask;
-            cv::threshold(bgr_channels[0], b_mask, rgb_threshold[2], 255, cv::THRESH_BINARY); // B channel
-            cv::threshold(bgr_channels[1], g_mask, rgb_threshold[1], 255, cv::THRESH_BINARY); // G channel
-            cv::threshold(bgr_channels[2], r_mask, rgb_threshold[0], 255, cv::THRESH_BINARY); // R channel
+// 最近一分鐘的完成數：每秒一個桶，桶的秒數過期就歸零
+class RateWindow
+{
+public:
+    void add(std::chrono::steady_clock::time_point now)
+    {
+        const int64_t second = secondsOf(now);
+        std::lock_guard<std::mutex> lock(mutex);
+        Bucket &bucket = buckets[static_cast<size_t>(second) % buckets.size()];
+        if (bucket.second != second)
+            bucket = Bucket{second, 0};
+        ++bucket.count;
+    }
 
-            cv::bitwise_and(b_mask, g_mask, binary_mask);
-            cv::bitwise_and(binary_mask, r_mask, binary_mask);
+    double perSecond(std::chrono::steady_clock::time_point now) const
+    {
+        const int64_t second = secondsOf(now);
+        size_t total = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const Bucket &bucket : buckets)
+        {
+            if (bucket.second > second - static_cast<int64_t>(buckets.size()))
+                total += bucket.count;
         }
-        else if (color_space == 1 && hsl_threshold)
-        { // HSL
-            cv::Mat hls_image;
-            cv::cvtColor(image, hls_image, cv::COLOR_BGR2HLS);
+        return static_cast<double>(total) / buckets.size();
+    }
 
-            cv::Mat hls_channels[3];
-            cv::split(hls_image, hls_channels);
+private:
+    struct Bucket
+    {
+        int64_t second = -1;
+        size_t count = 0;
+    };
 
-            cv::Mat h_mask, l_mask, s_mask;
-            // H channel (0-180 in OpenCV)
-            cv::threshold(hls_channels[0], h_mask, hsl_threshold[0], 255, cv::THRESH_BINARY);
-            // L channel (0-255)
-            cv::threshold(hls_channels[1], l_mask, hsl_threshold[2] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
-            // S channel (0-255)
-            cv::threshold(hls_channels[2], s_mask, hsl_threshold[1] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
+    static int64_t secondsOf(std::chrono::steady_clock::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+    }
+
+    mutable std::mutex mutex;
+    std::array<Bucket, 60> buckets{};
+};
+
+// 單頁的 threshold + cluster，結果做成跟批次快取相同的 CachedPageResult
+std::shared_ptr<CachedPageResult> processPageForService(const cv::Mat &bgr, const BatchOptions &options, PageArena &arena)
+{
+    arena.reset();
+    cv::Mat ink = computeInkMask(bgr, options.setting, &arena);
+    applyMorphology(ink, options.morphology, &arena);
+    std::pmr::vector<cv::Point> points(&arena);
+    ClusterCSR clusters(&arena);
+    std::pmr::vector<ClusterStats> stats(&arena);
+    gatherInkPoints(ink, points);
+    clusterInkPoints(points, ink.size(), options.radius, clusters, &arena);
+    computeClusterStats(points, clusters, stats);
+    if (options.merge_strokes)
+    {
+        ClusterCSR characters(&arena);
+        mergeStrokeClusters(stats, clusters, characters, &arena);
+        clusters = std::move(characters);
+        computeClusterStats(points, clusters, stats);
+    }
+
+    auto result = std::make_shared<CachedPageResult>();
+    result->ink = ink.clone();
+    result->points.assign(points.begin(), points.end());
+    result->offsets.assign(clusters.offsets.begin(), clusters.offsets.end());
+    result->indices.assign(clusters.indices.begin(), clusters.indices.end());
+    result->stats.assign(stats.begin(), stats.end());
+    return result;
+}
+
+#ifndef _WIN32
+static volatile std::sig_atomic_t service_interrupted = 0;
+
+static void onServiceSignal(int)
+{
+    service_interrupted = 1;
+}
+
+class ProcessingService
+{
+public:
+    explicit ProcessingService(const ServiceOptions &options)
+        : options(options), decode_cache(options.decode_cache_mb << 20), started(std::chrono::steady_clock::now())
+    {
+        if (options.use_cache)
+            result_cache = make_unique<ResultCache>(options.cache_dir);
+        if (!settings_store.open(getSettingsStorePath(), getDocumentPath()))
+            cerr << "Settings store unavailable, only the default setting can be used" << endl;
+    }
+
+    int run()
+    {
+        std::signal(SIGPIPE, SIG_IGN);
+        std::signal(SIGINT, onServiceSignal);
+        std::signal(SIGTERM, onServiceSignal);
 
-            cv::bitwise_and(h_mask, l_mask, binary_mask);
-            cv::bitwise_and(binary_mask, s_mask, binary_mask);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (options.socket_path.size() >= sizeof(address.sun_path))
+        {
+            cerr << "Socket path is too long: " << options.socket_path << endl;
+            return 2;
         }
-        else if (color_space == 2 && hsv_threshold)
-        { // HSV
-            cv::Mat hsv_image;
-            cv::cvtColor(image, hsv_image, cv::COLOR_BGR2HSV);
+        memcpy(address.sun_path, options.socket_path.c_str(), options.socket_path.size() + 1);
+        // 上次沒清掉的 socket 檔會讓 bind 失敗；只刪 socket，不刪一般檔案
+        struct stat st;
+        if (lstat(options.socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(options.socket_path.c_str());
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listen_fd, 16) != 0)
+        {
+            cerr << "Failed to listen on " << options.socket_path << ": " << strerror(errno) << endl;
+            if (listen_fd >= 0)
+                ::close(listen_fd);
+            return 1;
+        }
+        cout << "Serving on " << options.socket_path << " with " << options.workers << " workers"
+             << (result_cache ? ", result cache in " + options.cache_dir : string()) << endl;
 
-            cv::Mat hsv_channels[3];
-            cv::split(hsv_image, hsv_channels);
+        vector<std::thread> workers;
+        for (unsigned w = 0; w < options.workers; ++w)
+            workers.emplace_back([this] { workerLoop(); });
 
-            cv::Mat h_mask, s_mask, v_mask;
-            // H channel (0-180 in OpenCV)
-            cv::threshold(hsv_channels[0], h_mask, hsv_threshold[0], 255, cv::THRESH_BINARY);
-            // S channel (0-255)
-            cv::threshold(hsv_channels[1], s_mask, hsv_threshold[1] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
-            // V channel (0-255)
-            cv::threshold(hsv_channels[2], v_mask, hsv_threshold[2] * 255.0f / 100.0f, 255, cv::THRESH_BINARY);
+        while (!stopping.load() && !service_interrupted)
+        {
+            pollfd pfd{listen_fd, POLLIN, 0};
+            if (poll(&pfd, 1, 250) <= 0)
+                continue;
+            const int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            // 客戶端不讀結果時，writer 最多卡這麼久就斷線，不會拖住關機
+            const timeval send_timeout{30, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+            auto connection = std::make_shared<Connection>(fd);
+            // 讀取端與工作拿的是 handle：最後一個 handle 放掉（讀到 EOF 且工作都做完）時 close()，
+            // writer 把剩下的結果送完才結束；Connection 本身由 writer 執行緒持有
+            std::shared_ptr<Connection> handle(connection.get(), [connection](Connection *c) { c->close(); });
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            // 順便收掉已經結束的連線
+            std::erase_if(connections, [](const std::weak_ptr<Connection> &weak) { return weak.expired(); });
+            std::erase_if(connection_threads, [](ConnectionThread &thread)
+            {
+                if (!thread.done->load())
+                    return false;
+                thread.thread.join();
+                return true;
+            });
+            connections.push_back(connection);
+            auto writer_done = std::make_shared<std::atomic<bool>>(false);
+            connection_threads.push_back(ConnectionThread{std::thread([connection, writer_done]
+            {
+                connection->writeLoop();
+                *writer_done = true;
+            }), writer_done});
+            auto reader_done = std::make_shared<std::atomic<bool>>(false);
+            connection_threads.push_back(ConnectionThread{std::thread([this, handle, reader_done]
+            {
+                readLoop(handle);
+                *reader_done = true;
+            }), reader_done});
+        }
 
-            cv::bitwise_and(h_mask, s_mask, binary_mask);
-            cv::bitwise_and(binary_mask, v_mask, binary_mask);
-        } // Apply binary threshold to create pure binary image (0 or 1 values)
-        if (!binary_mask.empty())
+        // 先做完佇列裡的頁面（結果還送得出去），再關連線
         {
-            // Convert binary mask to pure binary values (0 or 1)
-            cv::Mat pure_binary;
-            binary_mask.convertTo(pure_binary, CV_8UC1, 1.0 / 255.0); // Convert 255 to 1, 0 stays 0
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_ready.notify_all();
+        for (auto &th : workers)
+            th.join();
+        ::close(listen_fd);
+        unlink(options.socket_path.c_str());
+        // 只關讀取端：reader 讀到 EOF 結束，writer 送完排隊中的結果才結束
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            for (auto &weak : connections)
+            {
+                if (auto connection = weak.lock())
+                    shutdown(connection->fd, SHUT_RD);
+            }
+        }
+        for (auto &thread : connection_threads)
+            thread.thread.join();
 
-            // Convert to 3-channel for consistency with the rest of the pipeline
-            cv::Mat binary_3channel;
-            cv::cvtColor(pure_binary, binary_3channel, cv::COLOR_GRAY2BGR);
+        Json::StreamWriterBuilder builder;
+        builder["indentation"] = "  ";
+        cout << "Service stopped: " << Json::writeString(builder, counters()) << endl;
+        return 0;
+    }
 
-            // Scale back to 0-255 range for display purposes
-            binary_3channel.convertTo(image, CV_8UC3, 255.0); // Convert 1 to 255, 0 stays 0
+private:
+    // 每條連線一個送出佇列與 writer 執行緒：worker 與讀取端只把整行 JSON 排進佇列，
+    // 不會因為客戶端讀得慢而卡在 write()
+    struct Connection
+    {
+        explicit Connection(int fd) : fd(fd) {}
+        ~Connection() { ::close(fd); }
+
+        // 客戶端一直不讀、積壓超過上限就斷線，不讓記憶體無限制成長
+        static constexpr size_t max_queued_bytes = size_t(64) << 20;
+
+        void send(const Json::Value &message)
+        {
+            Json::StreamWriterBuilder builder;
+            builder["indentation"] = "";
+            string line = Json::writeString(builder, message) + "\n";
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!open || closing)
+                return;
+            if (queued_bytes + line.size() > max_queued_bytes)
+            {
+                drop();
+                return;
+            }
+            queued_bytes += line.size();
+            outbox.push_back(std::move(line));
+            ready.notify_one();
+        }
+
+        // 不會再有新訊息：writer 送完佇列裡的就結束
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+            ready.notify_one();
+        }
+
+        void writeLoop()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                ready.wait(lock, [&] { return closing || !outbox.empty(); });
+                if (outbox.empty())
+                    return;
+                const string line = std::move(outbox.front());
+                outbox.pop_front();
+                lock.unlock();
+                size_t written = 0;
+                bool failed = false;
+                while (written < line.size())
+                {
+                    const ssize_t n = write(fd, line.data() + written, line.size() - written);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                    {
+                        failed = true;
+                        break;
+                    }
+                    written += static_cast<size_t>(n);
+                }
+                lock.lock();
+                queued_bytes -= line.size();
+                if (failed)
+                    drop();
+            }
+        }
+
+        const int fd;
+        std::atomic<bool> open{true};
+
+    private:
+        // 呼叫時持有 mutex；shutdown 也會叫醒卡在 read 的讀取端
+        void drop()
+        {
+            if (open.exchange(false))
+                shutdown(fd, SHUT_RDWR);
+            for (const string &line : outbox)
+                queued_bytes -= line.size();
+            outbox.clear();
+        }
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<string> outbox;
+        size_t queued_bytes = 0;
+        bool closing = false;
+    };
+
+    struct ServiceJob
+    {
+        string id;
+        vector<string> pages;
+        BatchOptions options;
+        uint64_t parameter_hash = 0;
+        std::shared_ptr<Connection> connection;
+        std::chrono::steady_clock::time_point received;
+        std::atomic<size_t> remaining{0};
+        std::atomic<size_t> failed{0};
+    };
+
+    struct ConnectionThread
+    {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+
+    struct PageTask
+    {
+        std::shared_ptr<ServiceJob> job;
+        size_t index = 0;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void readLoop(std::shared_ptr<Connection> connection)
+    {
+        ++connection_count;
+        string pending;
+        char buffer[65536];
+        while (true)
+        {
+            const ssize_t n = read(connection->fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            pending.append(buffer, static_cast<size_t>(n));
+            size_t start = 0;
+            for (size_t end; (end = pending.find('\n', start)) != string::npos; start = end + 1)
+            {
+                if (end > start)
+                    handleMessage(connection, pending.substr(start, end - start));
+            }
+            pending.erase(0, start);
+        }
+        // 讀到 EOF 只代表客戶端送完了（例如 shutdown(SHUT_WR)），結果照送；寫入失敗才算斷線
+        --connection_count;
+    }
+
+    void handleMessage(const std::shared_ptr<Connection> &connection, const string &line)
+    {
+        Json::Value request;
+        Json::CharReaderBuilder builder;
+        string errors;
+        std::istringstream in(line);
+        Json::Value reply;
+        if (!Json::parseFromStream(builder, in, &request, &errors) || !request.isObject())
+        {
+            reply["error"] = "Invalid request: " + (errors.empty() ? string("expected a JSON object") : errors);
+            connection->send(reply);
+            return;
+        }
+
+        string error;
+        if (!validRequest(request, error))
+        {
+            reply["error"] = "Invalid request: " + error;
+            connection->send(reply);
+            return;
+        }
+        const string command = request.get("command", "").asString();
+        if (command == "stats")
+        {
+            connection->send(counters());
+        }
+        else if (command == "shutdown")
+        {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                stopping = true;
+            }
+            queue_ready.notify_all();
+            reply["shutdown"] = true;
+            connection->send(reply);
+        }
+        else if (command.empty() && request["pages"].isArray())
+        {
+            submit(connection, request);
+        }
+        else
+        {
+            reply["error"] = "Unknown request, expected \"pages\" or \"command\"";
+            connection->send(reply);
+        }
+    }
+
+    // 先檢查型別與範圍，後面的 asString / asInt / asDouble 才不會在型別不符時丟例外
+    static bool validRequest(const Json::Value &request, string &error)
+    {
+        auto fail = [&](const string &message)
+        {
+            error = message;
+            return false;
+        };
+        if (request.isMember("command") && !request["command"].isString())
+            return fail("\"command\" must be a string");
+        if (request.isMember("id") && !request["id"].isString() && !request["id"].isIntegral())
+            return fail("\"id\" must be a string or an integer");
+        if (request.isMember("pages"))
+        {
+            if (!request["pages"].isArray())
+                return fail("\"pages\" must be an array of paths");
+            for (const auto &page : request["pages"])
+            {
+                if (!page.isString())
+                    return fail("\"pages\" must be an array of paths");
+            }
+        }
+        if (request.isMember("setting") && !request["setting"].isString())
+            return fail("\"setting\" must be a string");
+        if (request.isMember("setting_id") && !request["setting_id"].isInt())
+            return fail("\"setting_id\" must be an integer");
+        if (request.isMember("radius") &&
+            (!request["radius"].isNumeric() || !std::isfinite(request["radius"].asDouble()) || request["radius"].asDouble() < 0.0))
+            return fail("\"radius\" must be a non-negative number");
+        if (request.isMember("merge_strokes") && !request["merge_strokes"].isBool())
+            return fail("\"merge_strokes\" must be true or false");
+        for (const char *key : {"open", "close", "despeckle"})
+        {
+            if (request.isMember(key) && (!request[key].isInt() || request[key].asInt() < 0))
+                return fail("\"" + string(key) + "\" must be a non-negative integer");
+        }
+        return true;
+    }
+
+    void submit(const std::shared_ptr<Connection> &connection, const Json::Value &request)
+    {
+        auto job = std::make_shared<ServiceJob>();
+        job->id = request.get("id", to_string(next_job_id.fetch_add(1))).asString();
+        job->connection = connection;
+        job->received = std::chrono::steady_clock::now();
+        for (const auto &page : request["pages"])
+            job->pages.push_back(page.asString());
+
+        Json::Value reply;
+        reply["job"] = job->id;
+        BatchOptions &opts = job->options;
+        opts.setting.enable_binary = true;
+        const int setting_id = request.get("setting_id", 0).asInt();
+        const string setting_name = request.get("setting", "").asString();
+        if (setting_id != 0 || !setting_name.empty())
+        {
+            // 其他行程（GUI、批次）可能剛存了新設定
+            settings_store.refresh();
+            auto entry = setting_id != 0 ? settings_store.findById(setting_id) : settings_store.findByName(setting_name);
+            if (!entry)
+            {
+                reply["error"] = "Binary threshold setting not found: " +
+                                 (setting_id != 0 ? "id " + to_string(setting_id) : setting_name);
+                connection->send(reply);
+                return;
+            }
+            opts.setting = entry->setting;
+            opts.setting_id = entry->id;
+        }
+        opts.radius = request.get("radius", opts.radius).asDouble();
+        opts.merge_strokes = request.get("merge_strokes", false).asBool();
+        opts.morphology.open_size = request.get("open", 0).asInt();
+        opts.morphology.close_size = request.get("close", 0).asInt();
+        opts.morphology.min_area = request.get("despeckle", 0).asInt();
+        job->parameter_hash = hashProcessingParameters(opts.setting, processingExtra(opts));
+        job->remaining = job->pages.size();
+
+        bool accepting = false;
+        size_t queue_depth = 0;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            accepting = !stopping;
+            queue_depth = queue.size() + job->pages.size();
+        }
+        if (!accepting)
+        {
+            reply["error"] = "Service is shutting down";
+            connection->send(reply);
+            return;
+        }
+        ++jobs_received;
+        reply["accepted"] = Json::UInt64(job->pages.size());
+        reply["queue_depth"] = Json::UInt64(queue_depth);
+        // 回覆要在頁面進佇列之前排進連線的送出佇列，才能保證它排在這個工作的任何一頁結果之前
+        connection->send(reply);
+        bool queued = false;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            // 兩次上鎖之間收到 shutdown 時 worker 可能已經結束，頁面不能再進佇列
+            if (!stopping)
+            {
+                for (size_t i = 0; i < job->pages.size(); ++i)
+                    queue.push_back(PageTask{job, i, job->received});
+                queued = true;
+            }
+        }
+        if (!queued)
+        {
+            pages_cancelled += job->pages.size();
+            job->failed = job->pages.size();
+            finishJob(*job);
+            return;
+        }
+        queue_ready.notify_all();
+        if (job->pages.empty())
+            finishJob(*job);
+    }
+
+    void workerLoop()
+    {
+        PageArena arena;
+        while (true)
+        {
+            PageTask task;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                task = std::move(queue.front());
+                queue.pop_front();
+                ++in_flight;
+            }
+            processTask(task, arena);
+            --in_flight;
+        }
+    }
+
+    void processTask(const PageTask &task, PageArena &arena)
+    {
+        ServiceJob &job = *task.job;
+        const string &path = job.pages[task.index];
+        Json::Value message;
+        message["job"] = job.id;
+        message["index"] = Json::UInt64(task.index);
+        message["page"] = path;
+
+        // 客戶端已經斷線，剩下的頁面不必做
+        if (!job.connection->open)
+        {
+            ++pages_cancelled;
+            ++job.failed;
+            finishPage(job);
+            return;
+        }
+
+        std::shared_ptr<const CachedPageResult> result;
+        bool cached = false;
+        string error;
+        vector<uchar> bytes;
+        if (!readFileBytes(path, bytes))
+        {
+            error = "Cannot read file";
+        }
+        else
+        {
+            const uint64_t content_hash = hashBytes(bytes.data(), bytes.size());
+            const uint64_t key = resultCacheKey(content_hash, job.parameter_hash);
+            if (result_cache)
+                result = result_cache->find(key);
+            cached = result != nullptr;
+            if (!result)
+            {
+                std::shared_ptr<const cv::Mat> bgr = decode_cache.find(content_hash);
+                if (!bgr)
+                {
+                    cv::Mat buffer;
+                    cv::Mat page = decodePageBgr(bytes, buffer);
+                    if (!page.empty())
+                    {
+                        bgr = std::make_shared<const cv::Mat>(page);
+                        decode_cache.store(content_hash, bgr);
+                    }
+                }
+                if (!bgr)
+                {
+                    error = "Cannot decode image";
+                }
+                else
+                {
+                    auto computed = processPageForService(*bgr, job.options, arena);
+                    if (result_cache)
+                        result_cache->store(key, computed);
+                    result = std::move(computed);
+                }
+            }
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        const double latency_ms = std::chrono::duration<double, std::milli>(now - task.queued).count();
+        if (result)
+        {
+            message["status"] = "ok";
+            message["cached"] = cached;
+            message["width"] = result->ink.cols;
+            message["height"] = result->ink.rows;
+            Json::Value clusters(Json::arrayValue);
+            for (const ClusterStats &s : result->stats)
+            {
+                Json::Value cluster(Json::arrayValue);
+                cluster.append(s.bbox.x);
+                cluster.append(s.bbox.y);
+                cluster.append(s.bbox.width);
+                cluster.append(s.bbox.height);
+                cluster.append(s.centroid.x);
+                cluster.append(s.centroid.y);
+                cluster.append(s.size);
+                clusters.append(cluster);
+            }
+            message["clusters"] = clusters;
+            ++pages_completed;
+            if (cached)
+                ++pages_cached;
+            page_rate.add(now);
+        }
+        else
+        {
+            message["status"] = "failed";
+            message["error"] = error;
+            ++pages_failed;
+            ++job.failed;
+        }
+        message["latency_ms"] = latency_ms;
+        page_latency.add(latency_ms);
+        job.connection->send(message);
+        finishPage(job);
+    }
+
+    void finishPage(ServiceJob &job)
+    {
+        if (job.remaining.fetch_sub(1) == 1)
+            finishJob(job);
+    }
+
+    void finishJob(ServiceJob &job)
+    {
+        const double elapsed_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job.received).count();
+        job_latency.add(elapsed_ms);
+        ++jobs_completed;
+        Json::Value message;
+        message["job"] = job.id;
+        message["done"] = true;
+        message["pages"] = Json::UInt64(job.pages.size());
+        message["failed"] = Json::UInt64(job.failed.load());
+        message["elapsed_ms"] = elapsed_ms;
+        job.connection->send(message);
+    }
+
+    Json::Value counters() const
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const double uptime = std::chrono::duration<double>(now - started).count();
+        Json::Value value;
+        value["uptime_s"] = uptime;
+        value["workers"] = options.workers;
+        value["connections"] = connection_count.load();
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            value["queue_depth"] = Json::UInt64(queue.size());
+        }
+        value["in_flight"] = in_flight.load();
+        value["jobs"]["received"] = Json::UInt64(jobs_received.load());
+        value["jobs"]["completed"] = Json::UInt64(jobs_completed.load());
+        value["pages"]["completed"] = Json::UInt64(pages_completed.load());
+        value["pages"]["cached"] = Json::UInt64(pages_cached.load());
+        value["pages"]["failed"] = Json::UInt64(pages_failed.load());
+        value["pages"]["cancelled"] = Json::UInt64(pages_cancelled.load());
+        value["throughput"]["pages_per_s"] = uptime > 0.0 ? pages_completed.load() / uptime : 0.0;
+        value["throughput"]["pages_per_s_last_minute"] = page_rate.perSecond(now);
+        value["latency_ms"]["page"] = page_latency.summary();
+        value["latency_ms"]["job"] = job_latency.summary();
+        if (result_cache)
+        {
+            value["result_cache"]["hits"] = Json::UInt64(result_cache->hits());
+            value["result_cache"]["misses"] = Json::UInt64(result_cache->misses());
+        }
+        value["decode_cache"] = decode_cache.counters();
+        return value;
+    }
+
+    ServiceOptions options;
+    BinaryThresholdSettingStore settings_store;
+    unique_ptr<ResultCache> result_cache;
+    DecodeCache decode_cache;
+    const std::chrono::steady_clock::time_point started;
+    int listen_fd = -1;
+
+    mutable std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<PageTask> queue;
+    std::atomic<bool> stopping{false};
+
+    std::mutex connections_mutex;
+    vector<std::weak_ptr<Connection>> connections;
+    vector<ConnectionThread> connection_threads;
+
+    std::atomic<size_t> next_job_id{1};
+    std::atomic<int> connection_count{0};
+    std::atomic<int> in_flight{0};
+    std::atomic<size_t> jobs_received{0};
+    std::atomic<size_t> jobs_completed{0};
+    std::atomic<size_t> pages_completed{0};
+    std::atomic<size_t> pages_cached{0};
+    std::atomic<size_t> pages_failed{0};
+    std::atomic<size_t> pages_cancelled{0};
+    LatencyWindow page_latency;
+    LatencyWindow job_latency;
+    RateWindow page_rate;
+};
+#endif
+
+int runServeCommand(int argc, char **argv)
+{
+    ServiceOptions opts;
+    int i = 2;
+    if (i < argc && argv[i][0] != '-')
+        opts.socket_path = argv[i++];
+    for (; i < argc; ++i)
+    {
+        string arg = argv[i];
+        auto value = [&]() -> string
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "Missing value for " << arg << endl;
+                exit(2);
+            }
+            return argv[++i];
+        };
+        auto number = [&](auto &target)
+        {
+            const string text = value();
+            if (!parseNumber(text, target))
+            {
+                cerr << "Invalid value for " << arg << ": " << text << endl;
+                cerr << "Usage: --serve [socket] [--workers n] [--cache dir] [--no-cache] [--decode-cache MB]" << endl;
+                exit(2);
+            }
+        };
+        if (arg == "--workers")
+        {
+            number(opts.workers);
+            opts.workers = std::max(1u, opts.workers);
+        }
+        else if (arg == "--cache")
+            opts.cache_dir = value();
+        else if (arg == "--no-cache")
+            opts.use_cache = false;
+        else if (arg == "--decode-cache")
+            number(opts.decode_cache_mb);
+        else
+        {
+            cerr << "Unknown serve option: " << arg << endl;
+            return 2;
         }
     }
+#ifdef _WIN32
+    cerr << "--serve is POSIX-only (Linux, macOS): it listens on a Unix domain socket and is not available on Windows. "
+            "Use --batch instead." << endl;
+    return 2;
+#else
+    ProcessingService service(opts);
+    return service.run();
+#endif
+}
+
+#ifdef HW_CORE_LIBRARY
+} // namespace
+#endif
+
+// 嵌入用 API（handwriting_core.h）：把上面的函式包成不碰全域狀態的呼叫。
+// 每個執行緒有自己的 arena 放暫存，輸入輸出都是呼叫端的記憶體；平行部分走共用執行緒池
+namespace hwcore
+{
 
-    // Apply grayscale conversion if requested
-    if (grayscale)
-    {
-        cv::cvtColor(image, image, cv::COLOR_BGR2GRAY);
-        cv::cvtColor(image, image, cv::COLOR_GRAY2BGR); // Convert back to 3-channel for consistency
-    }
+static cv::Mat wrapImage(const ImageView &view)
+{
+    const int type = view.channels == 1 ? CV_8UC1 : CV_8UC3;
+    const size_t step = view.stride ? view.stride : static_cast<size_t>(view.width) * view.channels;
+    return cv::Mat(view.height, view.width, type, const_cast<uint8_t *>(view.data), step);
+}
 
-    // Apply brightness and contrast adjustments
-    if (brightness != 0.0f || contrast != 1.0f)
+static bool checkImage(const ImageView &view, int channels, const char *what, string *error)
+{
+    if (!view.data || view.width <= 0 || view.height <= 0 || view.channels != channels ||
+        (view.stride && view.stride < static_cast<size_t>(view.width) * channels))
     {
-        image.convertTo(image, -1, contrast, brightness);
+        if (error)
+            *error = string(what) + " must be a non-empty 8-bit image with " + to_string(channels) + " channel(s)";
+        return false;
     }
+    return true;
+}
 
-    // Apply blur if requested
-    if (blur_kernel > 0)
+static bool parseSetting(const string &setting_json, BinaryThresholdSetting &setting, string *error)
+{
+    Json::Value root;
+    Json::CharReaderBuilder builder;
+    string errors;
+    std::istringstream in(setting_json);
+    if (!Json::parseFromStream(builder, in, &root, &errors) || !root.isObject())
     {
-        cv::GaussianBlur(image, image, cv::Size(blur_kernel * 2 + 1, blur_kernel * 2 + 1), 0);
+        if (error)
+            *error = "Invalid setting JSON: " + (errors.empty() ? string("expected an object") : errors);
+        return false;
     }
+    setting = binaryThresholdSettingFromJson(root);
+    return true;
+}
 
-    // Convert BGR to RGB (OpenCV uses BGR by default)
-    cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+static PageArena &threadArena()
+{
+    thread_local PageArena arena;
+    return arena;
+}
 
-    // Ensure continuous memory layout
-    if (!image.isContinuous())
+bool computeInkMask(const ImageView &bgr, const InkMaskOptions &options, const MaskView &ink, string *error)
+{
+    if (!checkImage(bgr, 3, "bgr", error))
+        return false;
+    if (!ink.data || ink.width != bgr.width || ink.height != bgr.height ||
+        (ink.stride && ink.stride < static_cast<size_t>(ink.width)))
     {
-        image = image.clone();
+        if (error)
+            *error = "ink must be a writable 8-bit single-channel buffer of the same size as bgr";
+        return false;
     }
+    BinaryThresholdSetting setting;
+    if (!parseSetting(options.setting_json, setting, error))
+        return false;
 
-    // Create a OpenGL texture identifier
-    GLuint image_texture;
-    glGenTextures(1, &image_texture);
-    glBindTexture(GL_TEXTURE_2D, image_texture);
-
-    // Setup filtering parameters for display
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    // Upload pixels into texture - specify correct alignment
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-#if defined(GL_UNPACK_ROW_LENGTH) && !defined(__EMSCRIPTEN__)
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-#endif
-
-    // Upload as RGB 3-channel
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image.cols, image.rows, 0, GL_RGB, GL_UNSIGNED_BYTE, image.data);
+    PageArena &arena = threadArena();
+    arena.reset();
+    cv::Mat out(ink.height, ink.width, CV_8UC1, ink.data, ink.stride ? ink.stride : static_cast<size_t>(ink.width));
+    computeInkMaskInto(wrapImage(bgr), setting, out, &arena);
+    MorphologyOptions morphology;
+    morphology.open_size = options.open_size;
+    morphology.close_size = options.close_size;
+    morphology.min_area = options.min_area;
+    applyMorphology(out, morphology, &arena);
+    return true;
+}
 
-    // Check for OpenGL errors
-    GLenum error = glGetError();
-    if (error != GL_NO_ERROR)
+bool clusterInkMask(const ImageView &ink, const ClusterOptions &options, ClusterResult &result, string *error)
+{
+    if (!checkImage(ink, 1, "ink", error))
+        return false;
+    if (!std::isfinite(options.radius) || options.radius < 0.0)
     {
-        cerr << "OpenGL error after processed texture upload: " << error << endl;
-        glDeleteTextures(1, &image_texture);
+        if (error)
+            *error = "radius must be a finite number >= 0";
         return false;
     }
 
-    *out_texture = image_texture;
-    *out_width = image.cols;
-    *out_height = image.rows;
+    PageArena &arena = threadArena();
+    arena.reset();
+    const cv::Mat mask = wrapImage(ink);
+    std::pmr::vector<cv::Point> points(&arena);
+    ClusterCSR clusters(&arena);
+    std::pmr::vector<ClusterStats> stats(&arena);
+    gatherInkPoints(mask, points);
+    clusterInkPoints(points, mask.size(), options.radius, clusters, &arena);
+    computeClusterStats(points, clusters, stats);
+    if (options.merge_strokes)
+    {
+        ClusterCSR characters(&arena);
+        mergeStrokeClusters(stats, clusters, characters, &arena);
+        clusters = std::move(characters);
+        computeClusterStats(points, clusters, stats);
+    }
+
+    static_assert(sizeof(cv::Point) == 2 * sizeof(int32_t));
+    result.points.resize(points.size() * 2);
+    memcpy(result.points.data(), points.data(), points.size() * sizeof(cv::Point));
+    result.offsets.assign(clusters.offsets.begin(), clusters.offsets.end());
+    result.indices.assign(clusters.indices.begin(), clusters.indices.end());
+    result.boxes.resize(stats.size() * 4);
+    result.centroids.resize(stats.size() * 2);
+    result.sizes.resize(stats.size());
+    for (size_t c = 0; c < stats.size(); ++c)
+    {
+        const ClusterStats &s = stats[c];
+        result.boxes[c * 4 + 0] = s.bbox.x;
+        result.boxes[c * 4 + 1] = s.bbox.y;
+        result.boxes[c * 4 + 2] = s.bbox.width;
+        result.boxes[c * 4 + 3] = s.bbox.height;
+        result.centroids[c * 2 + 0] = s.centroid.x;
+        result.centroids[c * 2 + 1] = s.centroid.y;
+        result.sizes[c] = s.size;
+    }
+    return true;
+}
 
+bool normalizeSetting(const string &setting_json, string &normalized, string *error)
+{
+    BinaryThresholdSetting setting;
+    if (!parseSetting(setting_json, setting, error))
+        return false;
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    normalized = Json::writeString(builder, binaryThresholdSettingToJson(setting));
     return true;
 }
 
-int main()
+} // namespace hwcore
+
+#ifndef HW_CORE_LIBRARY
+int main(int argc, char **argv)
 {
+    if (argc > 1 && string(argv[1]) == "--batch")
+        return runBatchCommand(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--worker")
+        return runWorkerCommand(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--serve")
+        return runServeCommand(argc, argv);
+    if (argc > 1 && string(argv[1]) == "--cluster-json")
+    {
+        if (argc < 4)
+        {
+            cerr << "Usage: --cluster-json <clusters.hwcl> <output.json>" << endl;
+            return 2;
+        }
+        return convertClusterFileToJson(argv[2], argv[3]) ? 0 : 1;
+    }
+
+#ifndef HW_WITH_GUI
+    cerr << "This build has no GUI. Modes: --batch, --worker, --serve, --cluster-json" << endl;
+    printBatchUsage();
+    return 2;
+#else
+    // Construct the shared thread pool before the static background workers below, so it is destroyed after them
+    sharedPool();
+
     // Initialize GLFW
     if (!glfwInit())
     {
@@ -556,6 +8431,7 @@ int main()
     int image_width = 0;
     int image_height = 0;
     string current_image_path = "";
+    ImageProbe current_image_probe;
 
     // Image processing parameters
     static float brightness = 0.0f;
@@ -577,9 +8453,11 @@ int main()
 
         if (LoadProcessedTextureFromFile(path.c_str(), &image_texture, &image_width, &image_height,
                                          brightness, contrast, blur_kernel, grayscale,
-                                         enable_binary, color_space, rgb_threshold, hsl_threshold, hsv_threshold))
+                                         enable_binary, color_space, rgb_threshold, hsl_threshold, hsv_threshold,
+                                         adaptive_threshold))
         {
             current_image_path = path;
+            current_image_probe = probeImageFile(path);
             cout << "Successfully loaded image: " << path << " (" << image_width << "x" << image_height << ")" << endl;
         }
         else
@@ -601,7 +8479,8 @@ int main()
 
             if (LoadProcessedTextureFromFile(current_image_path.c_str(), &image_texture, &image_width, &image_height,
                                              brightness, contrast, blur_kernel, grayscale,
-                                             enable_binary, color_space, rgb_threshold, hsl_threshold, hsv_threshold))
+                                             enable_binary, color_space, rgb_threshold, hsl_threshold, hsv_threshold,
+                                             adaptive_threshold))
             {
                 cout << "Reloaded image with effects applied" << endl;
             }
@@ -649,51 +8528,127 @@ int main()
     }
 
     // Directory listing state
-    vector<string> directory_entries;
+    static DirectoryIndex directory_index; // Scanned in the background; the browser only draws snapshots
+    static DirectoryWatcher directory_watcher; // Feeds new, changed and deleted files into directory_index
     string current_path = "../impool";
-
-    // Function to refresh directory listing
+    static int duplicate_distance = 4;
+    static DuplicateGrouper duplicate_grouper; // Hashes pages off the UI thread
+    static std::unordered_map<string, vector<string>> duplicate_groups; // 代表頁檔名 -> 重複頁檔名
+    static std::unordered_map<string, string> duplicate_of;               // 重複頁檔名 -> 代表頁檔名
+    static std::unordered_set<string> expanded_groups;                    // 展開顯示重複頁的代表頁
+    static DirectoryIndex::Snapshot browser_entries = directory_index.snapshot();
+    static vector<int> browser_rows;    // 畫面上的每一列：>= 0 是 browser_entries 的索引，< 0 是 -(重複頁索引) - 1
+    static bool browser_rows_dirty = true;
+    static uint64_t browser_version = 0;
+    static std::unordered_map<string, int> entry_by_name;
+
+    // Function to refresh directory listing (returns immediately; the index publishes a new snapshot when done)
     auto refresh_directory = [&]()
     {
-        directory_entries.clear();
-        try
-        {
-            for (const auto &entry : filesystem::directory_iterator(current_path))
-            {
-                string name = entry.path().filename().string();
-                if (entry.is_directory())
-                {
-                    name += "/";
-                }
-                directory_entries.push_back(name);
-            }
-            sort(directory_entries.begin(), directory_entries.end());
-        }
-        catch (const filesystem::filesystem_error &ex)
-        {
-            directory_entries.clear();
-            directory_entries.push_back("Error reading directory: " + string(ex.what()));
-        }
-    };    // Initial directory load
+        duplicate_groups.clear();
+        duplicate_of.clear();
+        expanded_groups.clear();
+        browser_rows_dirty = true;
+        directory_index.refresh(current_path);
+    }; // Initial directory load
     refresh_directory();
+    directory_watcher.start(current_path);
 
     static bool show_clusters_window = false;
     static std::vector<std::vector<int>> clusters;
     static int selected_cluster = -1;
+    // Clusters table: rows go through a clipper, and the per-column sort orders and the filtered row list are
+    // rebuilt only when the clusters, the sort column or a filter change
+    constexpr int cluster_column_count = 7; // #, Points, X, Y, Width, Height, Line
+    static uint64_t clusters_version = 0;   // Bumped whenever clusters / cluster_stats are replaced
+    static uint64_t cluster_table_version = UINT64_MAX;
+    static std::array<vector<int>, cluster_column_count> cluster_column_order; // Ascending permutation per column
+    static vector<int> cluster_rows; // Cluster indices in display order after filtering
+    static bool cluster_rows_dirty = true;
+    static int cluster_sort_column = 0;
+    static bool cluster_sort_descending = false;
+    static int cluster_size_range[2] = {0, 0}; // min, max (0 = no upper limit)
+    static int cluster_x_range[2] = {0, 0};    // Centroid x
+    static int cluster_y_range[2] = {0, 0};    // Centroid y
     static std::vector<cv::Point> nonZeroPoints;
     static GLuint cluster_texture = 0;
     static int cluster_image_width = 0;
     static int cluster_image_height = 0;
     static bool show_cluster_image_window = false;
+    static string clusters_source_path = "";
+    static std::pmr::vector<ClusterStats> cluster_stats;
+    static PageLayout cluster_layout;
+    static bool merge_strokes = false;
+    static bool template_grid_mode = false;
+    static MorphologyOptions morphology; // Mask cleanup before clustering
+    static ResultCache result_cache("../result_cache");
+    static size_t stroke_count = 0;
+    static long long cleanup_removed = -1; // Ink pixels removed by the mask cleanup on the last run; -1 when unknown (cached)
+    const string export_directory = "../glyph_export";
+
+    // Dense pages show a preview clustering within a frame or two; the exact pass runs in the background
+    const double preview_budget_ms = 8.0;
+    // Thresholding, cleanup, clustering and the result cache lookup all run on this worker, which also keeps the
+    // last exact clustering so a small threshold change only re-clusters the changed pixels
+    static BackgroundClusterer background_clusterer(&result_cache);
+    static uint64_t cluster_generation = 0; // Bumped per clustering request; stale background results are dropped
+    static bool cluster_preview = false;    // Displayed clusters are the preview, exact result still pending
+    static PreviewClusterInfo preview_info;
 
     // Binary threshold settings management
+    static BinaryThresholdSettingStore settings_store;
     static vector<BinaryThresholdSetting> binary_settings;
+    static vector<int> binary_setting_ids;
+    static int active_setting_id = 0; // Preset last loaded or saved; recorded in exported outputs
     static bool show_binary_settings_window = false;
     static char setting_name_buffer[256] = "";
     static int selected_setting_index = -1;
 
-    // Load existing binary threshold settings
-    binary_settings = loadBinaryThresholdSettings();
+    // Refresh the list shown in the Binary Settings Manager from the settings store
+    auto sync_binary_settings = [&]()
+    {
+        binary_settings.clear();
+        binary_setting_ids.clear();
+        for (const auto &entry : settings_store.list())
+        {
+            binary_settings.push_back(entry.setting);
+            binary_setting_ids.push_back(entry.id);
+        }
+    };
+
+    // The binary threshold values currently applied in the GUI
+    auto current_binary_setting = [&]()
+    {
+        BinaryThresholdSetting setting;
+        setting.color_space = color_space;
+        setting.enable_binary = enable_binary;
+        std::copy(rgb_threshold, rgb_threshold + 3, setting.rgb_threshold);
+        std::copy(hsl_threshold, hsl_threshold + 3, setting.hsl_threshold);
+        std::copy(hsv_threshold, hsv_threshold + 3, setting.hsv_threshold);
+        std::copy(adaptive_threshold, adaptive_threshold + 3, setting.adaptive_threshold);
+        return setting;
+    };
+
+    // Provenance for exported files: the active preset if the GUI still matches it
+    auto current_setting_info = [&]()
+    {
+        BinaryThresholdSetting current = current_binary_setting();
+        Json::Value info;
+        info["id"] = 0;
+        info["name"] = "";
+        auto entry = settings_store.findById(active_setting_id);
+        if (entry && hashProcessingParameters(entry->setting, "") == hashProcessingParameters(current, ""))
+        {
+            info["id"] = entry->id;
+            info["name"] = entry->setting.name;
+        }
+        info["values"] = binaryThresholdSettingToJson(current);
+        return info;
+    };
+
+    // Load existing binary threshold settings (imports imgBinHistory.json the first time)
+    settings_store.open(getSettingsStorePath(), getDocumentPath());
+    sync_binary_settings();
 
     // Main loop
     while (!glfwWindowShouldClose(window))
@@ -713,50 +8668,46 @@ int main()
             ImGui::Checkbox("Directory Window", &show_directory_window);
             ImGui::Checkbox("OpenCV Window", &show_opencv_window);
             ImGui::Checkbox("Binary Settings Manager", &show_binary_settings_window);
+            ImGui::Checkbox("Merge strokes into characters", &merge_strokes);
+            ImGui::Checkbox("Template grid mode", &template_grid_mode);
+            ImGui::Text("Mask cleanup before clustering:");
+            ImGui::SliderInt("Open (px)", &morphology.open_size, 0, 15);
+            ImGui::SliderInt("Close (px)", &morphology.close_size, 0, 15);
+            ImGui::SliderInt("Despeckle area (px)", &morphology.min_area, 0, 200);
 
             if (ImGui::Button("Compare non-zero points to total pixels"))
             {
                 if (!image.empty())
                 {
-                    cv::Mat gray_image;
-                    cv::cvtColor(image, gray_image, cv::COLOR_RGB2GRAY);
-
-                    cv::bitwise_not(gray_image, gray_image);
-
-                    nonZeroPoints.clear();
-                    cv::findNonZero(gray_image, nonZeroPoints);
-
-                    size_t non_zero_count = nonZeroPoints.size();
-                    size_t total_pixels = gray_image.total(); // total() returns rows * cols
-
-                    cout << "Comparison of non-zero points to total pixels:" << endl;
-                    cout << " - Non-zero points found: " << non_zero_count << endl;
-                    cout << " - Total pixels in image: " << total_pixels << endl;
-
-                    if (non_zero_count == total_pixels)
-                    {
-                        cout << "Result: All pixels in the image are non-zero." << endl;
-                    }
-                    else
-                    {
-                        cout << "Result: Not all pixels in the image are non-zero." << endl;
-                    }
-
-/**
- * do clustering
- */
-                    MultithreadCluster clusterer;
-                    vector<MultithreadCluster::Point2D> points = clusterer.formCV(nonZeroPoints);
-                    double radius = 5.0; // Example radius for clustering
-                    clusters = clusterer.cluster(points, radius);
-                    show_clusters_window = true;
-                    selected_cluster = -1; // Reset selection
+                    BackgroundClusterer::Request request;
+                    request.generation = ++cluster_generation;
+                    request.rgb = image; // load_image replaces the buffer, so the worker's view stays valid
+                    request.source = current_image_path;
+                    request.radius = 5.0; // Example radius for clustering
+                    request.merge_strokes = merge_strokes;
+                    request.template_grid = template_grid_mode;
+                    request.morphology = morphology;
+                    request.preview_budget_ms = preview_budget_ms;
+
+                    // Cache key: source file content + every effect that changed the displayed image + clustering options
+                    std::ostringstream extra;
+                    extra << "brightness=" << brightness << ";contrast=" << contrast << ";blur=" << blur_kernel
+                          << ";grayscale=" << grayscale << ";radius=" << request.radius << ";merge_strokes=" << merge_strokes
+                          << ";template_grid=" << template_grid_mode << ";open=" << morphology.open_size
+                          << ";close=" << morphology.close_size << ";despeckle=" << morphology.min_area;
+                    request.parameter_hash = hashProcessingParameters(current_binary_setting(), extra.str());
+                    background_clusterer.submit(std::move(request));
                 }
                 else
                 {
                     cout << "No image loaded to perform the check." << endl;
                 }
             }
+            if (background_clusterer.running() && !cluster_preview)
+            {
+                ImGui::SameLine();
+                ImGui::Text("Clustering...");
+            }
 
             ImGui::ColorEdit3("clear color", (float *)&clear_color); // Edit 3 floats representing a color
 
@@ -764,64 +8715,252 @@ int main()
             ImGui::End();
         }
 
+        // Show the preview or the exact clusters of the latest request once the worker publishes them
+        if (auto result = background_clusterer.take(); result && result->generation == cluster_generation)
+        {
+            if (cluster_preview && !result->preview)
+            {
+                cout << "Exact clustering: " << result->clusters.size() << " clusters in " << result->ms
+                     << " ms (preview had " << clusters.size() << ")" << endl;
+            }
+            nonZeroPoints = std::move(result->points);
+            clusters = std::move(result->clusters);
+            cluster_stats.assign(result->stats.begin(), result->stats.end());
+            cluster_layout = std::move(result->layout);
+            stroke_count = result->stroke_count;
+            cleanup_removed = result->cleanup_removed;
+            cluster_preview = result->preview;
+            preview_info = result->preview_info;
+            clusters_source_path = result->source;
+            ++clusters_version;
+            show_clusters_window = true;
+            selected_cluster = -1;             // Indices changed: reset the selection
+            show_cluster_image_window = false; // and close the view of the old one
+        }
+
         if (show_clusters_window)
         {
             ImGui::Begin("Clusters", &show_clusters_window);
-            for (size_t i = 0; i < clusters.size(); ++i)
+            if (cluster_preview)
             {
-                std::ostringstream oss;
-                oss << "Cluster " << i << " (" << clusters[i].size() << " points)";
-                if (ImGui::Selectable(oss.str().c_str(), selected_cluster == static_cast<int>(i)))
-                {
-                    selected_cluster = static_cast<int>(i);
-                    show_cluster_image_window = true;
+                ImGui::TextColored(ImVec4(1.0f, 0.8f, 0.2f, 1.0f), "Preview (%zu sampled points, %d px cells) - exact clustering running...",
+                                   preview_info.samples, preview_info.cell);
+            }
+            if (ImGui::Button("Export Glyph Atlas") && !clusters.empty() && !cluster_preview)
+            {
+                filesystem::create_directories(export_directory);
+                const string stem = filesystem::path(clusters_source_path).stem().string();
+                const string base = (filesystem::path(export_directory) / stem).string();
+
+                GlyphAtlasExporter exporter;
+                exporter.addPage(clusters_source_path, nonZeroPoints, clusters, cluster_stats, &cluster_layout);
+                exporter.setMetadata("setting", current_setting_info());
+                exporter.write(base + "_atlas.png", base + "_atlas.json");
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Export Clusters") && !clusters.empty() && !cluster_preview)
+            {
+                filesystem::create_directories(export_directory);
+                const string stem = filesystem::path(clusters_source_path).stem().string();
+
+                ClusterFileWriter writer;
+                writer.addPage(clusters_source_path, image.size(), nonZeroPoints, clusters, cluster_stats, &cluster_layout);
+                writer.write((filesystem::path(export_directory) / (stem + ".hwcl")).string());
+            }
+            ImGui::SameLine();
+            ImGui::Text("%zu text lines", cluster_layout.lines.size());
+            if (stroke_count != clusters.size())
+            {
+                ImGui::SameLine();
+                ImGui::Text("(%zu strokes -> %zu characters)", stroke_count, clusters.size());
+            }
+            if (cleanup_removed >= 0)
+            {
+                ImGui::SameLine();
+                ImGui::Text("Cleanup removed %lld ink pixels", cleanup_removed);
+            }
+            ImGui::Separator();
 
-                    if (selected_cluster != -1 && !clusters.empty() && !nonZeroPoints.empty())
+            // Rebuild the sort orders and the filtered row list only when the clusters, the sort or a filter changed
+            if (cluster_table_version != clusters_version)
+            {
+                cluster_table_version = clusters_version;
+                for (auto &order : cluster_column_order)
+                    order.clear();
+                cluster_rows_dirty = true;
+            }
+            ImGui::SetNextItemWidth(160);
+            if (ImGui::InputInt2("Points", cluster_size_range))
+                cluster_rows_dirty = true;
+            ImGui::SameLine();
+            ImGui::SetNextItemWidth(160);
+            if (ImGui::InputInt2("Center X", cluster_x_range))
+                cluster_rows_dirty = true;
+            ImGui::SameLine();
+            ImGui::SetNextItemWidth(160);
+            if (ImGui::InputInt2("Center Y", cluster_y_range))
+                cluster_rows_dirty = true;
+            ImGui::SameLine();
+            ImGui::TextDisabled("(min, max; max 0 = any)");
+
+            int clicked_cluster = -1;
+            const ImGuiTableFlags table_flags = ImGuiTableFlags_Sortable | ImGuiTableFlags_RowBg | ImGuiTableFlags_Borders |
+                                                ImGuiTableFlags_ScrollY | ImGuiTableFlags_Resizable | ImGuiTableFlags_SizingFixedFit;
+            if (ImGui::BeginTable("ClusterTable", cluster_column_count, table_flags))
+            {
+                ImGui::TableSetupScrollFreeze(0, 1);
+                ImGui::TableSetupColumn("#", ImGuiTableColumnFlags_DefaultSort, 0.0f, 0);
+                ImGui::TableSetupColumn("Points", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, 1);
+                ImGui::TableSetupColumn("X", 0, 0.0f, 2);
+                ImGui::TableSetupColumn("Y", 0, 0.0f, 3);
+                ImGui::TableSetupColumn("Width", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, 4);
+                ImGui::TableSetupColumn("Height", ImGuiTableColumnFlags_PreferSortDescending, 0.0f, 5);
+                ImGui::TableSetupColumn("Line", 0, 0.0f, 6);
+                ImGui::TableHeadersRow();
+
+                if (ImGuiTableSortSpecs *specs = ImGui::TableGetSortSpecs(); specs && specs->SpecsDirty)
+                {
+                    if (specs->SpecsCount > 0)
                     {
-                        cv::Mat cluster_display;
-                        if (!image.empty())
-                        {
-                            cluster_display = image.clone(); // Work on a copy
-                        }
-                        else
-                        {
-                            cluster_display = cv::Mat::zeros(480, 640, CV_8UC3); // Fallback
-                        }
+                        cluster_sort_column = static_cast<int>(specs->Specs[0].ColumnUserID);
+                        cluster_sort_descending = specs->Specs[0].SortDirection == ImGuiSortDirection_Descending;
+                    }
+                    specs->SpecsDirty = false;
+                    cluster_rows_dirty = true;
+                }
 
-                        // Draw points from the selected cluster
-                        const auto &cluster_indices = clusters[selected_cluster];
-                        for (int point_idx : cluster_indices)
+                if (cluster_rows_dirty)
+                {
+                    // Each column's ascending order is sorted once per clustering result; descending walks it backwards
+                    vector<int> &order = cluster_column_order[cluster_sort_column];
+                    if (order.size() != cluster_stats.size())
+                    {
+                        order.resize(cluster_stats.size());
+                        std::iota(order.begin(), order.end(), 0);
+                        auto key = [&](int c) -> int
                         {
-                            if (point_idx < nonZeroPoints.size())
+                            const ClusterStats &stat = cluster_stats[c];
+                            switch (cluster_sort_column)
                             {
-                                cv::Point p = nonZeroPoints[point_idx];
-                                // Draw a red circle. The global `image` is RGB, so red is (255, 0, 0).
-                                cv::circle(cluster_display, p, 2, cv::Scalar(255, 0, 0), -1);
+                            case 1: return stat.size;
+                            case 2: return stat.bbox.x;
+                            case 3: return stat.bbox.y;
+                            case 4: return stat.bbox.width;
+                            case 5: return stat.bbox.height;
+                            case 6: return c < static_cast<int>(cluster_layout.line_of.size()) ? cluster_layout.line_of[c] : -1;
+                            default: return c;
                             }
-                        }
+                        };
+                        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return key(a) < key(b); });
+                    }
+
+                    auto in_range = [](float value, const int range[2])
+                    {
+                        return value >= range[0] && (range[1] == 0 || value <= range[1]);
+                    };
+                    cluster_rows.clear();
+                    cluster_rows.reserve(order.size());
+                    for (size_t k = 0; k < order.size(); ++k)
+                    {
+                        const int c = cluster_sort_descending ? order[order.size() - 1 - k] : order[k];
+                        const ClusterStats &stat = cluster_stats[c];
+                        if (in_range(static_cast<float>(stat.size), cluster_size_range) &&
+                            in_range(stat.centroid.x, cluster_x_range) && in_range(stat.centroid.y, cluster_y_range))
+                            cluster_rows.push_back(c);
+                    }
+                    cluster_rows_dirty = false;
+                }
+
+                // Only the visible rows are formatted, into a stack buffer
+                ImGuiListClipper clipper;
+                clipper.Begin(static_cast<int>(cluster_rows.size()));
+                while (clipper.Step())
+                {
+                    for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row)
+                    {
+                        const int c = cluster_rows[row];
+                        const ClusterStats &stat = cluster_stats[c];
+                        char label[16];
+                        snprintf(label, sizeof(label), "%d", c);
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        if (ImGui::Selectable(label, selected_cluster == c, ImGuiSelectableFlags_SpanAllColumns))
+                            clicked_cluster = c;
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", stat.size);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", stat.bbox.x);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", stat.bbox.y);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", stat.bbox.width);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", stat.bbox.height);
+                        ImGui::TableNextColumn();
+                        const int line = c < static_cast<int>(cluster_layout.line_of.size()) ? cluster_layout.line_of[c] : -1;
+                        if (line >= 0)
+                            ImGui::Text("%d", line);
+                        else
+                            ImGui::TextDisabled("-");
+                    }
+                }
+                ImGui::EndTable();
+            }
+            if (cluster_rows.size() != clusters.size())
+                ImGui::Text("Showing %zu of %zu clusters", cluster_rows.size(), clusters.size());
+
+            if (clicked_cluster >= 0)
+            {
+                selected_cluster = clicked_cluster;
+                show_cluster_image_window = true;
+
+                if (selected_cluster != -1 && !clusters.empty() && !nonZeroPoints.empty())
+                {
+                    cv::Mat cluster_display;
+                    if (!image.empty())
+                    {
+                        cluster_display = image.clone(); // Work on a copy
+                    }
+                    else
+                    {
+                        cluster_display = cv::Mat::zeros(480, 640, CV_8UC3); // Fallback
+                    }
 
-                        // Create/update OpenGL texture for display
-                        if (cluster_texture != 0)
+                    // Draw points from the selected cluster
+                    const auto &cluster_indices = clusters[selected_cluster];
+                    for (int point_idx : cluster_indices)
+                    {
+                        if (point_idx < nonZeroPoints.size())
                         {
-                            glDeleteTextures(1, &cluster_texture);
+                            cv::Point p = nonZeroPoints[point_idx];
+                            // Draw a red circle. The global `image` is RGB, so red is (255, 0, 0).
+                            cv::circle(cluster_display, p, 2, cv::Scalar(255, 0, 0), -1);
                         }
-                        glGenTextures(1, &cluster_texture);
-                        glBindTexture(GL_TEXTURE_2D, cluster_texture);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-                        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-                        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cluster_display.cols, cluster_display.rows, 0, GL_RGB, GL_UNSIGNED_BYTE, cluster_display.data);
-
-                        cluster_image_width = cluster_display.cols;
-                        cluster_image_height = cluster_display.rows;
                     }
+
+                    // Create/update OpenGL texture for display
+                    if (cluster_texture != 0)
+                    {
+                        glDeleteTextures(1, &cluster_texture);
+                    }
+                    glGenTextures(1, &cluster_texture);
+                    glBindTexture(GL_TEXTURE_2D, cluster_texture);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+                    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cluster_display.cols, cluster_display.rows, 0, GL_RGB, GL_UNSIGNED_BYTE, cluster_display.data);
+
+                    cluster_image_width = cluster_display.cols;
+                    cluster_image_height = cluster_display.rows;
                 }
             }
             ImGui::End();
         }
 
+        if (show_cluster_image_window && (selected_cluster < 0 || selected_cluster >= static_cast<int>(clusters.size())))
+            show_cluster_image_window = false;
         if (show_cluster_image_window)
 {
     ImGui::Begin("Cluster Visualization", &show_cluster_image_window);
@@ -927,7 +9066,9 @@ int main()
                             ImGui::BeginTooltip();
                             ImGui::Text("Color Space: %s", 
                                 setting.color_space == 0 ? "RGB" : 
-                                setting.color_space == 1 ? "HSL" : "HSV");
+                                setting.color_space == 1 ? "HSL" :
+                                setting.color_space == 2 ? "HSV" :
+                                setting.color_space == 3 ? "Adaptive (Sauvola)" : "Adaptive (Niblack)");
                             ImGui::Text("Binary Enabled: %s", setting.enable_binary ? "Yes" : "No");
                             
                             if (setting.color_space == 0) {
@@ -936,9 +9077,12 @@ int main()
                             } else if (setting.color_space == 1) {
                                 ImGui::Text("HSL: %.1f, %.1f, %.1f", 
                                     setting.hsl_threshold[0], setting.hsl_threshold[1], setting.hsl_threshold[2]);
-                            } else {
+                            } else if (setting.color_space == 2) {
                                 ImGui::Text("HSV: %.1f, %.1f, %.1f", 
                                     setting.hsv_threshold[0], setting.hsv_threshold[1], setting.hsv_threshold[2]);
+                            } else {
+                                ImGui::Text("Window: %.0f, k: %.2f, R: %.0f", 
+                                    setting.adaptive_threshold[0], setting.adaptive_threshold[1], setting.adaptive_threshold[2]);
                             }
                             ImGui::EndTooltip();
                         }
@@ -960,7 +9104,10 @@ int main()
                         memcpy(rgb_threshold, setting.rgb_threshold, sizeof(rgb_threshold));
                         memcpy(hsl_threshold, setting.hsl_threshold, sizeof(hsl_threshold));
                         memcpy(hsv_threshold, setting.hsv_threshold, sizeof(hsv_threshold));
+                        memcpy(adaptive_threshold, setting.adaptive_threshold, sizeof(adaptive_threshold));
                         
+                        active_setting_id = binary_setting_ids[selected_setting_index];
+
                         // Reload image with new settings
                         reload_with_effects();
                         
@@ -982,8 +9129,8 @@ int main()
                         
                         if (ImGui::Button("Yes, Delete", ImVec2(120, 0)))
                         {
-                            binary_settings.erase(binary_settings.begin() + selected_setting_index);
-                            saveBinaryThresholdSettings(binary_settings);
+                            settings_store.remove(binary_setting_ids[selected_setting_index]);
+                            sync_binary_settings();
                             selected_setting_index = -1;
                             ImGui::CloseCurrentPopup();
                         }
@@ -1011,8 +9158,8 @@ int main()
                     
                     if (ImGui::Button("Yes, Clear All", ImVec2(120, 0)))
                     {
-                        binary_settings.clear();
-                        saveBinaryThresholdSettings(binary_settings);
+                        settings_store.clear();
+                        sync_binary_settings();
                         selected_setting_index = -1;
                         ImGui::CloseCurrentPopup();
                     }
@@ -1026,12 +9173,33 @@ int main()
             }
             
             ImGui::Separator();
-            ImGui::Text("Settings file location:");
+            ImGui::Text("Settings store location:");
+            ImGui::Text("%s", settings_store.logPath().c_str());
+            ImGui::Text("JSON import/export file:");
             ImGui::Text("%s", getDocumentPath().c_str());
             
             if (ImGui::Button("Reload Settings from File"))
             {
-                binary_settings = loadBinaryThresholdSettings();
+                settings_store.refresh();
+                sync_binary_settings();
+                selected_setting_index = -1;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Compact Store"))
+            {
+                settings_store.compact();
+                sync_binary_settings();
+            }
+            
+            if (ImGui::Button("Export JSON"))
+            {
+                settings_store.exportJson(getDocumentPath());
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Import JSON"))
+            {
+                settings_store.importJson(getDocumentPath());
+                sync_binary_settings();
                 selected_setting_index = -1;
             }
             
@@ -1040,52 +9208,198 @@ int main()
 
 
         // 4. Show directory listing window
+        // Files dropped into the folder show up without pressing Refresh
+        vector<FileChange> directory_changes = directory_watcher.take();
+        if (!directory_changes.empty())
+        {
+            // The watcher lost events (inotify queue overflow): relist the whole folder instead
+            const bool rescan = std::any_of(directory_changes.begin(), directory_changes.end(),
+                                            [](const FileChange &change) { return change.rescan; });
+            if (rescan)
+            {
+                directory_index.refresh(current_path);
+            }
+            else
+            {
+                vector<string> changed_paths;
+                for (const auto &change : directory_changes)
+                    changed_paths.push_back(change.path);
+                directory_index.update(changed_paths);
+            }
+        }
+
         if (show_directory_window)
         {
             ImGui::Begin("Image Browser", &show_directory_window);
 
-            ImGui::Text("Current Directory: %s", filesystem::absolute(current_path).string().c_str());
+            // Pick up a newly published snapshot and rebuild the visible rows only when something changed
+            if (directory_index.version() != browser_version)
+            {
+                browser_version = directory_index.version();
+                browser_entries = directory_index.snapshot();
+                entry_by_name.clear();
+                for (size_t i = 0; i < browser_entries->size(); ++i)
+                    entry_by_name[(*browser_entries)[i].name] = static_cast<int>(i);
+                browser_rows_dirty = true;
+            }
+            if (browser_rows_dirty)
+            {
+                browser_rows.clear();
+                browser_rows.reserve(browser_entries->size());
+                for (size_t i = 0; i < browser_entries->size(); ++i)
+                {
+                    const DirectoryEntry &entry = (*browser_entries)[i];
+                    // Near-duplicates are listed under their representative
+                    if (entry.is_image && duplicate_of.count(entry.name))
+                        continue;
+                    browser_rows.push_back(static_cast<int>(i));
+                    auto group = duplicate_groups.find(entry.name);
+                    if (group == duplicate_groups.end() || !expanded_groups.count(entry.name))
+                        continue;
+                    for (const auto &duplicate : group->second)
+                    {
+                        auto found = entry_by_name.find(duplicate);
+                        if (found != entry_by_name.end())
+                            browser_rows.push_back(-found->second - 1);
+                    }
+                }
+                browser_rows_dirty = false;
+            }
+
+            ImGui::Text("Current Directory: %s", directory_index.directory().c_str());
             ImGui::Text("Current Image: %s", current_image_path.empty() ? "None" : filesystem::path(current_image_path).filename().string().c_str());
 
             if (ImGui::Button("Refresh"))
                 refresh_directory();
+            ImGui::SameLine();
+            if (ImGui::Button("Group Duplicates"))
+            {
+                vector<string> names;
+                vector<string> paths;
+                for (const auto &entry : *browser_entries)
+                {
+                    if (entry.is_image)
+                    {
+                        names.push_back(entry.name);
+                        paths.push_back(entry.path);
+                    }
+                }
+                duplicate_grouper.submit(std::move(names), std::move(paths), duplicate_distance);
+            }
+            ImGui::SameLine();
+            ImGui::SetNextItemWidth(100);
+            ImGui::SliderInt("Max distance", &duplicate_distance, 0, PerceptualHashIndex::max_exact_distance);
+            if (directory_index.scanning())
+            {
+                ImGui::SameLine();
+                ImGui::Text("Scanning...");
+            }
+            if (duplicate_grouper.running())
+            {
+                ImGui::SameLine();
+                ImGui::Text("Hashing...");
+            }
+            DuplicateGrouper::Result grouping;
+            if (duplicate_grouper.take(grouping))
+            {
+                duplicate_groups.clear();
+                duplicate_of.clear();
+                expanded_groups.clear();
+                for (size_t i = 0; i < grouping.names.size(); ++i)
+                {
+                    const int r = grouping.representative[i];
+                    if (r == static_cast<int>(i))
+                        continue;
+                    duplicate_groups[grouping.names[r]].push_back(grouping.names[i]);
+                    duplicate_of[grouping.names[i]] = grouping.names[r];
+                }
+                browser_rows_dirty = true;
+                cout << "Found " << duplicate_of.size() << " near-duplicate images in " << current_path << " ("
+                     << std::fixed << std::setprecision(2) << grouping.seconds << " s)" << endl;
+            }
 
             ImGui::Separator();
 
-            // Show directory contents with click to load functionality
+            // Show directory contents with click to load functionality.
+            // Only the visible rows are drawn, so the cost per frame does not grow with the directory size.
             if (ImGui::BeginChild("DirectoryContents", ImVec2(0, 300), true))
             {
-                for (const auto &entry : directory_entries)
+                const string error = directory_index.error();
+                if (!error.empty())
+                    ImGui::Text("%s", error.c_str());
+
+                const float row_width = ImGui::GetContentRegionAvail().x;
+                ImGuiListClipper clipper;
+                clipper.Begin(static_cast<int>(browser_rows.size()));
+                while (clipper.Step())
                 {
-                    // Check if it's an image file
-                    string ext = filesystem::path(entry).extension().string();
-                    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-                    bool is_image = (ext == ".webp" || ext == ".jpg" || ext == ".jpeg" || ext == ".png" || ext == ".bmp" || ext == ".tiff" || ext == ".tga");
-
-                    if (is_image)
+                    for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row)
                     {
-                        // Make image files clickable
-                        if (ImGui::Selectable(entry.c_str()))
+                        const bool is_duplicate = browser_rows[row] < 0;
+                        const DirectoryEntry &entry = (*browser_entries)[is_duplicate ? -browser_rows[row] - 1 : browser_rows[row]];
+                        ImGui::PushID(row);
+                        if (entry.is_image)
                         {
-                            string full_path = filesystem::absolute(current_path + "/" + entry).string();
-                            load_image(full_path);
+                            if (is_duplicate)
+                                ImGui::Indent();
+                            // Make image files clickable
+                            if (ImGui::Selectable(entry.name.c_str(), entry.path == current_image_path, 0,
+                                                  ImVec2(std::max(row_width - 260, 1.0f), 0)))
+                            {
+                                load_image(entry.path);
+                            }
+                            if (is_duplicate)
+                                ImGui::Unindent();
+                            const bool wrong_extension = !extensionMatchesFormat(entry.name, entry.probe.format);
+                            if (wrong_extension)
+                            {
+                                ImGui::SameLine(row_width - 95);
+                                ImGui::TextColored(ImVec4(1.0f, 1.0f, 0.0f, 1.0f), "!");
+                            }
+                            ImGui::SameLine(row_width - 80);
+                            ImGui::Text("%8.1f KB", entry.size / 1024.0);
+                            if (ImGui::IsItemHovered())
+                            {
+                                const time_t mtime = static_cast<time_t>(entry.mtime);
+                                char modified[32] = "";
+                                if (entry.mtime != 0)
+                                    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+                                ImGui::SetTooltip("%s %dx%d%s\nModified %s", imageFormatName(entry.probe.format),
+                                                  entry.probe.width, entry.probe.height,
+                                                  wrong_extension ? " (wrong extension)" : "", modified);
+                            }
+                            auto group = is_duplicate ? duplicate_groups.end() : duplicate_groups.find(entry.name);
+                            if (group != duplicate_groups.end())
+                            {
+                                const bool expanded = expanded_groups.count(entry.name) != 0;
+                                string label = (expanded ? "- " : "+ ") + to_string(group->second.size()) + " near-duplicates";
+                                ImGui::SameLine(row_width - 250);
+                                if (ImGui::SmallButton(label.c_str()))
+                                {
+                                    if (expanded)
+                                        expanded_groups.erase(entry.name);
+                                    else
+                                        expanded_groups.insert(entry.name);
+                                    browser_rows_dirty = true;
+                                }
+                            }
                         }
-                        // Highlight current selected image
-                        if (!current_image_path.empty() && filesystem::path(current_image_path).filename().string() == entry)
+                        else
                         {
-                            ImGui::SameLine();
-                            ImGui::Text("  <-- Current");
+                            // Non-image files shown as regular text
+                            ImGui::Text("%s", entry.name.c_str());
                         }
-                    }
-                    else
-                    {
-                        // Non-image files shown as regular text
-                        ImGui::Text("%s", entry.c_str());
+                        ImGui::PopID();
                     }
                 }
             }
             ImGui::EndChild();
-            ImGui::Text("Total items: %zu", directory_entries.size());
+            ImGui::Text("Total items: %zu", browser_entries->size());
+            if (!duplicate_of.empty())
+            {
+                ImGui::SameLine();
+                ImGui::Text("(%zu near-duplicates in %zu groups)", duplicate_of.size(), duplicate_groups.size());
+            }
             ImGui::Text("Tip: Click on image files to load them");
 
             ImGui::End();
@@ -1146,7 +9460,7 @@ int main()
                 {
                     ImGui::Text("Color Space Selection:");
 
-                    const char *color_space_items[] = {"RGB", "HSL", "HSV"};
+                    const char *color_space_items[] = {"RGB", "HSL", "HSV", "Adaptive (Sauvola)", "Adaptive (Niblack)"};
                     if (ImGui::Combo("Color Space", &color_space, color_space_items, IM_ARRAYSIZE(color_space_items)))
                     {
                         effects_changed = true;
@@ -1202,6 +9516,22 @@ int main()
                             effects_changed = true;
                         }
                     }
+                    else
+                    { // Adaptive (local mean / deviation of lightness)
+                        ImGui::Text("Adaptive Threshold (lightness):");
+                        if (ImGui::SliderFloat("Window", &adaptive_threshold[0], 3.0f, 255.0f, "%.0f px"))
+                        {
+                            effects_changed = true;
+                        }
+                        if (ImGui::SliderFloat("k", &adaptive_threshold[1], 0.0f, 1.0f, "%.2f"))
+                        {
+                            effects_changed = true;
+                        }
+                        if (color_space == 3 && ImGui::SliderFloat("R (dynamic range)", &adaptive_threshold[2], 1.0f, 255.0f, "%.0f"))
+                        {
+                            effects_changed = true;
+                        }
+                    }
                 }
 
                 ImGui::SameLine();
@@ -1217,6 +9547,9 @@ int main()
                     hsl_threshold[0] = hsv_threshold[0] = 180.0f;
                     hsl_threshold[1] = hsl_threshold[2] = 50.0f;
                     hsv_threshold[1] = hsv_threshold[2] = 50.0f;
+                    adaptive_threshold[0] = 31.0f;
+                    adaptive_threshold[1] = 0.2f;
+                    adaptive_threshold[2] = 128.0f;
                     effects_changed = true;
                 }
 
@@ -1225,7 +9558,7 @@ int main()
                 {
                     if (enable_binary) {
                         // Create a dialog to get the setting name
-                        strcpy_s(setting_name_buffer, sizeof(setting_name_buffer), "");
+                        setting_name_buffer[0] = '\0';
                         ImGui::OpenPopup("Save Binary Setting");
                     } else {
                         ImGui::OpenPopup("Binary Not Enabled");
@@ -1249,9 +9582,10 @@ int main()
                             memcpy(new_setting.rgb_threshold, rgb_threshold, sizeof(rgb_threshold));
                             memcpy(new_setting.hsl_threshold, hsl_threshold, sizeof(hsl_threshold));
                             memcpy(new_setting.hsv_threshold, hsv_threshold, sizeof(hsv_threshold));
+                            memcpy(new_setting.adaptive_threshold, adaptive_threshold, sizeof(adaptive_threshold));
                             
-                            binary_settings.push_back(new_setting);
-                            saveBinaryThresholdSettings(binary_settings);
+                            active_setting_id = settings_store.put(new_setting);
+                            sync_binary_settings();
                             
                             ImGui::CloseCurrentPopup();
                         }
@@ -1327,14 +9661,16 @@ int main()
                 float size_mb = (image_width * image_height * 3) / (1024.0f * 1024.0f);
                 ImGui::Text("  Memory Usage: %.2f MB (uncompressed)", size_mb);
 
-                // Show file extension vs actual format warning
+                // Show file extension vs actual format warning (format sniffed from the file header)
                 if (!current_image_path.empty())
                 {
                     string ext = filesystem::path(current_image_path).extension().string();
                     ImGui::Text("  File Extension: %s", ext.c_str());
-                    if (ext == ".jpg" || ext == ".jpeg")
+                    ImGui::Text("  Detected Format: %s", imageFormatName(current_image_probe.format));
+                    if (!extensionMatchesFormat(current_image_path, current_image_probe.format))
                     {
-                        ImGui::TextColored(ImVec4(1.0f, 1.0f, 0.0f, 1.0f), "  Warning: Files may be WebP format with wrong extension!");
+                        ImGui::TextColored(ImVec4(1.0f, 1.0f, 0.0f, 1.0f), "  Warning: %s file with a %s extension!",
+                                           imageFormatName(current_image_probe.format), ext.c_str());
                     }
                 }
             }
@@ -1354,7 +9690,11 @@ int main()
         glfwSwapBuffers(window);
     }
 
-    // Cleanup
+    // Cleanup: join the background workers while sharedPool() and the other statics they use are still alive
+    background_clusterer.stop();
+    duplicate_grouper.stop();
+    directory_watcher.stop();
+    directory_index.stop();
     if (image_texture != 0)
         glDeleteTextures(1, &image_texture);
     if (cluster_texture != 0)
@@ -1368,4 +9708,6 @@ int main()
     glfwTerminate();
 
     return 0;
-}
\ No newline at end of file
+#endif
+}
+#endif
@@ -0,0 +1,155 @@
+// hwcore：HandwritingCore 的 Python 綁定。
+// NumPy 陣列直接包成 ImageView / MaskView 傳進 C++，結果陣列指向 C++ 端的 vector（由 capsule 持有），
+// 兩個方向都不複製；運算期間放開 GIL，多個 Python 執行緒可以同時呼叫
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "handwriting_core.h"
+
+namespace py = pybind11;
+
+namespace
+{
+
+// uint8 陣列：列之間可以有間隔（例如切片出來的 ROI），但一列之內必須是緊密排列
+hwcore::ImageView imageView(const py::array &array, int channels, const char *name)
+{
+    const bool layout_ok = array.dtype().kind() == 'u' && array.itemsize() == 1 &&
+                           array.ndim() == (channels == 1 ? 2 : 3) &&
+                           (channels == 1 || (array.shape(2) == channels && array.strides(2) == 1)) &&
+                           array.strides(1) == channels && array.strides(0) >= array.shape(1) * channels;
+    if (!layout_ok)
+    {
+        throw py::value_error(std::string(name) + " must be a uint8 array of shape " +
+                              (channels == 1 ? "(h, w)" : "(h, w, 3)") +
+                              " with contiguous rows (use numpy.ascontiguousarray)");
+    }
+    hwcore::ImageView view;
+    view.data = static_cast<const uint8_t *>(array.data());
+    view.height = static_cast<int>(array.shape(0));
+    view.width = static_cast<int>(array.shape(1));
+    view.stride = static_cast<size_t>(array.strides(0));
+    view.channels = channels;
+    return view;
+}
+
+// 設定可以是 JSON 字串，也可以是與 imgBinHistory.json 一筆相同結構的 dict
+std::string settingJson(const py::object &setting)
+{
+    if (py::isinstance<py::str>(setting))
+        return setting.cast<std::string>();
+    return py::module_::import("json").attr("dumps")(setting).cast<std::string>();
+}
+
+template <typename T>
+py::array_t<T> viewOf(std::vector<T> &values, std::vector<py::ssize_t> shape, const py::capsule &owner)
+{
+    return py::array_t<T>(shape, values.data(), owner);
+}
+
+py::array inkMask(const py::array &bgr, const py::object &setting, py::object out,
+                  int open_size, int close_size, int despeckle)
+{
+    const hwcore::ImageView input = imageView(bgr, 3, "bgr");
+    // out 不做型別轉換：轉換會產生副本，結果就寫不回呼叫端的陣列
+    py::array ink;
+    if (out.is_none())
+    {
+        ink = py::array_t<uint8_t>({static_cast<py::ssize_t>(input.height), static_cast<py::ssize_t>(input.width)});
+    }
+    else
+    {
+        if (!py::isinstance<py::array>(out))
+            throw py::type_error("out must be a numpy array");
+        ink = py::reinterpret_borrow<py::array>(out);
+        if (!ink.writeable())
+            throw py::value_error("out must be writable");
+        imageView(ink, 1, "out");
+    }
+
+    hwcore::InkMaskOptions options;
+    options.setting_json = settingJson(setting);
+    options.open_size = open_size;
+    options.close_size = close_size;
+    options.min_area = despeckle;
+
+    hwcore::MaskView mask;
+    mask.data = static_cast<uint8_t *>(ink.mutable_data());
+    mask.height = static_cast<int>(ink.shape(0));
+    mask.width = static_cast<int>(ink.shape(1));
+    mask.stride = static_cast<size_t>(ink.strides(0));
+
+    std::string error;
+    bool ok;
+    {
+        py::gil_scoped_release release;
+        ok = hwcore::computeInkMask(input, options, mask, &error);
+    }
+    if (!ok)
+        throw py::value_error(error);
+    return ink;
+}
+
+py::dict cluster(const py::array &ink, double radius, bool merge_strokes)
+{
+    const hwcore::ImageView input = imageView(ink, 1, "ink");
+    hwcore::ClusterOptions options;
+    options.radius = radius;
+    options.merge_strokes = merge_strokes;
+
+    auto result = std::make_unique<hwcore::ClusterResult>();
+    std::string error;
+    bool ok;
+    {
+        py::gil_scoped_release release;
+        ok = hwcore::clusterInkMask(input, options, *result, &error);
+    }
+    if (!ok)
+        throw py::value_error(error);
+
+    // 所有輸出陣列共用一個 capsule，最後一個陣列被回收時才刪掉 C++ 的結果
+    hwcore::ClusterResult *owned = result.release();
+    py::capsule owner(owned, [](void *p) { delete static_cast<hwcore::ClusterResult *>(p); });
+    const auto points = static_cast<py::ssize_t>(owned->points.size() / 2);
+    const auto clusters = static_cast<py::ssize_t>(owned->clusterCount());
+
+    py::dict out;
+    out["points"] = viewOf(owned->points, {points, 2}, owner);
+    out["offsets"] = viewOf(owned->offsets, {static_cast<py::ssize_t>(owned->offsets.size())}, owner);
+    out["indices"] = viewOf(owned->indices, {static_cast<py::ssize_t>(owned->indices.size())}, owner);
+    out["boxes"] = viewOf(owned->boxes, {clusters, 4}, owner);
+    out["centroids"] = viewOf(owned->centroids, {clusters, 2}, owner);
+    out["sizes"] = viewOf(owned->sizes, {clusters}, owner);
+    return out;
+}
+
+std::string normalizeSetting(const py::object &setting)
+{
+    std::string normalized, error;
+    if (!hwcore::normalizeSetting(settingJson(setting), normalized, &error))
+        throw py::value_error(error);
+    return normalized;
+}
+
+} // namespace
+
+PYBIND11_MODULE(hwcore, m)
+{
+    m.doc() = "Handwriting thresholding and clustering on NumPy arrays without copies";
+
+    m.def("ink_mask", &inkMask, py::arg("bgr"), py::arg("setting"), py::arg("out") = py::none(),
+          py::arg("open_size") = 0, py::arg("close_size") = 0, py::arg("despeckle") = 0,
+          "Ink mask (255 = ink) of a uint8 (h, w, 3) BGR image. setting is a JSON string or dict in the "
+          "imgBinHistory.json format. Writes into out (uint8 (h, w)) when given, otherwise into a new array.");
+    m.def("cluster", &cluster, py::arg("ink"), py::arg("radius") = 5.0, py::arg("merge_strokes") = false,
+          "Cluster the ink pixels of a uint8 (h, w) mask. Returns a dict of arrays: points (n, 2) as x, y; "
+          "offsets and indices (cluster c is points[indices[offsets[c]:offsets[c + 1]]]); "
+          "boxes (k, 4) as x, y, w, h; centroids (k, 2); sizes (k,).");
+    m.def("normalize_setting", &normalizeSetting, py::arg("setting"),
+          "Parse a setting and return it as JSON with every field filled in.");
+}
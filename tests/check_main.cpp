@@ -0,0 +1,636 @@
+// HandwritingChecks：把快速實作跟參考實作（直接照定義算的樸素版本、OpenCV）比對。
+// 直接 include main.cpp（HW_CORE_LIBRARY，不含 GUI 與 main），所以內部函式都能測。
+// 用法：HandwritingChecks [名稱]；不給名稱就全部跑。ctest 每個檢查註冊成一個 test
+
+#define HW_CORE_LIBRARY
+#include "main.cpp"
+
+namespace
+{
+
+int failures = 0;
+
+#define CHECK(cond)                                                                 \
+    do                                                                              \
+    {                                                                               \
+        if (!(cond))                                                                \
+        {                                                                           \
+            cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond << endl; \
+            ++failures;                                                             \
+        }                                                                           \
+    } while (0)
+
+// 隨機的淺色紙 + 深色筆畫 + 不均勻光照
+cv::Mat makePage(int rows, int cols, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    cv::Mat bgr(rows, cols, CV_8UC3);
+    for (int y = 0; y < rows; ++y)
+    {
+        uchar *row = bgr.ptr<uchar>(y);
+        for (int x = 0; x < cols; ++x)
+        {
+            const int light = 150 + (x * 80) / cols + static_cast<int>(rng() % 20);
+            row[3 * x] = static_cast<uchar>(std::min(255, light));
+            row[3 * x + 1] = static_cast<uchar>(std::min(255, light - 5));
+            row[3 * x + 2] = static_cast<uchar>(std::min(255, light + 3));
+        }
+    }
+    for (int k = 0; k < 12; ++k)
+    {
+        const cv::Point a(static_cast<int>(rng() % cols), static_cast<int>(rng() % rows));
+        const cv::Point b(static_cast<int>(rng() % cols), static_cast<int>(rng() % rows));
+        const int ink = static_cast<int>(rng() % 80);
+        cv::line(bgr, a, b, cv::Scalar(ink, ink, ink + 10), 1 + static_cast<int>(rng() % 3));
+    }
+    return bgr;
+}
+
+// 039：積分圖版 Sauvola / Niblack 對照逐像素掃視窗的版本。
+// 視窗和都是整數、門檻用同一個式子算，所以結果必須完全相同
+bool checkAdaptiveThreshold()
+{
+    const int before = failures;
+    const cv::Mat bgr = makePage(61, 97, 39);
+    const int rows = bgr.rows;
+    const int cols = bgr.cols;
+
+    cv::Mat lightness(rows, cols, CV_8UC1);
+    for (int y = 0; y < rows; ++y)
+    {
+        const uchar *p = bgr.ptr<uchar>(y);
+        for (int x = 0; x < cols; ++x, p += 3)
+            lightness.at<uchar>(y, x) = static_cast<uchar>((std::max({p[0], p[1], p[2]}) + std::min({p[0], p[1], p[2]}) + 1) >> 1);
+    }
+
+    const float params[][3] = {{3, 0.2f, 128}, {15, 0.34f, 128}, {31, 0.5f, 64}, {255, 0.2f, 128}, {15, 0.2f, 1}};
+    for (int method = 0; method < 2; ++method)
+    {
+        for (const auto &param : params)
+        {
+            cv::Mat fast(rows, cols, CV_8UC1);
+            computeAdaptiveMask(bgr, method, param, fast);
+
+            const int half = std::clamp(static_cast<int>(param[0]), 3, 255) / 2;
+            const double k = param[1];
+            const double range = std::max(1.0f, param[2]);
+            size_t mismatches = 0;
+            for (int y = 0; y < rows; ++y)
+            {
+                for (int x = 0; x < cols; ++x)
+                {
+                    uint64_t total = 0, total_sq = 0;
+                    const int y0 = std::max(0, y - half), y1 = std::min(rows, y + half + 1);
+                    const int x0 = std::max(0, x - half), x1 = std::min(cols, x + half + 1);
+                    for (int yy = y0; yy < y1; ++yy)
+                    {
+                        for (int xx = x0; xx < x1; ++xx)
+                        {
+                            const uint64_t v = lightness.at<uchar>(yy, xx);
+                            total += v;
+                            total_sq += v * v;
+                        }
+                    }
+                    const double n = static_cast<double>(y1 - y0) * (x1 - x0);
+                    const double mean = total / n;
+                    const double deviation = std::sqrt(std::max(0.0, total_sq / n - mean * mean));
+                    const double threshold = method == 0 ? mean * (1.0 + k * (deviation / range - 1.0)) : mean - k * deviation;
+                    const uchar expected = lightness.at<uchar>(y, x) >= threshold ? 255 : 0;
+                    mismatches += fast.at<uchar>(y, x) != expected;
+                }
+            }
+            if (mismatches > 0)
+                cerr << (method == 0 ? "Sauvola" : "Niblack") << " window " << param[0] << ": " << mismatches
+                     << " pixels differ from the reference" << endl;
+            CHECK(mismatches == 0);
+        }
+    }
+    return failures == before;
+}
+
+// 040：van Herk / Gil-Werman 的方形侵蝕 / 膨脹對照 cv::erode / cv::dilate（邊界外不影響結果）。
+// 偶數大小進位成奇數；也測就地（src 與 dst 同一張）的用法，applyMorphology 就是這樣呼叫的；
+// 最後確認超大的大小不會溢位
+bool checkMorphology()
+{
+    const int before = failures;
+    std::mt19937 rng(40);
+    cv::Mat mask(83, 131, CV_8UC1);
+    for (int y = 0; y < mask.rows; ++y)
+    {
+        uchar *row = mask.ptr<uchar>(y);
+        for (int x = 0; x < mask.cols; ++x)
+            row[x] = rng() % 3 == 0 ? 255 : 0;
+    }
+
+    for (int size : {2, 3, 4, 7, 15, 40})
+    {
+        const int w = 2 * (size / 2) + 1;
+        const cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(w, w));
+        cv::Mat expected_min, expected_max;
+        cv::erode(mask, expected_min, kernel);
+        cv::dilate(mask, expected_max, kernel);
+
+        cv::Mat eroded, dilated;
+        extremumFilter<false>(mask, eroded, size);
+        extremumFilter<true>(mask, dilated, size);
+        cv::Mat in_place = mask.clone();
+        extremumFilter<false>(in_place, in_place, size);
+
+        const int erode_diff = cv::countNonZero(eroded != expected_min);
+        const int dilate_diff = cv::countNonZero(dilated != expected_max);
+        const int in_place_diff = cv::countNonZero(in_place != expected_min);
+        if (erode_diff || dilate_diff || in_place_diff)
+            cerr << "size " << size << ": erode " << erode_diff << ", dilate " << dilate_diff << ", in place "
+                 << in_place_diff << " pixels differ from OpenCV" << endl;
+        CHECK(erode_diff == 0);
+        CHECK(dilate_diff == 0);
+        CHECK(in_place_diff == 0);
+    }
+
+    // 大小遠超過頁面時夾到頁面大小：視窗從每個像素都蓋住整頁，開運算把有空白的頁面清空
+    MorphologyOptions huge;
+    huge.open_size = INT_MAX;
+    huge.close_size = INT_MAX;
+    cv::Mat cleaned = mask.clone();
+    CHECK(applyMorphology(cleaned, huge) == cv::countNonZero(mask));
+    CHECK(cv::countNonZero(cleaned) == 0);
+    return failures == before;
+}
+
+// 043：只讀檔頭的格式與尺寸探測。用 OpenCV 編碼真的檔案，副檔名對與不對各存一份；
+// JPEG 另外在 SOI 後塞一個 40 KB 的 APP1，SOF 落在第一次讀進來的 64 bytes 之外
+bool checkImageProbe()
+{
+    const int before = failures;
+    const filesystem::path dir = filesystem::temp_directory_path() / ("hw_probe_check_" + std::to_string(currentProcessId()));
+    filesystem::create_directories(dir);
+    auto save = [&](const string &name, const vector<uchar> &bytes)
+    {
+        const string path = (dir / name).string();
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        return path;
+    };
+
+    const cv::Mat page = makePage(123, 321, 43);
+    struct Case
+    {
+        const char *ext;
+        const char *wrong_ext;
+        ImageFormat format;
+        vector<int> params;
+        bool has_size;
+    };
+    vector<Case> cases = {
+        {".png", ".jpg", ImageFormat::Png, {}, true},
+        {".jpg", ".png", ImageFormat::Jpeg, {}, true},
+        {".bmp", ".webp", ImageFormat::Bmp, {}, true},
+        {".tiff", ".bmp", ImageFormat::Tiff, {}, false},
+    };
+    if (cv::haveImageWriter(".webp"))
+    {
+        cases.push_back({".webp", ".png", ImageFormat::Webp, {cv::IMWRITE_WEBP_QUALITY, 80}, true});   // VP8
+        cases.push_back({".webp", ".jpeg", ImageFormat::Webp, {cv::IMWRITE_WEBP_QUALITY, 101}, true}); // VP8L
+    }
+
+    int n = 0;
+    for (const auto &c : cases)
+    {
+        vector<uchar> bytes;
+        if (!cv::imencode(c.ext, page, bytes, c.params))
+        {
+            cerr << "cannot encode " << c.ext << ", skipped" << endl;
+            continue;
+        }
+        const string name = "page" + std::to_string(n++);
+        for (const string &ext : {string(c.ext), string(c.wrong_ext)})
+        {
+            const string path = save(name + ext, bytes);
+            const ImageProbe probe = probeImageFile(path);
+            if (probe.format != c.format || (c.has_size && (probe.width != page.cols || probe.height != page.rows)))
+                cerr << path << ": probed " << imageFormatName(probe.format) << " " << probe.width << "x" << probe.height << endl;
+            CHECK(probe.format == c.format);
+            CHECK(!c.has_size || (probe.width == page.cols && probe.height == page.rows));
+            CHECK(extensionMatchesFormat(path, probe.format) == (ext == c.ext));
+        }
+    }
+
+    vector<uchar> jpeg;
+    CHECK(cv::imencode(".jpg", page, jpeg));
+    if (jpeg.size() > 2)
+    {
+        const size_t payload = 40000;
+        vector<uchar> app1 = {0xFF, 0xE1, static_cast<uchar>((payload + 2) >> 8), static_cast<uchar>((payload + 2) & 0xFF)};
+        app1.resize(app1.size() + payload, 0);
+        jpeg.insert(jpeg.begin() + 2, app1.begin(), app1.end());
+        const ImageProbe probe = probeImageFile(save("exif.jpg", jpeg));
+        CHECK(probe.format == ImageFormat::Jpeg && probe.width == page.cols && probe.height == page.rows);
+    }
+
+    // 不是影像、截斷的檔頭、不存在的檔案
+    const ImageProbe garbage = probeImageFile(save("garbage.png", vector<uchar>(100, 0x5A)));
+    CHECK(garbage.format == ImageFormat::Unknown && !garbage.hasSize());
+    const ImageProbe truncated = probeImageFile(save("truncated.png", {0x89, 'P', 'N', 'G'}));
+    CHECK(truncated.format == ImageFormat::Unknown);
+    CHECK(probeImageFile((dir / "missing.png").string()).format == ImageFormat::Unknown);
+
+    std::error_code ec;
+    filesystem::remove_all(dir, ec);
+    return failures == before;
+}
+
+// 每個點的叢集編號，編號改成依點第一次出現的順序，跟叢集在 CSR 裡的排列無關
+vector<int> canonicalLabels(size_t n, const ClusterCSR &clusters)
+{
+    vector<int> label(n, -1);
+    for (size_t c = 0; c < clusters.size(); ++c)
+        for (int idx : clusters[c])
+            label[idx] = static_cast<int>(c);
+    vector<int> id(clusters.size(), -1);
+    int next = 0;
+    for (int &l : label)
+    {
+        if (l < 0)
+            continue;
+        if (id[l] < 0)
+            id[l] = next++;
+        l = id[l];
+    }
+    return label;
+}
+
+// 029：整數座標叢集（int16 / int32，有開 AVX2 時走向量化的鄰居掃描）對照原本的 double 版本。
+// 整數距離平方 <= floor(r^2) 與 double 的 <= r^2 等價，所以分群必須完全相同。
+// 點有依 y 排序（findNonZero 的順序）與打亂兩種，半徑涵蓋 0、非整數、向量寬度的邊界，
+// 以及 int16 的 r^2 超過 int32、int32 的外框超過 32767 時改走純量的情況
+bool checkAvx2Clustering()
+{
+    const int before = failures;
+#ifdef __AVX2__
+    cout << "AVX2 kernels enabled" << endl;
+#else
+    cout << "AVX2 kernels not compiled in (ENABLE_AVX2=OFF), checking the scalar path" << endl;
+#endif
+    std::mt19937 rng(29);
+
+    struct Layout
+    {
+        const char *name;
+        int width;
+        int height;
+        size_t count;
+        bool sorted;
+    };
+    const Layout layouts[] = {
+        {"dense", 120, 90, 2500, true},
+        {"dense shuffled", 120, 90, 2500, false},
+        {"sparse", 1000, 700, 3000, true},
+        {"wide", 32767, 40, 3000, true}, // int16 的最大座標，|dx| 到 32766
+        {"huge", 60000, 50000, 2000, false},
+    };
+    for (const auto &layout : layouts)
+    {
+        vector<cv::Point> points;
+        for (size_t i = 0; i < layout.count; ++i)
+            points.emplace_back(static_cast<int>(rng() % layout.width), static_cast<int>(rng() % layout.height));
+        if (layout.sorted)
+            std::sort(points.begin(), points.end(), [](const cv::Point &a, const cv::Point &b)
+                      { return a.y != b.y ? a.y < b.y : a.x < b.x; });
+
+        MultithreadCluster reference_clusterer;
+        const auto reference_points = reference_clusterer.formCV(points);
+        for (double radius : {0.0, 1.0, 1.5, 2.0, 3.99, 7.5, 16.0, 40.7, 46341.0, 1e5})
+        {
+            const auto nested = reference_clusterer.cluster(reference_points, radius);
+            vector<int> expected(points.size(), -1);
+            for (size_t c = 0; c < nested.size(); ++c)
+                for (int idx : nested[c])
+                    expected[idx] = static_cast<int>(c);
+
+            auto compare = [&](const char *path, const ClusterCSR &clusters)
+            {
+                const vector<int> labels = canonicalLabels(points.size(), clusters);
+                const bool same = labels == expected;
+                if (!same)
+                    cerr << layout.name << ", radius " << radius << ": " << path << " gives " << clusters.size()
+                         << " clusters, double gives " << nested.size() << endl;
+                CHECK(same);
+            };
+
+            const bool fits_int16 = layout.width <= INT16_MAX && layout.height <= INT16_MAX;
+            if (fits_int16)
+            {
+                BasicMultithreadCluster<int16_t> clusterer;
+                BasicMultithreadCluster<int16_t>::PointSet soa;
+                clusterer.formCV(points, soa);
+                ClusterCSR clusters;
+                clusterer.cluster(soa, radius, clusters, std::pmr::get_default_resource());
+                compare("int16", clusters);
+            }
+            {
+                BasicMultithreadCluster<int32_t> clusterer;
+                BasicMultithreadCluster<int32_t>::PointSet soa;
+                clusterer.formCV(points, soa);
+                ClusterCSR clusters;
+                clusterer.cluster(soa, radius, clusters, std::pmr::get_default_resource());
+                compare("int32", clusters);
+            }
+            // clusterInkPoints 會先把半徑夾到頁面對角線，超過對角線時結果不變
+            ClusterCSR clusters;
+            clusterInkPoints(points, cv::Size(layout.width, layout.height), radius, clusters);
+            compare("clusterInkPoints", clusters);
+        }
+    }
+    return failures == before;
+}
+
+// 049：門檻一格一格調整時，增量叢集（reset 後連續 update）跟每次整頁重做的結果要完全相同。
+// 頁面先模糊過，筆畫邊緣是漸層，門檻升降會在邊緣加減一圈像素，降門檻時筆畫也會斷開
+bool checkIncrementalClustering()
+{
+    const int before = failures;
+    cv::Mat gray;
+    cv::cvtColor(makePage(157, 211, 49), gray, cv::COLOR_BGR2GRAY);
+    cv::GaussianBlur(gray, gray, cv::Size(5, 5), 0);
+
+    const int thresholds[] = {110, 111, 113, 113, 112, 108, 104, 100, 103, 109, 114, 119, 116};
+    for (double radius : {1.5, 3.0})
+    {
+        IncrementalClusterer incremental;
+        for (int threshold : thresholds)
+        {
+            cv::Mat ink;
+            cv::threshold(gray, ink, threshold, 255, cv::THRESH_BINARY_INV);
+            std::pmr::vector<cv::Point> expected_points;
+            gatherInkPoints(ink, expected_points);
+            ClusterCSR expected;
+            clusterInkPoints(expected_points, ink.size(), radius, expected);
+            if (!incremental.ready())
+            {
+                incremental.reset(ink, expected_points, expected, radius);
+                continue;
+            }
+
+            IncrementalClusterer::UpdateStats delta;
+            const bool updated = incremental.update(ink, 1.0, &delta);
+            CHECK(updated);
+            if (!updated)
+                continue;
+            vector<cv::Point> points;
+            ClusterCSR clusters;
+            incremental.extract(points, clusters);
+            const bool same_points =
+                std::equal(points.begin(), points.end(), expected_points.begin(), expected_points.end(),
+                           [](const cv::Point &a, const cv::Point &b) { return a.x == b.x && a.y == b.y; });
+            const bool same_clusters = same_points && canonicalLabels(points.size(), clusters) == canonicalLabels(expected_points.size(), expected);
+            if (!same_points || !same_clusters)
+                cerr << "radius " << radius << ", threshold " << threshold << ": " << points.size() << " points in "
+                     << clusters.size() << " clusters, expected " << expected_points.size() << " in " << expected.size()
+                     << " (+" << delta.added << " / -" << delta.removed << ")" << endl;
+            CHECK(same_points);
+            CHECK(same_clusters);
+        }
+    }
+    return failures == before;
+}
+
+// 037：.hwcl 寫入再讀回：表頭、頁表、外框、形心、run 與來源路徑都要跟寫入的一致，
+// run 展開回來的像素就是叢集的點。三種寫法都測：先收在記憶體再 write()、open() 之後邊做邊寫、
+// write() 之後再加頁與拿掉頁（追加到已提交的檔案）。截斷或損毀的檔案 open() 必須拒絕
+bool checkClusterFile()
+{
+    const int before = failures;
+    const filesystem::path dir = filesystem::temp_directory_path() / ("hw_cluster_file_check_" + std::to_string(currentProcessId()));
+    filesystem::create_directories(dir);
+
+    struct Page
+    {
+        string source;
+        cv::Size size;
+        std::pmr::vector<cv::Point> points;
+        ClusterCSR clusters;
+        std::pmr::vector<ClusterStats> stats;
+    };
+    auto makeClusteredPage = [](const string &source, int rows, int cols, uint32_t seed)
+    {
+        Page page;
+        page.source = source;
+        page.size = cv::Size(cols, rows);
+        cv::Mat gray, ink;
+        cv::cvtColor(makePage(rows, cols, seed), gray, cv::COLOR_BGR2GRAY);
+        cv::threshold(gray, ink, 100, 255, cv::THRESH_BINARY_INV);
+        gatherInkPoints(ink, page.points);
+        clusterInkPoints(page.points, page.size, 2.0, page.clusters);
+        computeClusterStats(page.points, page.clusters, page.stats);
+        return page;
+    };
+    vector<Page> pages;
+    pages.push_back(makeClusteredPage("scans/page-001.png", 97, 131, 371));
+    pages.push_back(makeClusteredPage("掃描/第二頁.webp", 64, 200, 372));
+    pages.push_back(makeClusteredPage("", 40, 50, 373));
+    pages.push_back(Page{"blank.png", cv::Size(30, 20), {}, ClusterCSR(), {}}); // 沒有叢集的頁面
+    pages.back().clusters.offsets.assign(1, 0);
+    CHECK(!pages[0].stats.empty() && !pages[1].stats.empty());
+
+    auto add = [](ClusterFileWriter &writer, const Page &page)
+    {
+        writer.addPage(page.source, page.size, page.points, page.clusters, page.stats);
+    };
+
+    // 讀回來逐頁比對；expected 是讀取端應該看到的頁面順序
+    auto verify = [&](const string &path, const vector<const Page *> &expected)
+    {
+        ClusterFileReader reader;
+        const bool opened = reader.open(path);
+        CHECK(opened);
+        if (!opened)
+            return;
+        CHECK(reader.pageCount() == expected.size());
+        for (size_t i = 0; i < std::min(reader.pageCount(), expected.size()); ++i)
+        {
+            const Page &page = *expected[i];
+            const ClusterFileReader::PageView view = reader.page(i);
+            CHECK(view.source == page.source);
+            CHECK(view.width == page.size.width && view.height == page.size.height);
+            CHECK(view.clusters.size() == page.clusters.size());
+            if (view.clusters.size() != page.clusters.size())
+                continue;
+            size_t mismatched = 0;
+            for (size_t c = 0; c < view.clusters.size(); ++c)
+            {
+                const ClusterRecord &r = view.clusters[c];
+                const ClusterStats &s = page.stats[c];
+                bool same = r.x == s.bbox.x && r.y == s.bbox.y && r.width == s.bbox.width && r.height == s.bbox.height &&
+                            r.centroid_x == s.centroid.x && r.centroid_y == s.centroid.y && r.size == s.size && r.line == -1;
+
+                vector<cv::Point> expected_pixels;
+                for (int idx : page.clusters[c])
+                    expected_pixels.push_back(page.points[idx]);
+                auto by_row = [](const cv::Point &a, const cv::Point &b) { return a.y != b.y ? a.y < b.y : a.x < b.x; };
+                std::sort(expected_pixels.begin(), expected_pixels.end(), by_row);
+                vector<cv::Point> pixels;
+                for (const PixelRun &run : view.runsOf(c))
+                {
+                    same = same && run.length > 0;
+                    for (int k = 0; k < run.length; ++k)
+                        pixels.emplace_back(run.x + k, run.y);
+                }
+                same = same && std::is_sorted(pixels.begin(), pixels.end(), by_row) && pixels == expected_pixels;
+                mismatched += !same;
+            }
+            if (mismatched)
+                cerr << path << " page " << i << ": " << mismatched << " of " << view.clusters.size()
+                     << " clusters differ from what was written" << endl;
+            CHECK(mismatched == 0);
+        }
+    };
+
+    // 先收在記憶體，write() 時一起寫
+    const string buffered_path = (dir / "buffered.hwcl").string();
+    {
+        ClusterFileWriter writer;
+        for (const Page &page : pages)
+            add(writer, page);
+        CHECK(writer.write(buffered_path));
+    }
+    verify(buffered_path, {&pages[0], &pages[1], &pages[2], &pages[3]});
+
+    // open() 之後邊做邊寫，再追加一頁、拿掉一頁後重寫
+    const string streamed_path = (dir / "streamed.hwcl").string();
+    {
+        ClusterFileWriter writer;
+        CHECK(writer.open(streamed_path));
+        add(writer, pages[0]);
+        add(writer, pages[1]);
+        CHECK(writer.write(streamed_path));
+        verify(streamed_path, {&pages[0], &pages[1]});
+
+        add(writer, pages[2]);
+        writer.removePage(pages[0].source);
+        CHECK(writer.pageCount() == 2);
+        CHECK(writer.write(streamed_path));
+    }
+    verify(streamed_path, {&pages[1], &pages[2]});
+
+    // 表頭 file_size 之後的資料（下一輪正在追加的內容）不影響讀取
+    vector<uchar> bytes;
+    CHECK(readFileBytes(buffered_path, bytes));
+    const string trailing_path = (dir / "trailing.hwcl").string();
+    {
+        vector<uchar> trailing = bytes;
+        trailing.resize(trailing.size() + 100, 0xAB);
+        ofstream(trailing_path, ios::binary).write(reinterpret_cast<const char *>(trailing.data()), static_cast<std::streamsize>(trailing.size()));
+    }
+    verify(trailing_path, {&pages[0], &pages[1], &pages[2], &pages[3]});
+
+    // 截斷與損毀
+    auto rejects = [&](const string &name, const vector<uchar> &content)
+    {
+        const string path = (dir / name).string();
+        ofstream(path, ios::binary | ios::trunc).write(reinterpret_cast<const char *>(content.data()), static_cast<std::streamsize>(content.size()));
+        ClusterFileReader reader;
+        const bool opened = reader.open(path);
+        if (opened)
+            cerr << name << ": accepted a damaged file" << endl;
+        CHECK(!opened);
+        CHECK(reader.pageCount() == 0);
+    };
+    if (bytes.size() > sizeof(ClusterFileHeader))
+    {
+        ClusterFileHeader header;
+        memcpy(&header, bytes.data(), sizeof(header));
+        rejects("empty.hwcl", {});
+        rejects("header_only.hwcl", vector<uchar>(bytes.begin(), bytes.begin() + sizeof(ClusterFileHeader) - 1));
+        rejects("half.hwcl", vector<uchar>(bytes.begin(), bytes.begin() + bytes.size() / 2));
+        rejects("minus_one.hwcl", vector<uchar>(bytes.begin(), bytes.end() - 1));
+
+        auto patched = [&](auto &&edit)
+        {
+            vector<uchar> copy = bytes;
+            edit(copy);
+            return copy;
+        };
+        rejects("magic.hwcl", patched([](vector<uchar> &b) { b[0] = 'X'; }));
+        rejects("version.hwcl", patched([](vector<uchar> &b)
+        {
+            const uint32_t version = cluster_file_version + 1;
+            memcpy(b.data() + offsetof(ClusterFileHeader, version), &version, sizeof(version));
+        }));
+        rejects("page_count.hwcl", patched([&](vector<uchar> &b)
+        {
+            const uint32_t count = header.page_count + 1000;
+            memcpy(b.data() + offsetof(ClusterFileHeader, page_count), &count, sizeof(count));
+        }));
+        rejects("page_table.hwcl", patched([&](vector<uchar> &b)
+        {
+            const uint64_t offset = header.page_table_offset + 4; // 不對齊
+            memcpy(b.data() + offsetof(ClusterFileHeader, page_table_offset), &offset, sizeof(offset));
+        }));
+        const size_t entry0 = static_cast<size_t>(header.page_table_offset);
+        rejects("page_offset.hwcl", patched([&](vector<uchar> &b)
+        {
+            const uint64_t offset = header.file_size;
+            memcpy(b.data() + entry0 + offsetof(ClusterFilePage, offset), &offset, sizeof(offset));
+        }));
+        rejects("run_count.hwcl", patched([&](vector<uchar> &b)
+        {
+            const uint32_t runs = 0xFFFFFFF0u;
+            memcpy(b.data() + entry0 + offsetof(ClusterFilePage, run_count), &runs, sizeof(runs));
+        }));
+        rejects("source.hwcl", patched([&](vector<uchar> &b)
+        {
+            const uint32_t length = 1u << 30;
+            memcpy(b.data() + entry0 + offsetof(ClusterFilePage, source_length), &length, sizeof(length));
+        }));
+        rejects("first_run.hwcl", patched([&](vector<uchar> &b)
+        {
+            ClusterFilePage entry;
+            memcpy(&entry, b.data() + entry0, sizeof(entry));
+            const uint32_t first_run = entry.run_count; // 第一個叢集的 run 超出該頁
+            memcpy(b.data() + entry.offset + offsetof(ClusterRecord, first_run), &first_run, sizeof(first_run));
+        }));
+    }
+    CHECK(!ClusterFileReader().open((dir / "missing.hwcl").string()));
+
+    std::error_code ec;
+    filesystem::remove_all(dir, ec);
+    return failures == before;
+}
+
+struct Check
+{
+    const char *name;
+    bool (*run)();
+};
+
+const Check checks[] = {
+    {"adaptive_threshold", checkAdaptiveThreshold},
+    {"morphology", checkMorphology},
+    {"image_probe", checkImageProbe},
+    {"incremental_clustering", checkIncrementalClustering},
+    {"avx2_clustering", checkAvx2Clustering},
+    {"cluster_file", checkClusterFile},
+};
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const string only = argc > 1 ? argv[1] : "";
+    bool found = false;
+    for (const auto &check : checks)
+    {
+        if (!only.empty() && only != check.name)
+            continue;
+        found = true;
+        const bool ok = check.run();
+        cout << (ok ? "[ OK ] " : "[FAIL] ") << check.name << endl;
+    }
+    if (!found)
+    {
+        cerr << "Unknown check: " << only << endl;
+        return 2;
+    }
+    return failures == 0 ? 0 : 1;
+}